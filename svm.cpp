@@ -4,22 +4,23 @@
  * Quite appreciate "CPython Virtual Machine", from which I learnt a lot.
  *
  * Usage:
- * $ g++ svm.cpp -o svm
- * $ svm -r (-e) ./helloworld.slb (-v) (-p password) -- Run program (-v: in verbose mode, -e: performance evaluator)
+ * $ g++ svm.cpp -o svm -pthread
+ * $ svm -r (-e (-f) (-P profile)) ./helloworld.slb (-v) (-g) (-p password) (-j threads) (-s snapshot) (-m module.slb ...) (-k MB) (-t trace) (-l limit=value ...) (-w stats) (-M) -- Run program (-v: in verbose mode, -g: debugger, -e: performance evaluator, -f: with -e, counters per function, -P: with -e, record a profile for svm -O, -j: task threads, -s: start from/save a post-initialisation snapshot, -m: link more modules, -k: stack limit of each coroutine, 64 by default, -t: record an execution trace, -l: quota, one of ins=instructions, time=seconds, mem=MB, depth=calls, -w: count instructions for the statistics printed on SIGUSR1, and append them to a file (- for stderr), -M: memoise every pure function)
  * $ svm -d ./helloworld.slb (-p password) -- Disassembly
  * $ svm -i (-v) (-e) -- Interact Mode (-v: in verbose mode, -e: performance evaluator)
- * $ svm -a ./helloworld.txt -o ./helloworld.slb (-p password) -- Assembly input file
+ * $ svm -a ./helloworld.txt -o ./helloworld.slb (-p password) (-v) -- Assembly input file (-v: show progress)
+ * $ svm -O ./helloworld.slb -o ./helloworld.opt.slb (-p password) (-P profile) -- Optimise bytecode (.sli or .slb input, -P: guided by a profile)
+ * $ svm -x ./trace.bin (-v) -- Decode an execution trace (-v: every record instead of a summary)
+ * $ svm -c ./helloworld.slb -o ./helloworld.cpp (-p password) (-m module.slb ...) -- Translate to C++, then build with g++ -O2 -pthread -I <directory of svm.cpp> helloworld.cpp -o helloworld
  *
  * @author Junru Shen
  */
 #define MAGIC "80JF34R9S "
-#define MAX_INSTRUCTION_NUM 1000000
-#define MAX_INSTRUCTION_ADDR 2000000
 #define MEM_DBG
 #undef MEM_DBG
-#define OP_POP() (*operands)[(*op_top_ptr)--]
-#define OP_TOP() (*operands)[*op_top_ptr]
-#define OP_PUSH(slot) (*operands)[++(*op_top_ptr)] = slot
+#define OP_POP() operands[(*op_top_ptr)--]
+#define OP_TOP() operands[*op_top_ptr]
+#define OP_PUSH(slot) operands[++(*op_top_ptr)] = slot
 #ifdef MEM_DBG
 #define SLOT_INCREF(slot, reason)                                       \
     do {                                                                \
@@ -30,7 +31,8 @@
 #else
 #define SLOT_INCREF(slot, reason)                                       \
     do {                                                                \
-        slot->ref_cnt++;                                                \
+        if (vm_threaded) __atomic_add_fetch(&slot->ref_cnt, 1, __ATOMIC_RELAXED); \
+        else slot->ref_cnt++;                                           \
     } while (0)
 #endif
 #ifdef MEM_DBG
@@ -50,26 +52,18 @@
 #define SLOT_DECREF(slot, reason)                                       \
   do {                                                                  \
     if (slot == nullptr) break;                                         \
-    slot->ref_cnt--;                                                    \
-    if (!slot->ref_cnt) {                                               \
+    if (!SLOT_DEC(slot)) {                                              \
         RELEASE(slot);                                                  \
     }                                                                   \
   } while (0)
 #endif
+// Decrease and fetch a reference count, atomically once tasks may share slots
+#define SLOT_DEC(slot) \
+    (vm_threaded ? __atomic_sub_fetch(&(slot)->ref_cnt, 1, __ATOMIC_ACQ_REL) : --(slot)->ref_cnt)
 
 #define RELEASE(slot) \
 do { \
     if (slot == nullptr) break; \
-    if (slot->type == ARRAY) { \
-        for (int i = 0; i < slot->array_size; i++) { \
-            slot->array_val[i]->ref_cnt--; \
-            if (!slot->array_val[i]->ref_cnt) { \
-                if (slot->array_val[i] == nullptr) continue; \
-                delete slot->array_val[i]; \
-                slot->array_val[i] = nullptr; \
-            } \
-        } \
-    } \
     delete slot; \
     slot = nullptr; \
 } while (0)
@@ -90,17 +84,279 @@ typedef char char_tp;
 #include <string>
 #include <sstream>
 #include <unordered_map>
+#include <set>
 #include <getopt.h>
 #include <ctime>
 #include <iomanip>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <climits>
+#include <type_traits>
+#include <vector>
+#include <new>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <poll.h>
+#include <unistd.h>
+#include <csignal>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Set before dispatch when the program spawns tasks; switches reference counting to atomic operations
+bool vm_threaded = false;
+
+void trace_dump();
+std::string panic_location();
+void report_stack_overflow();
 
 void panic(const std::string& msg) {
-    std::cout << "Runtime error: " << msg << std::endl;
+    std::cout << "Runtime error: " << msg << panic_location() << std::endl;
     std::cout << "Enter verbose mode to see details." << std::endl;
     std::cout << "ABORTING..." << std::endl;
+    trace_dump();
     abort();
 }
 
+// Quotas for untrusted programs (-l)
+//
+// Instructions are not counted one by one. Each machine charges the span of instructions it ran since the
+// previous checkpoint (taken jumps, calls, returns, coroutine switches) against a local block of fuel, and
+// takes the next block from the shared pool when that runs out; the wall-clock limit is checked at the same
+// time. Memory is the bytes of array elements plus the slot pool, counted as they are allocated.
+// The checkpoints also keep the instruction count for the live statistics (-w).
+struct Quota {
+    static const long long FUEL_BLOCK = 1 << 16;
+    // 0: no limit
+    static long long instructions;
+    static double seconds;
+    static long long memory;
+    static int depth;
+    // Checkpoints are on: some limit is set, or instructions are counted for the live statistics
+    static bool on;
+    // Memory is counted: there is a memory limit, or for the live statistics
+    static bool metered;
+    static std::atomic<long long> fuel_left;
+    static std::atomic<long long> memory_used;
+    static timespec started;
+
+    static void start(bool count) {
+        on = count || instructions || seconds > 0 || memory || depth;
+        metered = count || memory;
+        fuel_left = instructions ? instructions : LLONG_MAX;
+        clock_gettime(CLOCK_MONOTONIC, &started);
+    }
+
+    static double elapsed() {
+        timespec now{};
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (double) (now.tv_sec - started.tv_sec) + (double) (now.tv_nsec - started.tv_nsec) * 1e-9;
+    }
+
+    static void exceeded(const std::string &what) {
+        long long used = instructions ? instructions - std::max(0LL, fuel_left.load()) : 0;
+        std::stringstream stats;
+        stats << "Quota exceeded: " << what << " (";
+        if (instructions) stats << "about " << used << " instructions, ";
+        stats << std::fixed << std::setprecision(3) << elapsed() << "s";
+        if (metered) stats << ", " << memory_used.load() / 1024 << "KB";
+        stats << ")";
+        panic(stats.str());
+    }
+
+    // Next block of fuel for a machine
+    static long long refuel() {
+        if (seconds > 0 && elapsed() > seconds) exceeded("wall time limit");
+        long long left = fuel_left.fetch_sub(FUEL_BLOCK, std::memory_order_relaxed);
+        if (left <= 0) exceeded("instruction limit");
+        return std::min(left, FUEL_BLOCK);
+    }
+
+    static void allocate(size_t bytes) {
+        if (!metered) return;
+        long long now = memory_used.fetch_add((long long) bytes, std::memory_order_relaxed) + (long long) bytes;
+        if (memory && now > memory) {
+            memory_used.fetch_sub((long long) bytes, std::memory_order_relaxed);
+            exceeded("memory limit, " + std::to_string(bytes / 1024) + "KB more requested");
+        }
+    }
+
+    static void release(size_t bytes) {
+        if (!metered) return;
+        memory_used.fetch_sub((long long) bytes, std::memory_order_relaxed);
+    }
+};
+
+const long long Quota::FUEL_BLOCK;
+long long Quota::instructions = 0;
+double Quota::seconds = 0;
+long long Quota::memory = 0;
+int Quota::depth = 0;
+std::atomic<long long> Quota::fuel_left{LLONG_MAX};
+std::atomic<long long> Quota::memory_used{0};
+bool Quota::on = false;
+bool Quota::metered = false;
+timespec Quota::started{};
+
+// Live statistics (SIGUSR1)
+//
+// Everything is counted only with -w, as it slows down call-heavy code by several percent. Each thread counts
+// the slots it allocates and frees, and the handler adds up the counters of all threads; a slot freed by
+// another thread than the one that made it still nets out. Instructions are counted by the quota
+// checkpoints. Whenever the main machine takes a block of fuel, it publishes its instruction count, position,
+// call depth and operand stack depth, and samples the clock at most every SAMPLE_NS for the MIPS of about
+// the last second. The handler only loads these atomics, formats them into a fixed buffer and writes it with
+// one write(); the machine itself is never read, so what it shows is as of the last block of fuel.
+struct LiveStats {
+    static const int MAX_THREADS = 256;
+    static const int WINDOW = 16;
+    static const long long SAMPLE_NS = 1000000000LL / WINDOW;
+    // stderr, or the file given with -w
+    static int fd;
+    static bool counting;
+    // Written by its own thread only, so counting is a plain load and store
+    static thread_local std::atomic<long long> slots;
+    static std::atomic<std::atomic<long long> *> slot_counters[MAX_THREADS];
+    static std::atomic<long long> retired_slots;
+    static std::atomic<long long> arrays;
+    static std::atomic<long long> sample_ns[WINDOW], sample_ins[WINDOW];
+    static std::atomic<int> samples;
+    // Published by the main machine; ip is -1 while it is not running
+    static std::atomic<long long> published_ins;
+    static std::atomic<int> published_ip, published_depth, published_operands;
+
+    static long long now_ns() {
+        timespec now{};
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec * 1000000000LL + now.tv_nsec;
+    }
+
+    // Threads running a machine; returns the place to give back to leave_thread
+    static int enter_thread() {
+        for (int k = 0; k < MAX_THREADS; k++) {
+            std::atomic<long long> *none = nullptr;
+            if (slot_counters[k].compare_exchange_strong(none, &slots)) return k;
+        }
+        return -1;
+    }
+
+    static void leave_thread(int k) {
+        if (k < 0) return;
+        retired_slots.fetch_add(slots.load(std::memory_order_relaxed));
+        slot_counters[k].store(nullptr);
+    }
+
+    static void count_slot(int delta) {
+        slots.store(slots.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+
+    static long long live_slots() {
+        long long n = retired_slots.load();
+        for (auto &c : slot_counters) {
+            auto *counter = c.load();
+            if (counter != nullptr) n += counter->load(std::memory_order_relaxed);
+        }
+        return n;
+    }
+
+    // Instructions executed so far by the main machine, at ip
+    static void publish(long long ins, int ip, int depth, int operands) {
+        published_ins.store(ins, std::memory_order_relaxed);
+        published_ip.store(ip, std::memory_order_relaxed);
+        published_depth.store(depth, std::memory_order_relaxed);
+        published_operands.store(operands, std::memory_order_relaxed);
+        long long now = now_ns();
+        int n = samples.load(std::memory_order_relaxed);
+        if (n > 0 && now - sample_ns[(n - 1) % WINDOW].load(std::memory_order_relaxed) < SAMPLE_NS) return;
+        sample_ns[n % WINDOW].store(now, std::memory_order_relaxed);
+        sample_ins[n % WINDOW].store(ins, std::memory_order_relaxed);
+        samples.store(n + 1);
+    }
+
+    // Instructions per microsecond, times 100, since the last sample at least a second old (else the oldest)
+    static long long mips_x100(long long ins) {
+        long long now = now_ns();
+        int n = samples.load(), from = -1;
+        for (int k = std::max(0, n - WINDOW); k < n; k++) {
+            if (from < 0 || now - sample_ns[k % WINDOW].load(std::memory_order_relaxed) >= 1000000000LL) from = k;
+        }
+        if (from < 0) return 0;
+        long long from_ns = sample_ns[from % WINDOW].load(std::memory_order_relaxed);
+        if (now <= from_ns) return 0;
+        return (ins - sample_ins[from % WINDOW].load(std::memory_order_relaxed)) * 100000 / (now - from_ns);
+    }
+
+    // One line of output, built without allocating
+    struct line {
+        char buf[1024];
+        size_t len = 0;
+
+        void put(const char *s) {
+            while (*s && len < sizeof(buf) - 1) buf[len++] = *s++;
+        }
+
+        void put(const std::string &s) {
+            put(s.c_str());
+        }
+
+        void put_int(long long v) {
+            char tmp[24];
+            int i = sizeof(tmp);
+            tmp[--i] = 0;
+            unsigned long long u = v < 0 ? 0ULL - (unsigned long long) v : (unsigned long long) v;
+            do {
+                tmp[--i] = (char) ('0' + u % 10);
+                u /= 10;
+            } while (u);
+            if (v < 0) tmp[--i] = '-';
+            put(tmp + i);
+        }
+
+        // v / 100 with two decimals
+        void put_fixed2(long long v) {
+            put_int(v / 100);
+            put(v % 100 < 10 ? ".0" : ".");
+            put_int(v % 100);
+        }
+
+        void flush(int to = fd) {
+            buf[len++] = '\n';
+            ssize_t n = write(to, buf, len);
+            (void) n;
+        }
+    };
+};
+
+const int LiveStats::MAX_THREADS;
+const int LiveStats::WINDOW;
+const long long LiveStats::SAMPLE_NS;
+int LiveStats::fd = 2;
+bool LiveStats::counting = false;
+thread_local std::atomic<long long> LiveStats::slots{0};
+std::atomic<std::atomic<long long> *> LiveStats::slot_counters[MAX_THREADS]{};
+std::atomic<long long> LiveStats::retired_slots{0};
+std::atomic<long long> LiveStats::arrays{0};
+std::atomic<long long> LiveStats::sample_ns[WINDOW]{};
+std::atomic<long long> LiveStats::sample_ins[WINDOW]{};
+std::atomic<int> LiveStats::samples{0};
+std::atomic<long long> LiveStats::published_ins{0};
+std::atomic<int> LiveStats::published_ip{-1};
+std::atomic<int> LiveStats::published_depth{0};
+std::atomic<int> LiveStats::published_operands{0};
+
 // Instruction codes
 enum instruct_code {
     CMALLOC,
@@ -147,7 +403,51 @@ enum instruct_code {
     PRINTK,
     // Basic I/O
     PUTCH,
-    GETCH
+    GETCH,
+    // Native intrinsics
+    CALL_NATIVE,
+    // Subscripts proven in bounds by the optimiser
+    BINARY_SUBSCR_UNCHECKED,
+    STORE_SUBSCR_UNCHECKED,
+    // Parallel tasks
+    SPAWN,
+    SPAWN_CALL,
+    JOIN,
+    // Coroutines
+    COROUTINE,
+    COROUTINE_CALL,
+    RESUME,
+    YIELD,
+    CO_STATUS,
+    SCHEDULE,
+    COROUTINE_END,
+    // Strings
+    LOAD_STRING,
+    // Multi-dimensional arrays
+    SUBSCR_2D,
+    STORE_SUBSCR_2D,
+    // Patched over an instruction by the debugger (-g); never appears in bytecode files
+    BREAKPOINT,
+    // Module symbols, read by the loader like CONSTANT: `addr EXPORT name` exports the function at addr;
+    // `addr IMPORT name` makes addr stand for a function exported by another module
+    EXPORT,
+    IMPORT,
+    // Hash maps
+    BUILD_MAP,
+    MAP_GET,
+    MAP_PUT,
+    MAP_DEL,
+    MAP_HAS,
+    MAP_SIZE,
+    // Call taking its arguments from the caller's operand stack; made by the loader from PUSH; CALL
+    CALL_ARGS,
+    // BINARY_OP seen only with two ints in a profile (-O -P); still handles any operands
+    BINARY_OP_INT,
+    // Debug section, read by the loader like EXPORT (see SourceMap)
+    FUNCTION,
+    LINE,
+    // Pragma, read by the loader like EXPORT: `addr MEMO` memoises the function at addr (see memo_cache)
+    MEMO
 };
 
 // Basic data types
@@ -156,19 +456,43 @@ enum basic_data_types {
     FLOAT,
     CHAR,
     VOID,
-    ARRAY
+    ARRAY,
+    MAP
 };
 
 // Slot
+#define SMALL_STRING_SIZE 15
+
+struct hash_map;
+
+void free_map(hash_map *m);
+
+int map_size(const hash_map *m);
+
 struct slot {
     basic_data_types type = VOID;
-    int_tp int_val{};
-    float_tp float_val{};
-    char_tp char_val{};
-    slot **array_val{};
+    int ref_cnt = 1;
+    // Char arrays (strings) up to SMALL_STRING_SIZE chars are stored inline, over the scalar values an array
+    // does not use, so that scalar slots stay as small as they were
+    union {
+        struct {
+            int_tp int_val{};
+            float_tp float_val{};
+        };
+        char_tp small_chars[SMALL_STRING_SIZE];
+    };
+    // Array elements are stored unboxed and contiguously: int_tp, float_tp or char_tp by arr_element_type
+    void *array_val{};
     int array_size{};
     basic_data_types arr_element_type = VOID;
-    int ref_cnt = 1;
+    // Multi-dimensional arrays are stored flat in row-major order; shape[0] is the number of dimensions,
+    // followed by the extent of each one. nullptr for 1-d arrays.
+    int *shape{};
+    // A slot is a char or a map, never both
+    union {
+        char_tp char_val;
+        hash_map *map_val{};
+    };
 
     explicit slot(int_tp _int_val) : int_val(_int_val), type(INT) {}
 
@@ -178,6 +502,8 @@ struct slot {
 
     explicit slot(char_tp _char_val) : char_val(_char_val), type(CHAR) {}
 
+    explicit slot(hash_map *_map_val) : type(MAP), map_val(_map_val) {}
+
     slot(int _array_size, basic_data_types _type) {
         if (_type == ARRAY || _type == VOID) {
             // do not support nested array
@@ -185,33 +511,149 @@ struct slot {
         }
         type = ARRAY;
         array_size = _array_size;
-        array_val = new slot *[array_size];
-        for (int i = 0; i < array_size; i++) {
-            slot *fill_slot = nullptr;
-            switch (_type) {
-                case INT:
-                    fill_slot = new slot((int_tp) 0);
-                    arr_element_type = INT;
-                    break;
-                case FLOAT:
-                    fill_slot = new slot((float_tp) 0.0);
-                    arr_element_type = FLOAT;
-                    break;
-                case CHAR:
-                    fill_slot = new slot((char) '\0');
-                    arr_element_type = CHAR;
-                    break;
-                default:
-                    panic("Unsupported type here");
-                    break;
-            }
-            *(array_val + i) = fill_slot;
-            SLOT_INCREF(fill_slot, "array initialize");
+        arr_element_type = _type;
+        if (LiveStats::counting) LiveStats::arrays.fetch_add(1, std::memory_order_relaxed);
+        switch (_type) {
+            case INT:
+                Quota::allocate(array_size * sizeof(int_tp));
+                array_val = new int_tp[array_size]();
+                break;
+            case FLOAT:
+                Quota::allocate(array_size * sizeof(float_tp));
+                array_val = new float_tp[array_size]();
+                break;
+            case CHAR:
+                if (array_size <= SMALL_STRING_SIZE) {
+                    memset(small_chars, 0, sizeof(small_chars));
+                    array_val = small_chars;
+                } else {
+                    Quota::allocate(array_size * sizeof(char_tp));
+                    array_val = new char_tp[array_size]();
+                }
+                break;
+            default:
+                panic("Unsupported type here");
+                break;
+        }
+    }
+
+    ~slot() {
+        if (type == MAP) free_map(map_val);
+        if (type != ARRAY) return;
+        if (LiveStats::counting) LiveStats::arrays.fetch_sub(1, std::memory_order_relaxed);
+        delete[] shape;
+        if (array_val != small_chars) Quota::release(array_size * element_size());
+        switch (arr_element_type) {
+            case INT:
+                delete[] ints();
+                break;
+            case FLOAT:
+                delete[] floats();
+                break;
+            default:
+                if (array_val != small_chars) delete[] chars();
+                break;
+        }
+    }
+
+    int_tp *ints() {
+        return (int_tp *) array_val;
+    }
+
+    float_tp *floats() {
+        return (float_tp *) array_val;
+    }
+
+    char_tp *chars() {
+        return (char_tp *) array_val;
+    }
+
+    // A new slot holding a copy of element i
+    slot *element(int i) {
+        switch (arr_element_type) {
+            case INT:
+                return new slot(ints()[i]);
+            case FLOAT:
+                return new slot(floats()[i]);
+            default:
+                return new slot(chars()[i]);
+        }
+    }
+
+    // Scalar value converted to another type
+    int_tp as_int() const {
+        return type == FLOAT ? (int_tp) float_val : type == CHAR ? (int_tp) char_val : int_val;
+    }
+
+    float_tp as_float() const {
+        return type == INT ? (float_tp) int_val : type == CHAR ? (float_tp) char_val : float_val;
+    }
+
+    char_tp as_char() const {
+        return type == INT ? (char_tp) int_val : char_val;
+    }
+
+    // Store the value of val (converted to the element type) into element i
+    void set_element(int i, const slot *val) {
+        switch (arr_element_type) {
+            case INT:
+                ints()[i] = val->as_int();
+                break;
+            case FLOAT:
+                floats()[i] = val->as_float();
+                break;
+            default:
+                chars()[i] = val->as_char();
+                break;
+        }
+    }
+
+    // Flat index of [i][j]. With a row stride, the array is indexed as flat storage (only the flat index is
+    // checked, like i * stride + j would be); without one, it must be 2-d and each index is checked.
+    int index_2d(int_tp i, int_tp j, int stride) const {
+        int_tp k;
+        if (stride > 0) {
+            k = i * stride + j;
+            if (k < 0 || k >= array_size) panic("Array index out of bound");
+            return (int) k;
+        }
+        if (shape == nullptr || shape[0] != 2) {
+            panic("Two subscripts on an array that is not 2-d");
+        }
+        if (i < 0 || i >= shape[1] || j < 0 || j >= shape[2]) {
+            panic("Array index out of bound");
         }
+        return (int) (i * shape[2] + j);
+    }
+
+    size_t element_size() const {
+        return arr_element_type == INT ? sizeof(int_tp) : arr_element_type == FLOAT ? sizeof(float_tp) : sizeof(char_tp);
     }
 
     slot() = default;
 
+    slot(const slot &) = delete;
+
+    // Slots are created and freed for nearly every instruction; freed ones are kept on a per-thread free list
+    static thread_local void *free_list;
+
+    static void *operator new(size_t size) {
+        void *p = free_list;
+        if (LiveStats::counting) LiveStats::count_slot(1);
+        if (p == nullptr) {
+            Quota::allocate(size);
+            return ::operator new(size);
+        }
+        free_list = *(void **) p;
+        return p;
+    }
+
+    static void operator delete(void *p) {
+        if (LiveStats::counting) LiveStats::count_slot(-1);
+        *(void **) p = free_list;
+        free_list = p;
+    }
+
     std::string as_string() {
         std::stringstream res;
         std::string ret;
@@ -228,6 +670,9 @@ struct slot {
             case ARRAY:
                 res << "array[" << array_size << "]";
                 break;
+            case MAP:
+                res << "map[" << map_size(map_val) << "]";
+                break;
             case VOID:
                 res << "(null)";
                 break;
@@ -237,1019 +682,6695 @@ struct slot {
     }
 };
 
-typedef slot *T_OPSTACK[2000];
-typedef slot **T_VARIABLES;
-
-// Instruction = Code + no more than 1 operand
-struct instruct {
-    instruct_code code = NOOP;
-    int operand{};
-    int address = -1;
-
-    instruct(int _addr, instruct_code _code, int _operand) : address(_addr), code(_code), operand(_operand) {}
+thread_local void *slot::free_list = nullptr;
 
-    instruct(int _addr, instruct_code _code) : address(_addr), code(_code) {}
+// String constants (CONSTANT type 4) keep their bytes hex-encoded, so that they stay a single token
+std::string hex_encode(const std::string &bytes) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    for (unsigned char c : bytes) {
+        hex += digits[c >> 4];
+        hex += digits[c & 15];
+    }
+    return hex;
+}
 
-    instruct() = default;
-};
+int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
 
-// Stack frame
-struct frame {
-    T_VARIABLES locals{};
-    int var_cnt = 0;
-    int return_ip{};
-    T_OPSTACK local_operands{};
-    int op_top = -1;
-    frame *caller;
+// Decodes hex into bytes; false if hex has an odd length or a non-hex digit
+bool hex_decode(const std::string &hex, std::string &bytes) {
+    if (hex.size() % 2) return false;
+    bytes.clear();
+    for (size_t i = 0; i < hex.size(); i += 2) {
+        int hi = hex_digit(hex[i]), lo = hex_digit(hex[i + 1]);
+        if (hi < 0 || lo < 0) return false;
+        bytes += (char) (hi << 4 | lo);
+    }
+    return true;
+}
 
-    explicit frame(frame *_caller) : caller(_caller) {}
-};
+slot *string_slot(const char_tp *chars, int size) {
+    auto *res = new slot(size, CHAR);
+    memcpy(res->chars(), chars, size);
+    return res;
+}
 
-instruct instructs[MAX_INSTRUCTION_NUM]; // Instructions
-int addrs[MAX_INSTRUCTION_ADDR + 1];
-slot **constants;
-T_VARIABLES globals;
-int var_cnt = 0;
-int constant_cnt = 0;
-T_OPSTACK global_operands;
+void trace_input(int c);
 
-// Virtual Machine
-class Machine {
+// Standard input of the VM. In run mode fd 0 is read directly through this buffer, so a
+// coroutine can check whether a read would block and park instead. In interact mode the
+// program itself comes through std::cin, so input goes through stdio and reads always block.
+class VMInput {
 private:
-    int ins_cnt{};
-    frame *esp{};
-    int op_top;
-    int ip{};
-    bool verbose = false;
-    bool evaluator = false;
-    long long int n_ins = 0;
-    T_OPSTACK *operands{};
-    int *op_top_ptr{};
+    char buf[4096]{};
+    int pos = 0, len = 0;
+    bool eof = false;
+    std::mutex lock;
 
 public:
-    static std::unordered_map<std::string, instruct_code> string_inscode_mapping;
-    static int inscode_param_cnt_mapping[200];
+    bool use_stdio = false;
 
-    static void load_name_code_mapping() {
-        string_inscode_mapping["CMALLOC"] = CMALLOC;
-        string_inscode_mapping["VMALLOC"] = VMALLOC;
-        string_inscode_mapping["CONSTANT"] = CONSTANT;
-        string_inscode_mapping["LOAD_CONSTANT"] = LOAD_CONSTANT;
-        string_inscode_mapping["POP_OP"] = POP_OP;
-        string_inscode_mapping["NOOP"] = NOOP;
-        string_inscode_mapping["LOAD_NULL"] = LOAD_NULL;
-        string_inscode_mapping["LOAD_NAME"] = LOAD_NAME;
-        string_inscode_mapping["LOAD_NAME_GLOBAL"] = LOAD_NAME_GLOBAL;
-        string_inscode_mapping["LOAD_INT"] = LOAD_INT;
-        string_inscode_mapping["LOAD_FLOAT"] = LOAD_FLOAT;
-        string_inscode_mapping["LOAD_CHAR"] = LOAD_CHAR;
-        string_inscode_mapping["STORE_NAME"] = STORE_NAME;
-        string_inscode_mapping["STORE_NAME_GLOBAL"] = STORE_NAME_GLOBAL;
-        string_inscode_mapping["STORE_NAME_NOPOP"] = STORE_NAME_NOPOP;
-        string_inscode_mapping["STORE_NAME_GLOBAL_NOPOP"] = STORE_NAME_GLOBAL_NOPOP;
-        string_inscode_mapping["JMP"] = JMP;
-        string_inscode_mapping["JMP_TRUE"] = JMP_TRUE;
-        string_inscode_mapping["JMP_FALSE"] = JMP_FALSE;
-        string_inscode_mapping["BINARY_OP"] = BINARY_OP;
-        string_inscode_mapping["UNARY_OP"] = UNARY_OP;
-        string_inscode_mapping["HALT"] = HALT;
-        string_inscode_mapping["RET"] = RET;
-        string_inscode_mapping["PUSH"] = PUSH;
-        string_inscode_mapping["CALL"] = CALL;
-        string_inscode_mapping["LOAD_GLOBAL"] = LOAD_GLOBAL;
-        string_inscode_mapping["STORE_GLOBAL"] = STORE_GLOBAL;
-        string_inscode_mapping["BUILD_ARR"] = BUILD_ARR;
-        string_inscode_mapping["TYPE_CVT"] = TYPE_CVT;
-        string_inscode_mapping["BINARY_SUBSCR"] = BINARY_SUBSCR;
-        string_inscode_mapping["STORE_SUBSCR"] = STORE_SUBSCR;
-        string_inscode_mapping["STORE_SUBSCR_INPLACE"] = STORE_SUBSCR_INPLACE;
-        string_inscode_mapping["STORE_SUBSCR_NOPOP"] = STORE_SUBSCR_NOPOP;
-        string_inscode_mapping["PRINTK"] = PRINTK;
-        string_inscode_mapping["PUTCH"] = PUTCH;
-        string_inscode_mapping["GETCH"] = GETCH;
-        string_inscode_mapping["SIZE_OF"] = SIZE_OF;
+    // A read would not block
+    bool ready() {
+        std::lock_guard<std::mutex> guard(lock);
+        if (use_stdio || pos < len || eof) return true;
+        pollfd p{0, POLLIN, 0};
+        return poll(&p, 1, 0) > 0;
     }
 
-    static void load_param_mapping() {
-        inscode_param_cnt_mapping[VMALLOC] = 1;
-        inscode_param_cnt_mapping[CMALLOC] = 1;
-        inscode_param_cnt_mapping[POP_OP] = 0;
-        inscode_param_cnt_mapping[NOOP] = 0;
-        inscode_param_cnt_mapping[LOAD_NULL] = 0;
-        inscode_param_cnt_mapping[LOAD_CONSTANT] = 1;
-        inscode_param_cnt_mapping[LOAD_NAME] = 1;
-        inscode_param_cnt_mapping[LOAD_NAME_GLOBAL] = 1;
-        inscode_param_cnt_mapping[LOAD_INT] = 1;
-        inscode_param_cnt_mapping[LOAD_FLOAT] = 1;
-        inscode_param_cnt_mapping[LOAD_CHAR] = 1;
-        inscode_param_cnt_mapping[STORE_NAME] = 1;
-        inscode_param_cnt_mapping[STORE_NAME_NOPOP] = 1;
-        inscode_param_cnt_mapping[STORE_NAME_GLOBAL] = 1;
-        inscode_param_cnt_mapping[STORE_NAME_GLOBAL_NOPOP] = 1;
-        inscode_param_cnt_mapping[JMP] = 1;
-        inscode_param_cnt_mapping[JMP_TRUE] = 1;
-        inscode_param_cnt_mapping[JMP_FALSE] = 1;
-        inscode_param_cnt_mapping[BINARY_OP] = 1;
-        inscode_param_cnt_mapping[UNARY_OP] = 1;
-        inscode_param_cnt_mapping[HALT] = 0;
-        inscode_param_cnt_mapping[RET] = 0;
-        inscode_param_cnt_mapping[PUSH] = 0;
-        inscode_param_cnt_mapping[CALL] = 1;
-        inscode_param_cnt_mapping[LOAD_GLOBAL] = 0;
-        inscode_param_cnt_mapping[STORE_GLOBAL] = 0;
-        inscode_param_cnt_mapping[BUILD_ARR] = 1;
-        inscode_param_cnt_mapping[TYPE_CVT] = 1;
-        inscode_param_cnt_mapping[BINARY_SUBSCR] = 0;
-        inscode_param_cnt_mapping[STORE_SUBSCR] = 0;
-        inscode_param_cnt_mapping[STORE_SUBSCR_INPLACE] = 0;
-        inscode_param_cnt_mapping[STORE_SUBSCR_NOPOP] = 0;
-        inscode_param_cnt_mapping[PRINTK] = 0;
-        inscode_param_cnt_mapping[PUTCH] = 0;
-        inscode_param_cnt_mapping[GETCH] = 0;
-        inscode_param_cnt_mapping[SIZE_OF] = 0;
-        // only used for assemble/disassemble
-        inscode_param_cnt_mapping[CONSTANT] = 3;
+    // Block until a read would not block
+    void wait() {
+        if (ready()) return;
+        block();
     }
 
-    Machine() {
-        op_top = -1;
-        reset();
+    int get() {
+        int c = fetch();
+        trace_input(c);
+        return c;
     }
 
-    ~Machine() {
-        reset();
+private:
+    // What getchar() on a stream tied to stdout used to do: a prompt without a newline shows up
+    // before the program blocks on input.
+    static void flush_output() {
+        std::cout.flush();
+        fflush(stdout);
     }
 
-    void enable_verbose() {
-        verbose = true;
+    // Wait for fd 0 to become readable. The quota checkpoints do not run while the program is blocked, so
+    // under a wall time limit (-l time=) the wait is a poll that ends when the limit runs out.
+    static void block() {
+        flush_output();
+        pollfd p{0, POLLIN, 0};
+        while (Quota::seconds > 0) {
+            double left = Quota::seconds - Quota::elapsed();
+            if (left <= 0) Quota::exceeded("wall time limit");
+            if (poll(&p, 1, (int) (left * 1000) + 1) > 0) return;
+        }
+        poll(&p, 1, -1);
     }
 
-    void enable_evaluator() {
-        evaluator = true;
-    }
+    int fetch() {
+        std::lock_guard<std::mutex> guard(lock);
+        if (use_stdio) return getchar();
+        if (pos == len) {
+            if (eof) return EOF;
+            block();
+            ssize_t n = read(0, buf, sizeof(buf));
+            if (n <= 0) {
+                eof = true;
+                return EOF;
+            }
+            pos = 0;
+            len = (int) n;
+        }
+        return (unsigned char) buf[pos++];
+    }
+} vm_input;
 
-    void reset() {
-        ip = -1;
-        ins_cnt = 0;
-        while (op_top > -1) {
-            SLOT_DECREF(global_operands[op_top--], "Reset");
+// Bulk array kernels
+//
+// Portable loops, plus AVX2 versions picked at startup when the CPU supports them. Float sums and
+// min/max reduce in 4 lanes on both paths, so the result does not depend on the CPU.
+#if defined(__x86_64__)
+bool init_cpu_avx2() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+const bool cpu_avx2 = init_cpu_avx2();
+
+__attribute__((target("avx2")))
+int avx2_index_of(const int_tp *a, int i, int n, int_tp v) {
+    __m256i key = _mm256_set1_epi64x(v);
+    for (; i + 4 <= n; i += 4) {
+        __m256i eq = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *) (a + i)), key);
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(eq));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    for (; i < n; i++) if (a[i] == v) return i;
+    return -1;
+}
+
+__attribute__((target("avx2")))
+int avx2_index_of(const float_tp *a, int i, int n, float_tp v) {
+    __m256d key = _mm256_set1_pd(v);
+    for (; i + 4 <= n; i += 4) {
+        int mask = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(a + i), key, _CMP_EQ_OQ));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    for (; i < n; i++) if (a[i] == v) return i;
+    return -1;
+}
+
+__attribute__((target("avx2")))
+int avx2_index_of(const char_tp *a, int i, int n, char_tp v) {
+    __m256i key = _mm256_set1_epi8(v);
+    for (; i + 32 <= n; i += 32) {
+        __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (a + i)), key);
+        unsigned mask = _mm256_movemask_epi8(eq);
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    for (; i < n; i++) if (a[i] == v) return i;
+    return -1;
+}
+
+// Index of the first differing byte, or n
+__attribute__((target("avx2")))
+size_t avx2_mismatch(const char *a, const char *b, size_t i, size_t n) {
+    for (; i + 32 <= n; i += 32) {
+        __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (a + i)),
+                                       _mm256_loadu_si256((const __m256i *) (b + i)));
+        unsigned mask = ~(unsigned) _mm256_movemask_epi8(eq);
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    for (; i < n; i++) if (a[i] != b[i]) return i;
+    return n;
+}
+
+__attribute__((target("avx2")))
+void avx2_fill(int_tp *a, int n, int_tp v) {
+    __m256i val = _mm256_set1_epi64x(v);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) _mm256_storeu_si256((__m256i *) (a + i), val);
+    for (; i < n; i++) a[i] = v;
+}
+
+__attribute__((target("avx2")))
+int_tp avx2_sum(const int_tp *a, int n) {
+    __m256i acc = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) acc = _mm256_add_epi64(acc, _mm256_loadu_si256((const __m256i *) (a + i)));
+    int_tp lanes[4];
+    _mm256_storeu_si256((__m256i *) lanes, acc);
+    int_tp sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    for (; i < n; i++) sum += a[i];
+    return sum;
+}
+
+__attribute__((target("avx2")))
+float_tp avx2_sum(const float_tp *a, int n) {
+    __m256d acc = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) acc = _mm256_add_pd(acc, _mm256_loadu_pd(a + i));
+    float_tp lanes[4];
+    _mm256_storeu_pd(lanes, acc);
+    float_tp sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < n; i++) sum += a[i];
+    return sum;
+}
+
+// Characters are biased to unsigned bytes and summed 8 at a time by SAD
+__attribute__((target("avx2")))
+int_tp avx2_sum(const char_tp *a, int n) {
+    __m256i acc = _mm256_setzero_si256(), bias = _mm256_set1_epi8((char) 0x80), zero = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (a + i)), bias);
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(v, zero));
+    }
+    int_tp lanes[4];
+    _mm256_storeu_si256((__m256i *) lanes, acc);
+    int_tp sum = lanes[0] + lanes[1] + lanes[2] + lanes[3] - (int_tp) 128 * i;
+    for (; i < n; i++) sum += a[i];
+    return sum;
+}
+
+// Minimum (want_max = false) or maximum of a non-empty array
+__attribute__((target("avx2")))
+int_tp avx2_extreme(const int_tp *a, int n, bool want_max) {
+    int_tp best = a[0];
+    int i = 0;
+    if (n >= 4) {
+        __m256i acc = _mm256_loadu_si256((const __m256i *) a);
+        for (i = 4; i + 4 <= n; i += 4) {
+            __m256i v = _mm256_loadu_si256((const __m256i *) (a + i));
+            __m256i gt = want_max ? _mm256_cmpgt_epi64(v, acc) : _mm256_cmpgt_epi64(acc, v);
+            acc = _mm256_blendv_epi8(acc, v, gt);
         }
-        esp = nullptr;
-        while (var_cnt--) {
-            SLOT_DECREF(globals[var_cnt], "Reset");
+        int_tp lanes[4];
+        _mm256_storeu_si256((__m256i *) lanes, acc);
+        best = lanes[0];
+        for (int_tp x : lanes) best = want_max ? std::max(best, x) : std::min(best, x);
+    }
+    for (; i < n; i++) best = want_max ? std::max(best, a[i]) : std::min(best, a[i]);
+    return best;
+}
+
+__attribute__((target("avx2")))
+float_tp avx2_extreme(const float_tp *a, int n, bool want_max) {
+    float_tp best = a[0];
+    int i = 0;
+    if (n >= 4) {
+        __m256d acc = _mm256_loadu_pd(a);
+        for (i = 4; i + 4 <= n; i += 4) {
+            __m256d v = _mm256_loadu_pd(a + i);
+            acc = want_max ? _mm256_max_pd(acc, v) : _mm256_min_pd(acc, v);
         }
-        while (constant_cnt--) {
-            SLOT_DECREF(constants[constant_cnt], "Reset");
+        float_tp lanes[4];
+        _mm256_storeu_pd(lanes, acc);
+        best = lanes[0];
+        for (int k = 1; k < 4; k++) best = want_max ? (best > lanes[k] ? best : lanes[k]) : (best < lanes[k] ? best : lanes[k]);
+    }
+    for (; i < n; i++) best = want_max ? (best > a[i] ? best : a[i]) : (best < a[i] ? best : a[i]);
+    return best;
+}
+
+__attribute__((target("avx2")))
+char_tp avx2_extreme(const char_tp *a, int n, bool want_max) {
+    char_tp best = a[0];
+    int i = 0;
+    if (n >= 32) {
+        __m256i acc = _mm256_loadu_si256((const __m256i *) a);
+        for (i = 32; i + 32 <= n; i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *) (a + i));
+            acc = want_max ? _mm256_max_epi8(acc, v) : _mm256_min_epi8(acc, v);
         }
-        var_cnt = 0;
-        constant_cnt = 0;
+        char_tp lanes[32];
+        _mm256_storeu_si256((__m256i *) lanes, acc);
+        for (char_tp x : lanes) best = want_max ? std::max(best, x) : std::min(best, x);
     }
+    for (; i < n; i++) best = want_max ? std::max(best, a[i]) : std::min(best, a[i]);
+    return best;
+}
+#else
+const bool cpu_avx2 = false;
+#define avx2_index_of scalar_index_of
+#define avx2_mismatch scalar_mismatch
+#define avx2_fill scalar_fill
+#define avx2_sum scalar_sum
+#define avx2_extreme scalar_extreme
+#endif
 
-    void add_instruct(instruct ins) {
-        instructs[ins_cnt++] = ins;
-        addrs[ins.address] = ins_cnt - 1;
+template<typename T>
+int scalar_index_of(const T *a, int i, int n, T v) {
+    for (; i < n; i++) if (a[i] == v) return i;
+    return -1;
+}
+
+size_t scalar_mismatch(const char *a, const char *b, size_t i, size_t n) {
+    for (; i < n; i++) if (a[i] != b[i]) return i;
+    return n;
+}
+
+template<typename T>
+void scalar_fill(T *a, int n, T v) {
+    std::fill(a, a + n, v);
+}
+
+int_tp scalar_sum(const int_tp *a, int n) {
+    int_tp sum = 0;
+    for (int i = 0; i < n; i++) sum += a[i];
+    return sum;
+}
+
+int_tp scalar_sum(const char_tp *a, int n) {
+    int_tp sum = 0;
+    for (int i = 0; i < n; i++) sum += a[i];
+    return sum;
+}
+
+float_tp scalar_sum(const float_tp *a, int n) {
+    float_tp lanes[4] = {0, 0, 0, 0};
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        for (int k = 0; k < 4; k++) lanes[k] += a[i + k];
     }
+    float_tp sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < n; i++) sum += a[i];
+    return sum;
+}
 
-    void dispatch() {
-        if (verbose) {
-            std::cout << "SLang Virtual Machine Debugger (SVMDB)" << std::endl;
-            std::cout << "I am an opcode-level debugging assistant." << std::endl;
-            std::cout << "======================================" << std::endl;
-            std::cin.get();
-            Machine::load_name_code_mapping();
-            Machine::load_param_mapping();
-        }
-        clock_t start = 0, finish;
-        if (evaluator) {
-            start = clock();
+template<typename T>
+T scalar_extreme(const T *a, int n, bool want_max) {
+    T best = a[0];
+    for (int i = 1; i < n; i++) best = want_max ? std::max(best, a[i]) : std::min(best, a[i]);
+    return best;
+}
+
+float_tp scalar_extreme(const float_tp *a, int n, bool want_max) {
+    float_tp best = a[0];
+    int i = 0;
+    if (n >= 4) {
+        float_tp lanes[4] = {a[0], a[1], a[2], a[3]};
+        for (i = 4; i + 4 <= n; i += 4) {
+            for (int k = 0; k < 4; k++) {
+                float_tp v = a[i + k];
+                lanes[k] = want_max ? (lanes[k] > v ? lanes[k] : v) : (lanes[k] < v ? lanes[k] : v);
+            }
         }
-        full_dispatch:
-        {
-            operands = (esp == nullptr) ? &global_operands : &(esp->local_operands);
-            op_top_ptr = (esp == nullptr) ? &op_top : &(esp->op_top);
+        best = lanes[0];
+        for (int k = 1; k < 4; k++) best = want_max ? (best > lanes[k] ? best : lanes[k]) : (best < lanes[k] ? best : lanes[k]);
+    }
+    for (; i < n; i++) best = want_max ? (best > a[i] ? best : a[i]) : (best < a[i] ? best : a[i]);
+    return best;
+}
 
-            dispatch:
-            {
-                n_ins++;
-                instruct ins = instructs[++ip];
-                if (verbose) {
-                    std::cout << "======================================" << std::endl;
-                    std::string code_name_mapping[200];
-                    for (const auto& x : Machine::string_inscode_mapping) {
-                        code_name_mapping[x.second] = x.first;
-                    }
-                    std::cout << "#" << ins.address << " $ " << code_name_mapping[ins.code];
-                    if (Machine::inscode_param_cnt_mapping[ins.code]) {
-                        std::cout << " " << ins.operand;
-                    }
-                    std::cout << " > ";
-                    std::cin.get();
-                }
-                switch (ins.code) {
-                    case VMALLOC: {
-                        if (ins.operand) {
-                            if (esp == nullptr) {
-                                globals = new slot *[ins.operand];
-                                for (int i = 0; i < ins.operand; i++) globals[i] = nullptr;
-                                var_cnt = ins.operand;
-                            } else {
-                                esp->locals = new slot *[ins.operand];
-                                for (int i = 0; i < ins.operand; i++) esp->locals[i] = nullptr;
-                                esp->var_cnt = ins.operand;
-                            }
-                        }
-                        DISPATCH;
-                    }
+template<typename T>
+int kernel_index_of(const T *a, int from, int n, T v) {
+    return cpu_avx2 ? avx2_index_of(a, from, n, v) : scalar_index_of(a, from, n, v);
+}
 
-                    case NOOP:
-                        DISPATCH;
+// int_tp for int and char arrays, float_tp for float arrays
+template<typename T>
+auto kernel_sum(const T *a, int n) -> decltype(scalar_sum(a, n)) {
+    return cpu_avx2 ? avx2_sum(a, n) : scalar_sum(a, n);
+}
 
-                    case POP_OP: {
-                        slot *op = OP_POP();
-                        SLOT_DECREF(op, "Operand is poped from the stack");
-                        DISPATCH;
-                    }
+void kernel_fill(int_tp *a, int n, int_tp v) {
+    if (cpu_avx2) avx2_fill(a, n, v);
+    else scalar_fill(a, n, v);
+}
 
-                    case TYPE_CVT: {
-                        slot *op = OP_POP();
-                        slot *res = nullptr;
-                        switch (ins.operand) {
-                            // INT
-                            case 0:
-                                if (op->type == INT) {
-                                    res = new slot((int_tp) op->int_val);
-                                } else if (op->type == FLOAT) {
-                                    res = new slot((int_tp) op->float_val);
-                                }
-                                break;
-                            // FLOAT
-                            case 1:
-                                if (op->type == INT) {
-                                    res = new slot((float_tp) op->int_val);
-                                } else if (op->type == FLOAT) {
-                                    res = new slot((float_tp) op->float_val);
-                                }
-                                break;
-                            // CHAR
-                            case 2:
-                                res = new slot((char_tp) op->char_val);
-                                break;
-                        }
-                        OP_PUSH(res);
-                        SLOT_DECREF(op, "Convert type");
-                        DISPATCH;
-                    }
+void kernel_fill(float_tp *a, int n, float_tp v) {
+    int_tp bits;
+    memcpy(&bits, &v, sizeof(bits));
+    kernel_fill((int_tp *) a, n, bits);
+}
 
-                    case PUSH: {
-                        auto *tmp = new frame(esp != nullptr ? esp : nullptr);
-                        esp = tmp;
-                        if (verbose) {
-                            std::cout << "Frame is pushed into the control stack." << std::endl;
-                        }
-                        FULL_DISPATCH;
-                    }
+void kernel_fill(char_tp *a, int n, char_tp v) {
+    memset(a, v, n);
+}
 
-                    case CALL: {
-                        esp->return_ip = ip + 1;
-                        if (verbose) {
-                            std::cout << "Call subroutine defined at address " << ins.operand
-                                      << ", with return address "
-                                      << (ip < ins_cnt - 1 ? instructs[ip + 1].address : -1) << "." << std::endl;
-                        }
-                        ip = addrs[ins.operand] - 1;
-                        DISPATCH;
-                    }
+template<typename T>
+T kernel_extreme(const T *a, int n, bool want_max) {
+    return cpu_avx2 ? avx2_extreme(a, n, want_max) : scalar_extreme(a, n, want_max);
+}
 
-                    case RET: {
-                        int to_ip = esp->return_ip - 1;
-                        ip = to_ip;
-                        slot *ret;
-                        if (esp->caller == nullptr) {
-                            ret = global_operands[++op_top] = OP_POP();
-                        } else {
-                            ret = esp->caller->local_operands[++esp->caller->op_top] = OP_POP();
-                        }
-                        // 此处不需要对ret进行减引用，因为ret此会在进入了函数之后被减一次
-                        if (verbose) {
-                            std::cout << "Frame is poped from the control stack. Return to instruct address "
-                                      << (to_ip < ins_cnt - 1 ? instructs[to_ip + 1].address : -1)
-                                      << " with return value " << ret->as_string() << "." << std::endl;
-                        }
-                        while (esp->op_top > -1) {
-                            SLOT_DECREF(esp->local_operands[esp->op_top], "Return statement op decref");
-                        }
-                        while (esp->var_cnt--) {
-                            SLOT_DECREF(esp->locals[esp->var_cnt], "Return statement var decref");
-                        }
-                        delete esp->locals;
-                        frame *tmp = esp->caller;
-                        delete esp;
-                        esp = tmp;
-                        FULL_DISPATCH;
-                    }
+// Lexicographic comparison of two arrays of the same element type: -1, 0 or 1
+template<typename T>
+int kernel_compare(const T *a, int na, const T *b, int nb) {
+    int n = std::min(na, nb);
+    size_t bytes = (size_t) n * sizeof(T), at = 0;
+    while (true) {
+        at = cpu_avx2 ? avx2_mismatch((const char *) a, (const char *) b, at, bytes)
+                      : scalar_mismatch((const char *) a, (const char *) b, at, bytes);
+        if (at == bytes) break;
+        size_t i = at / sizeof(T);
+        if (a[i] < b[i]) return -1;
+        if (b[i] < a[i]) return 1;
+        // Equal values with different bits (0.0 and -0.0)
+        at = (i + 1) * sizeof(T);
+    }
+    return na < nb ? -1 : (na > nb ? 1 : 0);
+}
 
-                    case LOAD_NULL: {
-                        slot* slt = new slot();
-                        OP_PUSH(slt);
-                        if (verbose) {
-                            std::cout << "NULL value (type: void) was loaded to operand stack." << std::endl;
-                        }
-                        DISPATCH;
-                    }
+// Native intrinsics
+// Runtime library functions bound through `__svm__ CALL_NATIVE <id>`, e.g.
+//   func int abs(int x) {
+//       __svm__ LOAD_NAME &x;
+//       __svm__ CALL_NATIVE 0;
+//       __svm__ RET;
+//   }
+// The arguments are taken directly from the operand stack (args[0] is the deepest one).
+// A native returns a new slot to be pushed, or nullptr if it has no return value.
+enum native_id {
+    NATIVE_ABS = 0,
+    NATIVE_SQRT,
+    NATIVE_TO_INT,
+    NATIVE_TO_FLOAT,
+    NATIVE_WRITE_INT,
+    NATIVE_WRITE_STR,
+    NATIVE_READ_STR,
+    NATIVE_ARR_FILL,
+    NATIVE_ARR_COPY,
+    NATIVE_ARR_COMPARE,
+    NATIVE_ARR_INDEX_OF,
+    NATIVE_ARR_SUM,
+    NATIVE_ARR_MIN,
+    NATIVE_ARR_MAX,
+    NATIVE_ARR_SORT,
+    NATIVE_STR_LEN,
+    NATIVE_STR_CAT,
+    NATIVE_STR_CMP,
+    NATIVE_STR_FIND,
+    NATIVE_CNT
+};
 
-                    case LOAD_INT: {
-                        slot *created = new slot((int_tp) ins.operand);
-                        OP_PUSH(created);
-                        if (verbose) {
-                            std::cout << "Int value " << ins.operand << " was loaded to operand stack." << std::endl;
-                        }
-                        DISPATCH;
-                    }
+typedef slot *(*native_fn)(slot **args);
 
-                    case LOAD_FLOAT: {
-                        slot *created = new slot((float_tp) ins.operand);
-                        OP_PUSH(created);
-                        if (verbose) {
-                            std::cout << "Float value " << ins.operand << " was loaded to operand stack." << std::endl;
-                        }
-                        DISPATCH;
-                    }
+struct native_entry {
+    const char *name;
+    int argc;
+    native_fn fn;
+    // Whether fn returns a slot (it never returns one only sometimes)
+    bool result;
+};
 
-                    case SIZE_OF: {
-                        slot *element = OP_POP();
-                        SLOT_DECREF(element, "Size of calculate");
-                        int size;
-                        if (element->type != ARRAY) size = 1;
-                        else size = element->array_size;
-                        OP_PUSH(new slot((int_tp) size));
-                        DISPATCH;
-                    }
+slot *native_abs(slot **args) {
+    slot *x = args[0];
+    if (x->type == INT) return new slot((int_tp) (x->int_val < 0 ? -x->int_val : x->int_val));
+    if (x->type == FLOAT) return new slot((float_tp) std::fabs(x->float_val));
+    panic("Unsupported operand of abs");
+    return nullptr;
+}
 
-                    case LOAD_CHAR: {
-                        slot *created = new slot((char_tp) ins.operand);
-                        OP_PUSH(created);
-                        if (verbose) {
-                            std::cout << "Char value " << ins.operand << " was loaded to operand stack." << std::endl;
-                        }
-                        DISPATCH;
-                    }
+slot *native_sqrt(slot **args) {
+    slot *x = args[0];
+    if (x->type == FLOAT) return new slot((float_tp) std::sqrt(x->float_val));
+    if (x->type != INT) panic("Unsupported operand of sqrt");
+    int_tp n = x->int_val;
+    if (n <= 1) return new slot(n);
+    // floor(sqrt(n)), corrected for the rounding error of the double result
+    auto r = (int_tp) std::sqrt((double) n);
+    while (r * r > n) r--;
+    while ((r + 1) * (r + 1) <= n) r++;
+    return new slot(r);
+}
 
-                    case LOAD_CONSTANT: {
-                        slot *constant = constants[ins.operand];
-                        OP_PUSH(constant);
-                        SLOT_INCREF(constant, "LOAD_CONSTANT");
-                        if (verbose) {
-                            std::cout << "Constant value " << constants[ins.operand]->as_string()
-                                      << " was loaded to operand stack." << std::endl;
-                        }
-                        DISPATCH;
-                    }
+slot *native_to_int(slot **args) {
+    slot *x = args[0];
+    if (x->type == FLOAT) return new slot((int_tp) x->float_val);
+    if (x->type == CHAR) return new slot((int_tp) x->char_val);
+    return new slot((int_tp) x->int_val);
+}
 
-                    case LOAD_NAME: {
-                        slot *var = esp->locals[ins.operand];
-                        OP_PUSH(var);
-                        SLOT_INCREF(var, "LOAD_NAME");
-                        if (verbose) {
-                            std::cout << "Loaded name " << ins.operand << "." << std::endl;
-                        }
-                        DISPATCH;
-                    }
-                    case LOAD_NAME_GLOBAL: {
-                        slot *var = globals[ins.operand];
-                        OP_PUSH(var);
-                        SLOT_INCREF(var, "LOAD_NAME_GLOBAL");
-                        if (verbose) {
-                            std::cout << "Loaded global name " << ins.operand << "." << std::endl;
-                        }
-                        DISPATCH;
-                    }
-                    case STORE_NAME:
-                    case STORE_NAME_NOPOP: {
-                        // 千万注意！原来的需要DECREF
-                        if (esp->locals[ins.operand] != nullptr) {
-                            SLOT_DECREF(esp->locals[ins.operand], "Store override");
-                        }
-                        if (ins.code == STORE_NAME) {
-                            esp->locals[ins.operand] = OP_POP();
-                        } else {
-                            esp->locals[ins.operand] = OP_TOP();
-                        }
-                        SLOT_INCREF(esp->locals[ins.operand], "STORE_NAME[_NOPOP]");
-                        if (verbose) {
-                            std::cout << "Stored " << esp->locals[ins.operand]->as_string() << " to name " << ins.operand << " in locals."
-                                      << std::endl;
-                        }
-                        DISPATCH;
-                    }
-                    case STORE_NAME_GLOBAL:
-                    case STORE_NAME_GLOBAL_NOPOP: {
-                        // 千万注意！原来的需要DECREF
-                        if (globals[ins.operand] != nullptr) {
-                            SLOT_DECREF(globals[ins.operand], "Store global override");
-                        }
-                        if (ins.code == STORE_NAME_GLOBAL) {
-                            globals[ins.operand] = OP_POP();
-                        } else {
-                            globals[ins.operand] = OP_TOP();
-                        }
-                        SLOT_INCREF(globals[ins.operand], "STORE_NAME_GLOBAL[_NOPOP]");
-                        if (verbose) {
-                            std::cout << "Stored " << globals[ins.operand]->as_string() << " to name " << ins.operand << " in globals."
-                                      << std::endl;
-                        }
-                        DISPATCH;
-                    }
-                    case JMP: {
-                        ip = addrs[ins.operand] - 1;
-                        if (verbose) {
-                            std::cout << "Jumped to instruction address " << ins.operand << "." << std::endl;
-                        }
-                        DISPATCH;
-                    }
+slot *native_to_float(slot **args) {
+    slot *x = args[0];
+    if (x->type == INT) return new slot((float_tp) x->int_val);
+    if (x->type == CHAR) return new slot((float_tp) x->char_val);
+    return new slot((float_tp) x->float_val);
+}
+
+slot *native_write_int(slot **args) {
+    std::cout << args[0]->int_val;
+    return nullptr;
+}
+
+slot *native_write_str(slot **args) {
+    slot *s = args[0];
+    const char_tp *end = (const char_tp *) memchr(s->chars(), '\0', s->array_size);
+    std::cout.write(s->chars(), end == nullptr ? s->array_size : end - s->chars());
+    return nullptr;
+}
+
+slot *native_read_str(slot **args) {
+    // Same semantics as the slang version: read until a blank, keep the last char before '\0'
+    slot *target = args[0];
+    int buffer_size = target->array_size;
+    int cur = 0;
+    char_tp ch = '\0';
+    while (ch != '\n' && ch != ' ') {
+        ch = (char_tp) vm_input.get();
+        if (cur >= buffer_size) panic("Array index out of bound");
+        target->chars()[cur] = ch;
+        if (cur < buffer_size - 2) cur++;
+        else break;
+    }
+    if (cur + 1 >= buffer_size) panic("Array index out of bound");
+    target->chars()[cur + 1] = '\0';
+    return nullptr;
+}
+
+slot *array_arg(slot **args, int k, const char *name) {
+    if (args[k]->type != ARRAY) {
+        panic((std::string(name) + " expects an array").c_str());
+    }
+    return args[k];
+}
+
+slot *native_arr_fill(slot **args) {
+    slot *a = array_arg(args, 0, "fill"), *v = args[1];
+    switch (a->arr_element_type) {
+        case INT:
+            kernel_fill(a->ints(), a->array_size, v->as_int());
+            break;
+        case FLOAT:
+            kernel_fill(a->floats(), a->array_size, v->as_float());
+            break;
+        default:
+            kernel_fill(a->chars(), a->array_size, v->as_char());
+            break;
+    }
+    return nullptr;
+}
+
+// copy(dst, dst_offset, src, src_offset, n), overlapping ranges allowed
+slot *native_arr_copy(slot **args) {
+    slot *dst = array_arg(args, 0, "copy"), *src = array_arg(args, 2, "copy");
+    int_tp dst_off = args[1]->int_val, src_off = args[3]->int_val, n = args[4]->int_val;
+    if (n < 0 || dst_off < 0 || src_off < 0 || dst_off + n > dst->array_size || src_off + n > src->array_size) {
+        panic("Array index out of bound");
+    }
+    if (dst->arr_element_type == src->arr_element_type) {
+        size_t size = dst->element_size();
+        memmove((char *) dst->array_val + dst_off * size, (char *) src->array_val + src_off * size, n * size);
+        return nullptr;
+    }
+    for (int_tp i = 0; i < n; i++) {
+        slot *element = src->element(src_off + i);
+        dst->set_element(dst_off + i, element);
+        delete element;
+    }
+    return nullptr;
+}
+
+slot *native_arr_compare(slot **args) {
+    slot *a = array_arg(args, 0, "compare"), *b = array_arg(args, 1, "compare");
+    if (a->arr_element_type != b->arr_element_type) {
+        panic("compare expects arrays of the same type");
+    }
+    int res;
+    switch (a->arr_element_type) {
+        case INT:
+            res = kernel_compare(a->ints(), a->array_size, b->ints(), b->array_size);
+            break;
+        case FLOAT:
+            res = kernel_compare(a->floats(), a->array_size, b->floats(), b->array_size);
+            break;
+        default:
+            res = kernel_compare(a->chars(), a->array_size, b->chars(), b->array_size);
+            break;
+    }
+    return new slot((int_tp) res);
+}
+
+// index_of(a, v, from): first index >= from holding v, or -1
+slot *native_arr_index_of(slot **args) {
+    slot *a = array_arg(args, 0, "index_of"), *v = args[1];
+    int from = (int) std::max((int_tp) 0, args[2]->int_val);
+    int res;
+    switch (a->arr_element_type) {
+        case INT:
+            res = kernel_index_of(a->ints(), from, a->array_size, v->as_int());
+            break;
+        case FLOAT:
+            res = kernel_index_of(a->floats(), from, a->array_size, v->as_float());
+            break;
+        default:
+            res = kernel_index_of(a->chars(), from, a->array_size, v->as_char());
+            break;
+    }
+    return new slot((int_tp) res);
+}
+
+slot *native_arr_sum(slot **args) {
+    slot *a = array_arg(args, 0, "sum");
+    switch (a->arr_element_type) {
+        case INT:
+            return new slot(kernel_sum(a->ints(), a->array_size));
+        case FLOAT:
+            return new slot(kernel_sum(a->floats(), a->array_size));
+        default:
+            return new slot(kernel_sum(a->chars(), a->array_size));
+    }
+}
+
+slot *array_extreme(slot *a, bool want_max) {
+    if (a->array_size == 0) {
+        panic(want_max ? "max of an empty array" : "min of an empty array");
+    }
+    switch (a->arr_element_type) {
+        case INT:
+            return new slot(kernel_extreme(a->ints(), a->array_size, want_max));
+        case FLOAT:
+            return new slot(kernel_extreme(a->floats(), a->array_size, want_max));
+        default:
+            return new slot(kernel_extreme(a->chars(), a->array_size, want_max));
+    }
+}
+
+slot *native_arr_min(slot **args) {
+    return array_extreme(array_arg(args, 0, "min"), false);
+}
+
+slot *native_arr_max(slot **args) {
+    return array_extreme(array_arg(args, 0, "max"), true);
+}
+
+slot *native_arr_sort(slot **args) {
+    slot *a = array_arg(args, 0, "sort");
+    switch (a->arr_element_type) {
+        case INT:
+            std::sort(a->ints(), a->ints() + a->array_size);
+            break;
+        case FLOAT:
+            std::sort(a->floats(), a->floats() + a->array_size);
+            break;
+        default:
+            std::sort(a->chars(), a->chars() + a->array_size);
+            break;
+    }
+    return nullptr;
+}
+
+// Strings are char arrays ending at the first '\0' (or at the end of the array)
+slot *string_arg(slot **args, int k, const char *name) {
+    if (args[k]->type != ARRAY || args[k]->arr_element_type != CHAR) {
+        panic((std::string(name) + " expects a string").c_str());
+    }
+    return args[k];
+}
+
+int string_length(slot *s) {
+    int len = kernel_index_of(s->chars(), 0, s->array_size, (char_tp) '\0');
+    return len == -1 ? s->array_size : len;
+}
+
+slot *native_str_len(slot **args) {
+    return new slot((int_tp) string_length(string_arg(args, 0, "strlen")));
+}
+
+// strcat(dst, src): append src to the string in dst
+slot *native_str_cat(slot **args) {
+    slot *dst = string_arg(args, 0, "strcat"), *src = string_arg(args, 1, "strcat");
+    int dst_len = string_length(dst), src_len = string_length(src);
+    if (dst_len + src_len > dst->array_size) {
+        panic("Array index out of bound");
+    }
+    memmove(dst->chars() + dst_len, src->chars(), src_len);
+    if (dst_len + src_len < dst->array_size) dst->chars()[dst_len + src_len] = '\0';
+    return nullptr;
+}
+
+slot *native_str_cmp(slot **args) {
+    slot *a = string_arg(args, 0, "strcmp"), *b = string_arg(args, 1, "strcmp");
+    return new slot((int_tp) kernel_compare(a->chars(), string_length(a), b->chars(), string_length(b)));
+}
+
+// strfind(s, t, from): first index >= from where t occurs in s, or -1
+slot *native_str_find(slot **args) {
+    slot *hay = string_arg(args, 0, "strfind"), *needle = string_arg(args, 1, "strfind");
+    int hay_len = string_length(hay), needle_len = string_length(needle);
+    int from = (int) std::max((int_tp) 0, args[2]->int_val);
+    if (needle_len == 0) return new slot((int_tp) (from <= hay_len ? from : -1));
+    const char_tp *h = hay->chars(), *t = needle->chars();
+    int last = hay_len - needle_len;
+    while (from <= last) {
+        int at = kernel_index_of(h, from, last + 1, t[0]);
+        if (at == -1) break;
+        if (memcmp(h + at, t, needle_len) == 0) return new slot((int_tp) at);
+        from = at + 1;
+    }
+    return new slot((int_tp) -1);
+}
+
+native_entry native_table[NATIVE_CNT] = {
+        {"abs",       1, native_abs,          true},
+        {"sqrt",      1, native_sqrt,         true},
+        {"to_int",    1, native_to_int,       true},
+        {"to_float",  1, native_to_float,     true},
+        {"write_int", 1, native_write_int,    false},
+        {"write_str", 1, native_write_str,    false},
+        {"read_str",  1, native_read_str,     false},
+        {"fill",      2, native_arr_fill,     false},
+        {"copy",      5, native_arr_copy,     false},
+        {"compare",   2, native_arr_compare,  true},
+        {"index_of",  3, native_arr_index_of, true},
+        {"sum",       1, native_arr_sum,      true},
+        {"min",       1, native_arr_min,      true},
+        {"max",       1, native_arr_max,      true},
+        {"sort",      1, native_arr_sort,     false},
+        {"strlen",    1, native_str_len,      true},
+        {"strcat",    2, native_str_cat,      false},
+        {"strcmp",    2, native_str_cmp,      true},
+        {"strfind",   3, native_str_find,     true}
+};
+
+// Hash maps (BUILD_MAP, MAP_GET, MAP_PUT, MAP_DEL, MAP_HAS, MAP_SIZE)
+//
+// Open addressing over flat arrays, after Swiss tables: a control byte per bucket (EMPTY, DELETED, or the low 7
+// bits of the key's hash) and a parallel array of (key, value) words. A lookup compares a group of 16 control
+// bytes with the hash at once and only looks at the entries whose byte matched; groups are probed quadratically.
+// Keys are ints, or strings (char arrays up to the first '\0') kept as a private copy in a char array slot.
+// Values are stored unboxed like array elements, converted to the value type of the map when stored.
+#if defined(__x86_64__)
+// Bit k is set when control byte k of the group equals c
+inline unsigned group_match(const uint8_t *g, uint8_t c) {
+    __m128i v = _mm_loadu_si128((const __m128i *) g);
+    return (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8((char) c)));
+}
+
+// Bit k is set when bucket k of the group is EMPTY or DELETED: only those have the top bit set
+inline unsigned group_free(const uint8_t *g) {
+    return (unsigned) _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) g));
+}
+#else
+inline unsigned group_match(const uint8_t *g, uint8_t c) {
+    unsigned m = 0;
+    for (int k = 0; k < 16; k++) m |= (unsigned) (g[k] == c) << k;
+    return m;
+}
+
+inline unsigned group_free(const uint8_t *g) {
+    unsigned m = 0;
+    for (int k = 0; k < 16; k++) m |= (unsigned) (g[k] >> 7) << k;
+    return m;
+}
+#endif
+
+struct hash_map {
+    static const int GROUP = 16;
+    static const uint8_t EMPTY = 0x80, DELETED = 0xfe;
+
+    struct entry {
+        // The key, or the slot holding a copy of a string key
+        int_tp key;
+        // Bits of the value, of value_type
+        int_tp value;
+    };
+
+    // A key being looked up: an int, or the bytes of a string
+    struct key_ref {
+        int_tp int_val = 0;
+        const char_tp *chars = nullptr;
+        int len = 0;
+        uint64_t hash = 0;
+    };
+
+    basic_data_types key_type, value_type;
+    int size = 0;
+
+    hash_map(basic_data_types _key_type, basic_data_types _value_type) : key_type(_key_type), value_type(_value_type) {
+        allocate(GROUP);
+    }
+
+    hash_map(const hash_map &) = delete;
+
+    ~hash_map() {
+        for (int i = 0; i < capacity; i++) {
+            if (key_type == CHAR && ctrl[i] < EMPTY) delete (slot *) entries[i].key;
+        }
+        release();
+    }
+
+    static uint64_t mix(uint64_t x) {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    static key_ref int_key(int_tp k) {
+        key_ref r;
+        r.int_val = k;
+        r.hash = mix((uint64_t) k);
+        return r;
+    }
+
+    static key_ref string_key(const char_tp *chars, int len) {
+        key_ref r;
+        r.chars = chars;
+        r.len = len;
+        uint64_t h = 1469598103934665603ULL;
+        for (int i = 0; i < len; i++) h = (h ^ (unsigned char) chars[i]) * 1099511628211ULL;
+        r.hash = mix(h);
+        return r;
+    }
+
+    key_ref key_of(const slot *k) const {
+        if (key_type == INT) {
+            if (k->type != INT && k->type != CHAR) panic("Map key must be an int");
+            return int_key(k->as_int());
+        }
+        if (k->type != ARRAY || k->arr_element_type != CHAR) panic("Map key must be a string");
+        const char_tp *chars = (const char_tp *) k->array_val;
+        const char_tp *end = (const char_tp *) memchr(chars, '\0', k->array_size);
+        return string_key(chars, end == nullptr ? k->array_size : (int) (end - chars));
+    }
+
+    key_ref entry_key(const entry &e) const {
+        if (key_type == INT) return int_key(e.key);
+        slot *s = (slot *) e.key;
+        return string_key(s->chars(), s->array_size);
+    }
+
+    int_tp word_of(const slot *val) const {
+        if (val->type == ARRAY || val->type == MAP) panic("Map values must be int, float or char");
+        if (value_type == FLOAT) {
+            float_tp f = val->as_float();
+            int_tp bits;
+            memcpy(&bits, &f, sizeof(bits));
+            return bits;
+        }
+        return value_type == INT ? val->as_int() : (int_tp) val->as_char();
+    }
+
+    slot *value_slot(int_tp word) const {
+        if (value_type == FLOAT) {
+            float_tp f;
+            memcpy(&f, &word, sizeof(f));
+            return new slot(f);
+        }
+        return value_type == INT ? new slot(word) : new slot((char_tp) word);
+    }
+
+    // Bucket holding the key, or -1
+    int find(const key_ref &k) const {
+        auto tag = (uint8_t) (k.hash & 0x7f);
+        int mask = capacity - 1, pos = (int) (k.hash >> 7) & mask;
+        for (int stride = GROUP;; stride += GROUP) {
+            for (unsigned m = group_match(ctrl + pos, tag); m; m &= m - 1) {
+                int i = (pos + __builtin_ctz(m)) & mask;
+                if (matches(i, k)) return i;
+            }
+            if (group_match(ctrl + pos, EMPTY)) return -1;
+            pos = (pos + stride) & mask;
+        }
+    }
+
+    void put(const key_ref &k, int_tp value) {
+        int i = find(k);
+        if (i >= 0) {
+            entries[i].value = value;
+            return;
+        }
+        if ((int_tp) (used + 1) * 8 > (int_tp) capacity * 7) {
+            // Grow, or just sweep out the DELETED buckets when they make up most of the load
+            int cap = GROUP;
+            while ((int_tp) cap * 7 < (int_tp) (size + 1) * 16) cap *= 2;
+            rehash(cap);
+        }
+        i = free_bucket(k.hash);
+        if (ctrl[i] == EMPTY) used++;
+        set_ctrl(i, (uint8_t) (k.hash & 0x7f));
+        entries[i].key = key_type == INT ? k.int_val : (int_tp) string_slot(k.chars, k.len);
+        entries[i].value = value;
+        size++;
+    }
+
+    bool erase(const key_ref &k) {
+        int i = find(k);
+        if (i < 0) return false;
+        if (key_type == CHAR) delete (slot *) entries[i].key;
+        // If no run of GROUP buckets around i has ever been full, no probe went past i to reach a later
+        // group, so the bucket can be EMPTY again instead of DELETED
+        unsigned before = group_match(ctrl + ((i - GROUP) & (capacity - 1)), EMPTY);
+        unsigned after = group_match(ctrl + i, EMPTY);
+        if (before && after && __builtin_ctz(after) + __builtin_clz(before) - 16 < GROUP) {
+            set_ctrl(i, EMPTY);
+            used--;
+        } else {
+            set_ctrl(i, DELETED);
+        }
+        size--;
+        return true;
+    }
+
+    int_tp value(int i) const {
+        return entries[i].value;
+    }
+
+    // Calls f(key, value) for every entry, in bucket order
+    template<typename F>
+    void each(F f) const {
+        for (int i = 0; i < capacity; i++) {
+            if (ctrl[i] < EMPTY) f(entries[i].key, entries[i].value);
+        }
+    }
+
+private:
+    // A power of two, at least GROUP
+    int capacity = 0;
+    // Buckets that are not EMPTY
+    int used = 0;
+    // capacity + GROUP - 1 bytes: the first GROUP - 1 are repeated at the end, so that a group can be loaded
+    // starting at any bucket
+    uint8_t *ctrl = nullptr;
+    entry *entries = nullptr;
+
+    size_t bytes() const {
+        return (size_t) capacity * (sizeof(entry) + 1) + GROUP - 1;
+    }
+
+    void allocate(int cap) {
+        capacity = cap;
+        used = 0;
+        Quota::allocate(bytes());
+        ctrl = new uint8_t[capacity + GROUP - 1];
+        memset(ctrl, EMPTY, capacity + GROUP - 1);
+        entries = new entry[capacity];
+    }
+
+    void release() {
+        Quota::release(bytes());
+        delete[] ctrl;
+        delete[] entries;
+    }
+
+    void set_ctrl(int i, uint8_t c) {
+        ctrl[i] = c;
+        if (i < GROUP - 1) ctrl[capacity + i] = c;
+    }
+
+    bool matches(int i, const key_ref &k) const {
+        if (key_type == INT) return entries[i].key == k.int_val;
+        slot *s = (slot *) entries[i].key;
+        return s->array_size == k.len && memcmp(s->chars(), k.chars, k.len) == 0;
+    }
+
+    int free_bucket(uint64_t hash) const {
+        int mask = capacity - 1, pos = (int) (hash >> 7) & mask;
+        for (int stride = GROUP;; stride += GROUP) {
+            unsigned m = group_free(ctrl + pos);
+            if (m) return (pos + __builtin_ctz(m)) & mask;
+            pos = (pos + stride) & mask;
+        }
+    }
+
+    void rehash(int cap) {
+        int old_capacity = capacity;
+        uint8_t *old_ctrl = ctrl;
+        entry *old_entries = entries;
+        Quota::allocate((size_t) cap * (sizeof(entry) + 1) + GROUP - 1);
+        Quota::release(bytes());
+        capacity = cap;
+        used = size;
+        ctrl = new uint8_t[capacity + GROUP - 1];
+        memset(ctrl, EMPTY, capacity + GROUP - 1);
+        entries = new entry[capacity];
+        for (int j = 0; j < old_capacity; j++) {
+            if (old_ctrl[j] >= EMPTY) continue;
+            key_ref k = entry_key(old_entries[j]);
+            int i = free_bucket(k.hash);
+            set_ctrl(i, (uint8_t) (k.hash & 0x7f));
+            entries[i] = old_entries[j];
+        }
+        delete[] old_ctrl;
+        delete[] old_entries;
+    }
+};
+
+const int hash_map::GROUP;
+const uint8_t hash_map::EMPTY;
+const uint8_t hash_map::DELETED;
+
+void free_map(hash_map *m) {
+    delete m;
+}
+
+int map_size(const hash_map *m) {
+    return m->size;
+}
+
+// Operators, shared by the interpreter and programs translated to C++ (-c). Always inlined: the interpreter
+// loop stays as it was, and in a translated program the operator is a constant, so only its own case is left.
+// Each returns a new slot, or nullptr when the operator does not apply to the operand types.
+inline __attribute__((always_inline)) slot *binary_op(int op, slot *left, slot *right) {
+    slot *res = nullptr;
+    switch (op) {
+        // +
+        case 0:
+            if (left->type == INT && right->type == INT) {
+                res = new slot(left->int_val + right->int_val);
+            } else if (left->type == INT && right->type == FLOAT) {
+                res = new slot(left->int_val + right->float_val);
+            } else if (left->type == FLOAT && right->type == INT) {
+                res = new slot(left->float_val + right->int_val);
+            } else if (left->type == FLOAT && right->type == FLOAT) {
+                res = new slot(left->float_val + right->float_val);
+            }
+            break;
+        // -
+        case 1:
+            if (left->type == INT && right->type == INT) {
+                res = new slot(left->int_val - right->int_val);
+            } else if (left->type == INT && right->type == FLOAT) {
+                res = new slot(left->int_val - right->float_val);
+            } else if (left->type == FLOAT && right->type == INT) {
+                res = new slot(left->float_val - right->int_val);
+            } else if (left->type == FLOAT && right->type == FLOAT) {
+                res = new slot(left->float_val - right->float_val);
+            }
+            break;
+        // *
+        case 2:
+            if (left->type == INT && right->type == INT) {
+                res = new slot(left->int_val * right->int_val);
+            } else if (left->type == INT && right->type == FLOAT) {
+                res = new slot(left->int_val * right->float_val);
+            } else if (left->type == FLOAT && right->type == INT) {
+                res = new slot(left->float_val * right->int_val);
+            } else if (left->type == FLOAT && right->type == FLOAT) {
+                res = new slot(left->float_val * right->float_val);
+            }
+            break;
+        // %
+        case 3:
+            if (left->type == INT && right->type == INT) {
+                res = new slot(left->int_val % right->int_val);
+            }
+            break;
+        // /
+        case 4:
+            if (left->type == INT && right->type == INT) {
+                res = new slot(left->int_val / right->int_val);
+            } else if (left->type == INT && right->type == FLOAT) {
+                res = new slot(left->int_val / right->float_val);
+            } else if (left->type == FLOAT && right->type == INT) {
+                res = new slot(left->float_val / right->int_val);
+            } else if (left->type == FLOAT && right->type == FLOAT) {
+                res = new slot(left->float_val / right->float_val);
+            }
+            break;
+        // &
+        case 5:
+            if (left->type == INT && right->type == INT) {
+                res = new slot((int_tp) ((unsigned int) left->int_val & (unsigned int) right->int_val));
+            }
+            break;
+        // |
+        case 6:
+            if (left->type == INT && right->type == INT) {
+                res = new slot((int_tp) ((unsigned int) left->int_val | (unsigned int) right->int_val));
+            }
+            break;
+        // <<
+        case 7:
+            if (left->type == INT && right->type == INT) {
+                res = new slot((int_tp) ((unsigned int) left->int_val << (unsigned int) right->int_val));
+            }
+            break;
+        // >>
+        case 8:
+            if (left->type == INT && right->type == INT) {
+                res = new slot((int_tp) ((unsigned int) left->int_val >> (unsigned int) right->int_val));
+            }
+            break;
+        // ^
+        case 9:
+            if (left->type == INT && right->type == INT) {
+                res = new slot((int_tp) ((unsigned int) left->int_val ^ (unsigned int) right->int_val));
+            }
+            break;
+        // <
+        case 10:
+            if (left->type == INT && right->type == INT) {
+                res = new slot(left->int_val < right->int_val);
+            } else if (left->type == INT && right->type == FLOAT) {
+                res = new slot(left->int_val < right->float_val);
+            } else if (left->type == FLOAT && right->type == INT) {
+                res = new slot(left->float_val < right->int_val);
+            } else if (left->type == FLOAT && right->type == FLOAT) {
+                res = new slot(left->float_val < right->float_val);
+            }
+            break;
+        // <=
+        case 11:
+            if (left->type == INT && right->type == INT) {
+                res = new slot(left->int_val <= right->int_val);
+            } else if (left->type == INT && right->type == FLOAT) {
+                res = new slot(left->int_val <= right->float_val);
+            } else if (left->type == FLOAT && right->type == INT) {
+                res = new slot(left->float_val <= right->int_val);
+            } else if (left->type == FLOAT && right->type == FLOAT) {
+                res = new slot(left->float_val <= right->float_val);
+            }
+            break;
+        // >
+        case 12:
+            if (left->type == INT && right->type == INT) {
+                res = new slot(left->int_val > right->int_val);
+            } else if (left->type == INT && right->type == FLOAT) {
+                res = new slot(left->int_val > right->float_val);
+            } else if (left->type == FLOAT && right->type == INT) {
+                res = new slot(left->float_val > right->int_val);
+            } else if (left->type == FLOAT && right->type == FLOAT) {
+                res = new slot(left->float_val > right->float_val);
+            }
+            break;
+        // >=
+        case 13:
+            if (left->type == INT && right->type == INT) {
+                res = new slot(left->int_val >= right->int_val);
+            } else if (left->type == INT && right->type == FLOAT) {
+                res = new slot(left->int_val >= right->float_val);
+            } else if (left->type == FLOAT && right->type == INT) {
+                res = new slot(left->float_val >= right->int_val);
+            } else if (left->type == FLOAT && right->type == FLOAT) {
+                res = new slot(left->float_val >= right->float_val);
+            }
+            break;
+        // ==
+        case 14:
+            if (left->type == INT && right->type == INT) {
+                res = new slot(left->int_val == right->int_val);
+            } else if (left->type == FLOAT && right->type == FLOAT) {
+                res = new slot(left->float_val == right->float_val);
+            } else if (left->type == CHAR && right->type == CHAR) {
+                res = new slot(left->char_val == right->char_val);
+            } else {
+                res = new slot(false);
+            }
+            break;
+        // !=
+        case 15:
+            if (left->type == INT && right->type == INT) {
+                res = new slot(left->int_val != right->int_val);
+            } else if (left->type == FLOAT && right->type == FLOAT) {
+                res = new slot(left->float_val != right->float_val);
+            } else if (left->type == CHAR && right->type == CHAR) {
+                res = new slot(left->char_val != right->char_val);
+            } else {
+                res = new slot(true);
+            }
+            break;
+    }
+    return res;
+}
+
+// binary_op on two ints, without looking at the types
+inline __attribute__((always_inline)) slot *int_binary_op(int op, int_tp l, int_tp r) {
+    switch (op) {
+        case 0: return new slot(l + r);
+        case 1: return new slot(l - r);
+        case 2: return new slot(l * r);
+        case 3: return new slot(l % r);
+        case 4: return new slot(l / r);
+        case 5: return new slot((int_tp) ((unsigned int) l & (unsigned int) r));
+        case 6: return new slot((int_tp) ((unsigned int) l | (unsigned int) r));
+        case 7: return new slot((int_tp) ((unsigned int) l << (unsigned int) r));
+        case 8: return new slot((int_tp) ((unsigned int) l >> (unsigned int) r));
+        case 9: return new slot((int_tp) ((unsigned int) l ^ (unsigned int) r));
+        case 10: return new slot(l < r);
+        case 11: return new slot(l <= r);
+        case 12: return new slot(l > r);
+        case 13: return new slot(l >= r);
+        case 14: return new slot(l == r);
+        case 15: return new slot(l != r);
+        default: return nullptr;
+    }
+}
+
+inline __attribute__((always_inline)) slot *unary_op(int op, slot *operand) {
+    slot *res = nullptr;
+    switch (op) {
+        // NOT
+        case 0:
+            if (operand->type == INT) {
+                res = new slot((int_tp) (operand->int_val ? 0 : 1));
+            }
+            break;
+        // NEGATIVE
+        case 1:
+            if (operand->type == INT) {
+                res = new slot(-operand->int_val);
+            } else if (operand->type == FLOAT) {
+                res = new slot(-operand->float_val);
+            }
+            break;
+    }
+    return res;
+}
+
+// TYPE_CVT
+inline __attribute__((always_inline)) slot *convert(int type, slot *op) {
+    slot *res = nullptr;
+    switch (type) {
+        // INT
+        case 0:
+            if (op->type == INT) {
+                res = new slot((int_tp) op->int_val);
+            } else if (op->type == FLOAT) {
+                res = new slot((int_tp) op->float_val);
+            }
+            break;
+        // FLOAT
+        case 1:
+            if (op->type == INT) {
+                res = new slot((float_tp) op->int_val);
+            } else if (op->type == FLOAT) {
+                res = new slot((float_tp) op->float_val);
+            }
+            break;
+        // CHAR
+        case 2:
+            res = new slot((char_tp) op->char_val);
+            break;
+    }
+    return res;
+}
+
+typedef slot **T_OPSTACK;
+typedef slot **T_VARIABLES;
+
+// Instruction = Code + no more than 1 operand
+struct instruct {
+    instruct_code code = NOOP;
+    int operand{};
+    int address = -1;
+
+    instruct(int _addr, instruct_code _code, int _operand) : address(_addr), code(_code), operand(_operand) {}
+
+    instruct(int _addr, instruct_code _code) : address(_addr), code(_code) {}
+
+    instruct() = default;
+};
+
+// Instructions whose operand is a code address (an instruction index once linked)
+bool code_operand(instruct_code code) {
+    return code == JMP || code == JMP_TRUE || code == JMP_FALSE || code == CALL || code == SPAWN_CALL
+           || code == COROUTINE_CALL || code == CALL_ARGS;
+}
+
+// Stacks of a coroutine
+//
+// A segment per coroutine: the global operand stack, a guard page, the control stack, another guard page.
+// Frames are laid out one after another on the control stack, each followed by its own operand stack, so a
+// callee's frame starts right above the caller's top operand. Pushes are not checked: running past either
+// stack touches a guard page, and the SIGSEGV handler turns that into a "Stack overflow" runtime error.
+// Segments reserve address space only; pages are backed when first touched, so stacks grow on demand
+// up to the limit (-k).
+//
+// Segments are carved out of one mapping per BATCH of them and never unmapped, so that live coroutines do
+// not each take kernel mappings (vm.max_map_count, 65530 by default). The guard pages are guard regions
+// (MADV_GUARD_INSTALL, Linux 6.13), which do not split the mapping. Older kernels fall back to mprotect,
+// which costs 4 mappings per segment; past a quarter of vm.max_map_count, segments get no guard pages.
+class StackSegment {
+private:
+    static const int BATCH = 64;
+    static const int MADV_GUARD = 102;
+    static size_t page;
+    char *base = nullptr;
+    size_t size = 0;
+    // Running stack segment of this thread, looked up by the fault handler
+    static thread_local const StackSegment *running;
+    // Segments of finished coroutines kept as they are, so creating a coroutine costs no system calls
+    static thread_local std::vector<char *> spare;
+    // Segments not in use by any thread, with their pages given back
+    static std::vector<char *> pool;
+    static std::mutex pool_lock;
+    static bool guard_regions;
+    static long long guards_left;
+
+    // Only async-signal-safe calls here: the interpreter is in an unknown state and the stack is exhausted
+    static void fault_handler(int, siginfo_t *info, void *) {
+        auto *addr = (const char *) info->si_addr;
+        if (running != nullptr && addr >= running->base && addr < running->base + running->size) {
+            // The fault is a push or a frame set up by the interpreter itself, never inside the library
+            report_stack_overflow();
+            signal(SIGABRT, SIG_DFL);
+            raise(SIGABRT);
+        }
+        signal(SIGSEGV, SIG_DFL);
+    }
+
+    static bool install_fault_handler() {
+        struct sigaction sa{};
+        sa.sa_sigaction = fault_handler;
+        // On the alternate stack where one is set up: a translated program (-c) overflows the native stack itself
+        sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGSEGV, &sa, nullptr);
+        return true;
+    }
+
+    static long long max_map_count() {
+        std::ifstream in("/proc/sys/vm/max_map_count");
+        long long n = 65530;
+        in >> n;
+        return n;
+    }
+
+    static void guard(char *p) {
+        if (guard_regions && madvise(p, page, MADV_GUARD) == 0) return;
+        guard_regions = false;
+        if (mprotect(p, page, PROT_NONE) != 0) {
+            panic("Cannot protect a stack guard page");
+        }
+    }
+
+    // Called with pool_lock held
+    void map_batch(size_t operand_bytes) {
+        void *p = mmap(nullptr, size * BATCH, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                       -1, 0);
+        if (p == MAP_FAILED) {
+            panic("Cannot map a stack segment");
+        }
+        for (int k = BATCH - 1; k >= 0; k--) {
+            char *segment = (char *) p + size * k;
+            if (guard_regions || guards_left > 0) {
+                guard(segment + operand_bytes);
+                guard(segment + size - page);
+                if (!guard_regions) guards_left--;
+            }
+            pool.push_back(segment);
+        }
+    }
+
+public:
+    // Bytes reserved per coroutine for both stacks, an eighth of it for the global operand stack
+    static size_t limit;
+    slot **operands = nullptr;
+    char *frames = nullptr;
+    size_t frame_bytes = 0;
+
+    StackSegment() {
+        static bool installed = install_fault_handler();
+        (void) installed;
+        if (page == 0) page = sysconf(_SC_PAGESIZE);
+        size_t operand_bytes = std::max(page, limit / 8 / page * page);
+        frame_bytes = std::max(page, (limit - operand_bytes) / page * page);
+        size = operand_bytes + page + frame_bytes + page;
+        if (!spare.empty()) {
+            base = spare.back();
+            spare.pop_back();
+        } else {
+            std::lock_guard<std::mutex> guard(pool_lock);
+            if (guards_left < 0) guards_left = max_map_count() / 4 / 4;
+            if (pool.empty()) map_batch(operand_bytes);
+            base = pool.back();
+            pool.pop_back();
+        }
+        operands = (slot **) base;
+        frames = base + operand_bytes + page;
+    }
+
+    StackSegment(const StackSegment &) = delete;
+
+    ~StackSegment() {
+        if (running == this) running = nullptr;
+        if (spare.size() < 16) {
+            spare.push_back(base);
+            return;
+        }
+        // Guard regions and PROT_NONE pages both survive MADV_DONTNEED
+        madvise(base, size, MADV_DONTNEED);
+        std::lock_guard<std::mutex> guard(pool_lock);
+        pool.push_back(base);
+    }
+
+    void enter() const {
+        running = this;
+    }
+};
+
+const int StackSegment::BATCH;
+const int StackSegment::MADV_GUARD;
+size_t StackSegment::page = 0;
+size_t StackSegment::limit = 64 << 20;
+thread_local const StackSegment *StackSegment::running = nullptr;
+thread_local std::vector<char *> StackSegment::spare;
+std::vector<char *> StackSegment::pool;
+std::mutex StackSegment::pool_lock;
+bool StackSegment::guard_regions = true;
+long long StackSegment::guards_left = -1;
+
+// Stack frame, placed on the control stack of its coroutine and followed by its locals, then its operand stack
+struct frame {
+    T_VARIABLES locals;
+    int var_cnt;
+    int return_ip{};
+    int op_top = -1;
+    // Frames on the control stack of the coroutine, this one included
+    int depth;
+    frame *caller;
+    T_OPSTACK local_operands;
+
+    explicit frame(frame *_caller, int _var_cnt = 0) : locals(reinterpret_cast<T_VARIABLES>(this + 1)),
+                                                       var_cnt(_var_cnt),
+                                                       depth(_caller != nullptr ? _caller->depth + 1 : 1),
+                                                       caller(_caller), local_operands(locals + _var_cnt) {}
+};
+
+// Coroutine (green thread)
+//
+// A coroutine owns its control stack and the operand stack used for passing arguments and
+// return values (the "global" operand stack); globals, constants and instructions are shared.
+// The machine always runs exactly one coroutine: the main one runs the program itself.
+// Switching saves esp/ip into the current coroutine and loads them from the next one.
+enum coroutine_status {
+    CO_SUSPENDED = 0,
+    CO_RUNNING,
+    CO_WAITING_INPUT,
+    CO_DEAD
+};
+
+struct coroutine {
+    frame *esp = nullptr;
+    int ip = -1;
+    StackSegment stack;
+    T_OPSTACK operands = stack.operands;
+    int op_top = -1;
+    coroutine_status status = CO_SUSPENDED;
+    // Coroutine that resumed this one and gets control back on YIELD
+    coroutine *resumer = nullptr;
+    // Resumed by SCHEDULE, which drops yielded values
+    bool scheduled = false;
+};
+
+// Debugger watchpoint on a global, or on one element of the array in a global.
+// The value is kept as raw bits, so checking it before every instruction is cheap.
+struct watchpoint {
+    int global{};
+    int element = -1;
+    const slot *array = nullptr;
+    basic_data_types type = VOID;
+    int_tp bits{};
+};
+
+// Code image: every loaded module, one after another, followed by a hidden COROUTINE_END.
+// link() turns jump and call targets from addresses into indices of this vector.
+std::vector<instruct> instructs;
+int ins_cnt = 0;
+// (address, index in instructs) sorted by address; used only while linking and by tools (debugger, snapshots)
+std::vector<std::pair<int, int>> addr_index;
+// First instruction of each module, in load order (the program itself first)
+std::vector<int> module_starts;
+// Exported function name -> address, and imported address -> function name, both after relocation
+std::unordered_map<std::string, int> exported;
+std::unordered_map<int, std::string> imported;
+// Function entered at each instruction, for CALL_ARGS: a function starting with `LOAD_GLOBAL` x argc; `VMALLOC n`
+// (argc is -1 at other instructions). The arguments go straight into locals 0 .. argc-1 when `STORE_NAME 0` ...
+// `STORE_NAME argc-1` follow; body is the first instruction the call does not do itself.
+struct call_entry {
+    int argc = -1;
+    int var_cnt = 0;
+    int body = 0;
+    bool direct = false;
+    // Index in memo_functions, or -1
+    int memo = -1;
+};
+std::vector<call_entry> call_entries;
+
+// Memoisation (-M, or the MEMO pragma)
+//
+// A function is memoised when link() proves it pure: no global variables, I/O, arrays, maps, strings, tasks,
+// coroutines or in-place operators, and only calls to pure functions. A CALL_ARGS to it with int and char
+// arguments looks the arguments up in a per-machine cache of the function; a hit replaces them with the
+// cached result without building a frame, a miss runs the call and stores the int, char or float result
+// when its frame returns. The cache is direct-mapped, so a new result evicts the one in its place.
+struct memo_cache {
+    static const int MAX_ARGS = 4;
+    static const int SIZE = 1 << 12;
+    struct entry {
+        bool used = false;
+        // Bit i set: argument i is a char
+        int chars = 0;
+        int_tp args[MAX_ARGS]{};
+        basic_data_types type = VOID;
+        int_tp bits = 0;
+    };
+    // Allocated on the first call
+    std::vector<entry> entries;
+    long long hits = 0, misses = 0, evictions = 0;
+};
+// Memoise every pure function, not only those marked MEMO
+bool memo_all = false;
+// Entry (instruction index) of each memoised function
+std::vector<int> memo_functions;
+// Addresses marked MEMO, after relocation
+std::vector<int> memo_marks;
+
+// Debug section of a program (optional), read by the loaders like EXPORT:
+//   addr FUNCTION name   the function entered at addr is called name
+//   addr LINE n          the code from addr up to the next LINE entry comes from source line n (0: unknown)
+// A function extends to the next FUNCTION entry. Both tables are sorted by address once loaded and
+// searched by binary search; nothing is kept per instruction.
+class SourceMap {
+private:
+    std::vector<std::pair<int, std::string>> functions;
+    std::vector<std::pair<int, int>> lines;
+
+    template <class T>
+    static void sort_unique(std::vector<std::pair<int, T>> &v) {
+        // Of several entries at one address the first one added is kept
+        std::stable_sort(v.begin(), v.end(), [](const std::pair<int, T> &a, const std::pair<int, T> &b) {
+            return a.first < b.first;
+        });
+        v.erase(std::unique(v.begin(), v.end(), [](const std::pair<int, T> &a, const std::pair<int, T> &b) {
+            return a.first == b.first;
+        }), v.end());
+    }
+
+    template <class T>
+    static const std::pair<int, T> *at_or_before(const std::vector<std::pair<int, T>> &v, int address) {
+        auto it = std::upper_bound(v.begin(), v.end(), address, [](int a, const std::pair<int, T> &e) {
+            return a < e.first;
+        });
+        return it == v.begin() ? nullptr : &*(it - 1);
+    }
+
+public:
+    void add_function(int address, const std::string &name) {
+        functions.emplace_back(address, name);
+    }
+
+    void add_line(int address, int line) {
+        lines.emplace_back(address, line);
+    }
+
+    // Call once everything is added
+    void seal() {
+        sort_unique(functions);
+        sort_unique(lines);
+    }
+
+    void clear() {
+        functions.clear();
+        lines.clear();
+    }
+
+    const std::vector<std::pair<int, std::string>> &function_entries() const {
+        return functions;
+    }
+
+    const std::vector<std::pair<int, int>> &line_entries() const {
+        return lines;
+    }
+
+    // (entry address, name) of the function the code at address belongs to, or nullptr before the first one
+    const std::pair<int, std::string> *function_entry(int address) const {
+        return at_or_before(functions, address);
+    }
+
+    std::string function(int address) const {
+        const auto *f = function_entry(address);
+        return f == nullptr ? "main" : f->second;
+    }
+
+    // Source line of the code at address, 0 if unknown
+    int line(int address) const {
+        const auto *l = at_or_before(lines, address);
+        return l == nullptr ? 0 : l->second;
+    }
+
+    // "in function, line n"
+    std::string where(int address) const {
+        int n = line(address);
+        return "in " + function(address) + (n ? ", line " + std::to_string(n) : "");
+    }
+
+    std::string describe(int address) const {
+        return "#" + std::to_string(address) + " " + where(address);
+    }
+};
+
+// Of the code image, completed by link() with exports, other call targets and module top levels
+SourceMap source_map;
+// Index of the instruction the interpreter of this thread is running, for panic
+thread_local const int *running_ip = nullptr;
+// The code image as linked, kept when breakpoints may be placed. A BREAKPOINT runs the original
+// instruction from here; it is never written while the program runs, so task threads need no lock.
+std::vector<instruct> original_instructs;
+// Ips replaced by BREAKPOINT. Only the debugger and the snapshot stop touch it.
+std::set<int> breakpoints;
+slot **constants;
+T_VARIABLES globals;
+int var_cnt = 0;
+int constant_cnt = 0;
+
+// VMALLOC at the top level: each module allocates its globals after those of the modules before it
+void grow_globals(int n) {
+    if (n <= var_cnt) return;
+    auto **grown = new slot *[n];
+    std::copy(globals, globals + var_cnt, grown);
+    std::fill(grown + var_cnt, grown + n, nullptr);
+    delete[] globals;
+    globals = grown;
+    var_cnt = n;
+}
+
+class Machine;
+
+// Post-initialisation snapshot (-s)
+//
+// Top-level setup (lookup tables, string and array literals, ...) runs before the program does anything
+// observable. With -s, a run without a usable snapshot stops at the first top-level instruction that is
+// not pure computation on globals (I/O, a call, a task or coroutine, HALT), saves constants, globals and
+// the operand stack there and carries on; later runs of the same program restore them and start at
+// that instruction. The stopping points are BREAKPOINT patches, so the normal loop is not slowed down.
+//
+// Slots are written once each and referenced by number, so sharing between globals, constants and
+// operands survives, and their reference counts are kept as they were.
+class Snapshot {
+private:
+    std::unordered_map<const slot *, int> ids;
+    std::vector<slot *> table;
+
+    static void write_slot(std::ostream &os, slot *s) {
+        os << s->ref_cnt << " ";
+        switch (s->type) {
+            case INT:
+                os << "I " << s->int_val;
+                break;
+            case FLOAT: {
+                long long bits;
+                memcpy(&bits, &s->float_val, sizeof(bits));
+                os << "F " << bits;
+                break;
+            }
+            case CHAR:
+                os << "C " << (int) s->char_val;
+                break;
+            case ARRAY: {
+                os << "A " << s->arr_element_type << " " << s->array_size << " " << (s->shape ? s->shape[0] : 0);
+                for (int i = 1; s->shape && i <= s->shape[0]; i++) os << " " << s->shape[i];
+                std::string bytes((const char *) s->array_val, s->array_size * s->element_size());
+                os << " " << (bytes.empty() ? "-" : hex_encode(bytes));
+                break;
+            }
+            case MAP: {
+                hash_map *m = s->map_val;
+                os << "M " << m->key_type << " " << m->value_type << " " << m->size;
+                m->each([&](int_tp key, int_tp value) {
+                    if (m->key_type == INT) {
+                        os << " " << key;
+                    } else {
+                        slot *k = (slot *) key;
+                        os << " " << (k->array_size ? hex_encode(std::string(k->chars(), k->array_size)) : "-");
+                    }
+                    os << " " << value;
+                });
+                break;
+            }
+            default:
+                os << "V";
+                break;
+        }
+        os << "\n";
+    }
+
+    static slot *read_slot(std::istream &is) {
+        int ref_cnt;
+        std::string kind;
+        is >> ref_cnt >> kind;
+        slot *s;
+        if (kind == "I") {
+            int_tp v;
+            is >> v;
+            s = new slot(v);
+        } else if (kind == "F") {
+            long long bits;
+            float_tp v;
+            is >> bits;
+            memcpy(&v, &bits, sizeof(v));
+            s = new slot(v);
+        } else if (kind == "C") {
+            int v;
+            is >> v;
+            s = new slot((char_tp) v);
+        } else if (kind == "A") {
+            int type, size, dims;
+            is >> type >> size >> dims;
+            s = new slot(size, (basic_data_types) type);
+            if (dims) {
+                s->shape = new int[dims + 1];
+                s->shape[0] = dims;
+                for (int i = 1; i <= dims; i++) is >> s->shape[i];
+            }
+            std::string hex;
+            is >> hex;
+            std::string bytes;
+            if (hex != "-" && !hex_decode(hex, bytes)) panic("Corrupted snapshot");
+            if (bytes.size() != size * s->element_size()) panic("Corrupted snapshot");
+            memcpy(s->array_val, bytes.data(), bytes.size());
+        } else if (kind == "M") {
+            int key_type, value_type, size;
+            is >> key_type >> value_type >> size;
+            auto *m = new hash_map((basic_data_types) key_type, (basic_data_types) value_type);
+            for (int i = 0; i < size; i++) {
+                int_tp value;
+                if (key_type == INT) {
+                    int_tp key;
+                    is >> key >> value;
+                    m->put(hash_map::int_key(key), value);
+                } else {
+                    std::string hex;
+                    is >> hex >> value;
+                    std::string bytes;
+                    if (hex != "-" && !hex_decode(hex, bytes)) panic("Corrupted snapshot");
+                    m->put(hash_map::string_key(bytes.data(), (int) bytes.size()), value);
+                }
+            }
+            s = new slot(m);
+        } else {
+            s = new slot();
+        }
+        s->ref_cnt = ref_cnt;
+        return s;
+    }
+
+    int id_of(slot *s) {
+        if (s == nullptr) return -1;
+        auto it = ids.find(s);
+        if (it != ids.end()) return it->second;
+        ids[s] = (int) table.size();
+        table.push_back(s);
+        return (int) table.size() - 1;
+    }
+
+public:
+    static std::string path;
+    // FNV-1a of the program file, so a snapshot is never applied to another program
+    static unsigned long long program_hash;
+    static bool pending;
+
+    static unsigned long long hash(const std::string &content) {
+        unsigned long long h = 1469598103934665603ULL;
+        for (unsigned char c : content) h = (h ^ c) * 1099511628211ULL;
+        return h;
+    }
+
+    // Instructions that may run before the snapshot is taken
+    static bool pure(const instruct &ins) {
+        switch (ins.code) {
+            case CALL_NATIVE:
+                return ins.operand != NATIVE_WRITE_INT && ins.operand != NATIVE_WRITE_STR
+                       && ins.operand != NATIVE_READ_STR;
+            case VMALLOC: case NOOP: case POP_OP: case TYPE_CVT: case LOAD_NULL: case LOAD_CONSTANT:
+            case LOAD_NAME: case LOAD_NAME_GLOBAL: case LOAD_INT: case LOAD_FLOAT: case LOAD_CHAR: case LOAD_STRING:
+            case STORE_NAME: case STORE_NAME_NOPOP: case STORE_NAME_GLOBAL: case STORE_NAME_GLOBAL_NOPOP:
+            case JMP: case JMP_TRUE: case JMP_FALSE: case BINARY_OP: case BINARY_OP_INT: case UNARY_OP:
+            case LOAD_GLOBAL: case STORE_GLOBAL:
+            case BUILD_ARR: case BINARY_SUBSCR: case STORE_SUBSCR: case STORE_SUBSCR_INPLACE: case STORE_SUBSCR_NOPOP:
+            case BINARY_SUBSCR_UNCHECKED: case STORE_SUBSCR_UNCHECKED: case SUBSCR_2D: case STORE_SUBSCR_2D:
+            case SIZE_OF: case BUILD_MAP: case MAP_GET: case MAP_PUT: case MAP_DEL: case MAP_HAS: case MAP_SIZE:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    void save(int address, slot **operands, int op_cnt) {
+        std::stringstream body;
+        std::vector<int> constant_ids, global_ids, operand_ids;
+        for (int i = 0; i < constant_cnt; i++) constant_ids.push_back(id_of(constants[i]));
+        for (int i = 0; i < var_cnt; i++) global_ids.push_back(id_of(globals[i]));
+        for (int i = 0; i < op_cnt; i++) operand_ids.push_back(id_of(operands[i]));
+        std::ofstream os(path, std::ios::out | std::ios::trunc);
+        os << "SVMSNAP " << program_hash << " " << address << "\n" << table.size() << "\n";
+        for (slot *s : table) write_slot(os, s);
+        for (const std::vector<int> *v : {&constant_ids, &global_ids, &operand_ids}) {
+            os << v->size();
+            for (int id : *v) os << " " << id;
+            os << "\n";
+        }
+    }
+
+    // Address to start at, or -1 when there is no snapshot of this program
+    int load(std::vector<slot *> &operands) {
+        std::ifstream is(path, std::ios::in);
+        std::string hd;
+        unsigned long long h;
+        int address, n;
+        if (!(is >> hd >> h >> address >> n) || hd != "SVMSNAP" || h != program_hash) return -1;
+        for (int i = 0; i < n; i++) table.push_back(read_slot(is));
+        auto get = [&](int id) -> slot * {
+            if (id < -1 || id >= n) panic("Corrupted snapshot");
+            return id < 0 ? nullptr : table[id];
+        };
+        int cnt, id;
+        is >> cnt;
+        if (cnt != constant_cnt) panic("Corrupted snapshot");
+        for (int i = 0; i < cnt; i++) {
+            is >> id;
+            delete constants[i];
+            constants[i] = get(id);
+        }
+        is >> cnt;
+        var_cnt = cnt;
+        globals = cnt ? new slot *[cnt] : nullptr;
+        for (int i = 0; i < cnt; i++) {
+            is >> id;
+            globals[i] = get(id);
+        }
+        is >> cnt;
+        for (int i = 0; i < cnt; i++) {
+            is >> id;
+            operands.push_back(get(id));
+        }
+        if (!is) panic("Corrupted snapshot");
+        return address;
+    }
+};
+
+std::string Snapshot::path;
+unsigned long long Snapshot::program_hash = 0;
+bool Snapshot::pending = false;
+
+// Execution trace (-t)
+//
+// Cheap enough to leave on: only control transfers are recorded, the instructions between two of them ran
+// one after another. A record is a varint (run << 3 | kind), run being the number of instructions executed
+// since the previous record, and a varint argument: the target of a transfer as a zigzag delta from the
+// instruction after the source, the byte read for INPUT (256 at end of input), the instruction the current
+// run started at for SYNC. Records go into a ring of 64KB chunks. Every chunk starts with a SYNC, so decoding
+// can begin at any chunk, and no record crosses a chunk boundary (the rest of the chunk is PAD).
+// The file is written at exit, on panic and on SIGINT/SIGTERM: a header with the code image (address and
+// opcode of each instruction) and the source map, then the chunks still in the ring, oldest first. Tasks (SPAWN) are not traced.
+class Trace {
+public:
+    enum kind {
+        JUMP, CALL, RET, SWITCH, INPUT, SYNC, END, PAD
+    };
+    static const size_t CHUNK = 1 << 16;
+    static std::string path;
+    // Ring size in bytes, a power of two
+    static size_t size;
+    static bool on;
+
+private:
+    static unsigned char *ring;
+    static size_t pos;
+    static int from;
+    static std::string header;
+    static std::thread::id owner;
+
+    static void put(unsigned long long v) {
+        while (v >= 0x80) {
+            ring[pos++ & (size - 1)] = (unsigned char) (v | 0x80);
+            v >>= 7;
+        }
+        ring[pos++ & (size - 1)] = (unsigned char) v;
+    }
+
+    static void record(kind k, long long run, unsigned long long arg) {
+        size_t offset = pos & (CHUNK - 1);
+        if (offset == 0 || offset > CHUNK - 24) {
+            while (pos & (CHUNK - 1)) ring[pos++ & (size - 1)] = PAD;
+            put(SYNC);
+            put(from);
+        }
+        put((unsigned long long) std::max(run, 0LL) << 3 | k);
+        put(arg);
+    }
+
+    static void write_all(int fd, const void *data, size_t len) {
+        auto *p = (const char *) data;
+        while (len > 0) {
+            ssize_t n = write(fd, p, len);
+            if (n <= 0) return;
+            p += n;
+            len -= n;
+        }
+    }
+
+    static void signal_handler(int sig) {
+        dump();
+        signal(sig, SIG_DFL);
+        raise(sig);
+    }
+
+public:
+    static void put_varint(std::string &out, unsigned long long v) {
+        while (v >= 0x80) {
+            out += (char) (v | 0x80);
+            v >>= 7;
+        }
+        out += (char) v;
+    }
+
+    static unsigned long long zigzag(long long d) {
+        return d < 0 ? ((unsigned long long) -(d + 1) << 1) | 1 : (unsigned long long) d << 1;
+    }
+
+    static long long unzigzag(unsigned long long v) {
+        return v & 1 ? -(long long) (v >> 1) - 1 : (long long) (v >> 1);
+    }
+
+    // Start recording before instruction first of the image code[0, cnt)
+    static void start(const std::vector<instruct> &code, int cnt, int first) {
+        header = "SVMTRACE\n";
+        put_varint(header, cnt);
+        int prev = 0;
+        for (int k = 0; k < cnt; k++) {
+            const instruct &ins = breakpoints.count(k) ? original_instructs[k] : code[k];
+            put_varint(header, zigzag((long long) ins.address - prev));
+            header += (char) ins.code;
+            prev = ins.address;
+        }
+        put_varint(header, source_map.function_entries().size());
+        prev = 0;
+        for (const auto &f : source_map.function_entries()) {
+            put_varint(header, zigzag((long long) f.first - prev));
+            put_varint(header, f.second.size());
+            header += f.second;
+            prev = f.first;
+        }
+        put_varint(header, source_map.line_entries().size());
+        prev = 0;
+        for (const auto &l : source_map.line_entries()) {
+            put_varint(header, zigzag((long long) l.first - prev));
+            put_varint(header, l.second);
+            prev = l.first;
+        }
+        ring = new unsigned char[size];
+        pos = 0;
+        from = first;
+        owner = std::this_thread::get_id();
+        on = true;
+        signal(SIGINT, signal_handler);
+        signal(SIGTERM, signal_handler);
+    }
+
+    // Control goes from instruction at to instruction target
+    static void transfer(kind k, int at, int target) {
+        record(k, (long long) at - from + 1, zigzag((long long) target - at - 1));
+        from = target;
+    }
+
+    static void input(int c) {
+        if (on && std::this_thread::get_id() == owner) record(INPUT, 0, c == EOF ? 256 : c);
+    }
+
+    // The program stopped after instruction at
+    static void end(int at) {
+        record(END, (long long) at - from + 1, 0);
+    }
+
+    // Write the trace file; only async-signal-safe calls from here on
+    static void dump() {
+        if (!on) return;
+        on = false;
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return;
+        write_all(fd, header.data(), header.size());
+        size_t first = pos > size ? (pos & ~(CHUNK - 1)) + CHUNK - size : 0;
+        for (size_t p = first; p < pos; p += CHUNK) {
+            write_all(fd, ring + (p & (size - 1)), std::min(CHUNK, pos - p));
+        }
+        close(fd);
+    }
+};
+
+const size_t Trace::CHUNK;
+std::string Trace::path;
+size_t Trace::size = 16 << 20;
+bool Trace::on = false;
+unsigned char *Trace::ring = nullptr;
+size_t Trace::pos = 0;
+int Trace::from = 0;
+std::string Trace::header;
+std::thread::id Trace::owner;
+
+void trace_dump() {
+    Trace::dump();
+}
+
+// Execution profile for profile-guided optimisation (-P)
+//
+// Recorded by the evaluator (-e -P file) for the instructions of the program itself, leaving out linked
+// modules: how often each instruction ran, how often each conditional jump was taken, the operand types
+// seen by each operator and how often each function was called. The optimiser (-O -P file) reads it back.
+// Everything is keyed by instruction address, so a profile only fits the bytecode file it was recorded from.
+//   SVMPROF
+//   ins <address> <count>
+//   branch <address> <times taken>
+//   types <address> <bit 8 * left type + right type set for every pair seen (right type 0 for UNARY_OP)>
+//   call <function address> <calls>
+class Profile {
+public:
+    static std::string path;
+    // While recording, by instruction index
+    std::vector<long long> counts, taken, calls;
+    std::vector<uint64_t> types;
+    // Once loaded, by address
+    std::unordered_map<int, long long> count_at, taken_at, calls_at;
+    std::unordered_map<int, uint64_t> types_at;
+
+    static uint64_t type_bit(basic_data_types left, basic_data_types right) {
+        return 1ull << (left * 8 + right);
+    }
+
+    explicit Profile(size_t n = 0) : counts(n), taken(n), calls(n), types(n) {}
+
+    // The instructions before end
+    void save(int end) const {
+        std::ofstream os(path, std::ios::out | std::ios::trunc);
+        os << "SVMPROF\n";
+        for (int k = 0; k < end; k++) {
+            int address = instructs[k].address;
+            if (counts[k]) os << "ins " << address << " " << counts[k] << "\n";
+            if (taken[k]) os << "branch " << address << " " << taken[k] << "\n";
+            if (types[k]) os << "types " << address << " " << types[k] << "\n";
+            if (calls[k]) os << "call " << address << " " << calls[k] << "\n";
+        }
+    }
+
+    void load() {
+        std::ifstream is(path, std::ios::in);
+        std::string hd, kind;
+        if (!(is >> hd) || hd != "SVMPROF") {
+            panic("Not a profile: " + path);
+        }
+        int address;
+        unsigned long long value;
+        while (is >> kind >> address >> value) {
+            if (kind == "ins") count_at[address] = (long long) value;
+            else if (kind == "branch") taken_at[address] = (long long) value;
+            else if (kind == "types") types_at[address] = value;
+            else if (kind == "call") calls_at[address] = (long long) value;
+            else panic("Corrupted profile");
+        }
+    }
+
+    long long count(int address) const {
+        auto it = count_at.find(address);
+        return it == count_at.end() ? 0 : it->second;
+    }
+};
+
+std::string Profile::path;
+
+// Counters for the evaluator (-e)
+//
+// Hardware and software perf events of the interpreter thread, user space only, read together with one
+// read() of the group. Counters the kernel refuses (no PMU in a VM or container, perf_event_paranoid, no
+// Linux) are left out; wall-clock time is always there, so the evaluator falls back to it alone.
+class PerfCounters {
+public:
+    // cycles, instructions, branch-misses, cache-misses, page-faults, wall-clock ns
+    static const int N = 6;
+    static const int WALL = N - 1;
+    static const char *names[N];
+    bool available[N]{};
+
+private:
+    int leader = -1;
+    int fds[N - 1]{};
+    // Position of each counter in the group read, -1 if not opened
+    int position[N - 1]{};
+    int opened = 0;
+
+public:
+    PerfCounters() {
+        std::fill(fds, fds + N - 1, -1);
+        std::fill(position, position + N - 1, -1);
+#if defined(__linux__)
+        static const std::pair<int, int> events[N - 1] = {
+                {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+                {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+                {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+                {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+                {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS}
+        };
+        for (int i = 0; i < N - 1; i++) {
+            perf_event_attr attr{};
+            attr.size = sizeof(attr);
+            attr.type = events[i].first;
+            attr.config = events[i].second;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP;
+            attr.disabled = leader < 0;
+            fds[i] = (int) syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+            if (fds[i] < 0) continue;
+            if (leader < 0) leader = fds[i];
+            position[i] = opened++;
+            available[i] = true;
+        }
+#endif
+        available[WALL] = true;
+    }
+
+    PerfCounters(const PerfCounters &) = delete;
+
+    ~PerfCounters() {
+        for (int fd : fds) {
+            if (fd >= 0) close(fd);
+        }
+    }
+
+    bool hardware() const {
+        return available[0] || available[1] || available[2] || available[3];
+    }
+
+    void start() {
+#if defined(__linux__)
+        if (leader >= 0) {
+            ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+#endif
+    }
+
+    void read_all(unsigned long long values[N]) const {
+        unsigned long long buf[N] = {};
+        if (leader >= 0 && read(leader, buf, sizeof(buf)) < (ssize_t) sizeof(unsigned long long)) {
+            buf[0] = 0;
+        }
+        for (int i = 0; i < N - 1; i++) {
+            values[i] = position[i] >= 0 && position[i] < (int) buf[0] ? buf[1 + position[i]] : 0;
+        }
+        timespec ts{};
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        values[WALL] = (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+};
+
+const char *PerfCounters::names[N] = {"cycles", "instructions", "branch-misses", "cache-misses", "page-faults",
+                                      "wall-clock(ns)"};
+
+void trace_input(int c) {
+    Trace::input(c);
+}
+
+// Parallel tasks (SPAWN/JOIN)
+//
+// A task runs one slang function call on its own Machine (own frames and operand stacks) and
+// shares instructions, constants and globals with every other task. Memory model:
+//  * reference counts are atomic while tasks exist, so slots and arrays can be shared freely;
+//  * a task may read any global or array element; writes to the same global or array element
+//    from tasks that are not ordered by JOIN are a data race and must be avoided
+//    (disjoint writes, e.g. to different parts of one array, are fine);
+//  * everything a task did happens-before the JOIN that returns its result.
+struct task {
+    int entry{};
+    std::vector<slot *> args;
+    slot *result = nullptr;
+    std::atomic<bool> done{false};
+};
+
+// Work-stealing thread pool: every worker owns a deque, pushes and pops its own tasks at the back
+// and steals from the front of other deques when its own is empty. The thread that runs the
+// program is worker 0; a worker waiting in JOIN keeps running other tasks meanwhile.
+class TaskPool {
+private:
+    struct worker_queue {
+        std::mutex lock;
+        std::deque<task *> tasks;
+    };
+    std::vector<worker_queue *> queues;
+    std::vector<std::thread> threads;
+    std::vector<task *> handles;
+    std::mutex handles_lock;
+    std::mutex idle_lock;
+    std::condition_variable idle;
+    std::atomic<int> queued{0};
+    std::atomic<int> running{0};
+    std::atomic<bool> stopping{false};
+    static thread_local int worker_id;
+
+    void worker_loop(int id);
+
+public:
+    static int thread_cnt;
+
+    explicit TaskPool(int n) {
+        if (n < 1) n = 1;
+        for (int i = 0; i < n; i++) queues.push_back(new worker_queue());
+        for (int i = 1; i < n; i++) threads.emplace_back(&TaskPool::worker_loop, this, i);
+    }
+
+    ~TaskPool() {
+        for (auto *q : queues) delete q;
+    }
+
+    int submit(task *t) {
+        int handle;
+        {
+            std::lock_guard<std::mutex> guard(handles_lock);
+            handle = handles.size();
+            handles.push_back(t);
+        }
+        worker_queue *q = queues[worker_id];
+        {
+            std::lock_guard<std::mutex> guard(q->lock);
+            q->tasks.push_back(t);
+        }
+        queued++;
+        idle.notify_one();
+        return handle;
+    }
+
+    task *claim(int_tp handle) {
+        std::lock_guard<std::mutex> guard(handles_lock);
+        if (handle < 0 || handle >= (int_tp) handles.size() || handles[handle] == nullptr) {
+            panic("Invalid task handle");
+        }
+        task *t = handles[handle];
+        handles[handle] = nullptr;
+        return t;
+    }
+
+    task *take() {
+        int n = queues.size();
+        for (int k = 0; k < n; k++) {
+            worker_queue *q = queues[(worker_id + k) % n];
+            std::lock_guard<std::mutex> guard(q->lock);
+            if (q->tasks.empty()) continue;
+            task *t;
+            if (k == 0) {
+                t = q->tasks.back();
+                q->tasks.pop_back();
+            } else {
+                t = q->tasks.front();
+                q->tasks.pop_front();
+            }
+            queued--;
+            return t;
+        }
+        return nullptr;
+    }
+
+    void execute(task *t);
+
+    // Help with other tasks until t is done
+    void wait(task *t) {
+        while (!t->done.load(std::memory_order_acquire)) {
+            task *other = take();
+            if (other != nullptr) execute(other);
+            else std::this_thread::yield();
+        }
+    }
+
+    // Finish all outstanding tasks and stop the workers
+    void shutdown() {
+        while (queued.load() > 0 || running.load() > 0) {
+            task *t = take();
+            if (t != nullptr) execute(t);
+            else std::this_thread::yield();
+        }
+        stopping = true;
+        idle.notify_all();
+        for (auto &th : threads) th.join();
+        threads.clear();
+    }
+};
+
+thread_local int TaskPool::worker_id = 0;
+int TaskPool::thread_cnt = 0;
+TaskPool *task_pool = nullptr;
+// Any HALT; a task's outermost frame returns to it
+int task_halt_ip = -1;
+
+// Mnemonic lookup for the assembler: an open-addressing table whose hash seed is searched when the
+// table is built, so that every opcode name gets a slot of its own and a lookup is one hash and one compare
+class MnemonicTable {
+private:
+    static const int SIZE = 512;
+    const std::string *names[SIZE]{};
+    instruct_code codes[SIZE]{};
+    uint32_t seed = 0;
+
+    static uint32_t hash(const char *s, size_t n, uint32_t seed) {
+        uint32_t h = 2166136261u ^ seed;
+        for (size_t i = 0; i < n; i++) h = (h ^ (unsigned char) s[i]) * 16777619u;
+        return (h ^ (h >> 15)) & (SIZE - 1);
+    }
+
+public:
+    void build(const std::unordered_map<std::string, instruct_code> &mapping) {
+        for (seed = 1;; seed++) {
+            std::fill(names, names + SIZE, nullptr);
+            bool perfect = true;
+            for (const auto &x : mapping) {
+                uint32_t h = hash(x.first.data(), x.first.size(), seed);
+                if (names[h] != nullptr) {
+                    perfect = false;
+                    break;
+                }
+                names[h] = &x.first;
+                codes[h] = x.second;
+            }
+            if (perfect) return;
+        }
+    }
+
+    // Opcode of a mnemonic, or -1
+    int find(const char *s, size_t n) const {
+        uint32_t h = hash(s, n, seed);
+        if (names[h] == nullptr || names[h]->size() != n || memcmp(names[h]->data(), s, n) != 0) return -1;
+        return codes[h];
+    }
+} mnemonics;
+
+// Virtual Machine
+class Machine {
+private:
+    frame *esp{};
+    int ip{};
+    bool verbose = false;
+    bool evaluator = false;
+    bool debugger = false;
+    // Debugger: stop before the next instruction; check watchpoints before every instruction
+    bool stepping = false;
+    bool debug_trap = false;
+    std::vector<watchpoint> watchpoints;
+    long long int n_ins = 0;
+    // Quotas: fuel left in the current block, and the first instruction not charged yet
+    long long fuel = 0;
+    long long fuel_taken = 0;
+    int fuel_from = 0;
+    // Evaluator counters; with profiling, also charged to the function running between calls and returns
+    PerfCounters *perf = nullptr;
+    bool profiling = false;
+    struct profile_row {
+        unsigned long long counts[PerfCounters::N]{};
+        long long vm_ins = 0;
+        long long calls = 0;
+    };
+    std::unordered_map<int, profile_row> profile;
+    // Execution profile being recorded (-e -P)
+    Profile *recorder = nullptr;
+    // Memoisation: a cache per memoised function, and the calls that missed and have not returned yet
+    struct memo_call {
+        const frame *f;
+        int id;
+        int at;
+        int chars;
+        int_tp args[memo_cache::MAX_ARGS];
+    };
+    std::vector<memo_cache> memo;
+    std::vector<memo_call> memo_pending;
+    // Function (entry instruction, -1 for top-level code) of each instruction
+    std::vector<int> function_of;
+    unsigned long long last_counts[PerfCounters::N]{};
+    long long last_n_ins = 0;
+    T_OPSTACK operands{};
+    int *op_top_ptr{};
+    coroutine main_co;
+    coroutine *co = &main_co;
+    std::vector<coroutine *> coroutines;
+    int sched_cursor = 0;
+    bool task_mode = false;
+
+public:
+    // The machine running the program itself, as opposed to tasks; read by the SIGUSR1 handler
+    static std::atomic<Machine *> main_machine;
+    static std::unordered_map<std::string, instruct_code> string_inscode_mapping;
+    static int inscode_param_cnt_mapping[200];
+    static std::string inscode_name_mapping[200];
+
+    static void load_name_code_mapping() {
+        string_inscode_mapping["CMALLOC"] = CMALLOC;
+        string_inscode_mapping["VMALLOC"] = VMALLOC;
+        string_inscode_mapping["CONSTANT"] = CONSTANT;
+        string_inscode_mapping["LOAD_CONSTANT"] = LOAD_CONSTANT;
+        string_inscode_mapping["POP_OP"] = POP_OP;
+        string_inscode_mapping["NOOP"] = NOOP;
+        string_inscode_mapping["LOAD_NULL"] = LOAD_NULL;
+        string_inscode_mapping["LOAD_NAME"] = LOAD_NAME;
+        string_inscode_mapping["LOAD_NAME_GLOBAL"] = LOAD_NAME_GLOBAL;
+        string_inscode_mapping["LOAD_INT"] = LOAD_INT;
+        string_inscode_mapping["LOAD_FLOAT"] = LOAD_FLOAT;
+        string_inscode_mapping["LOAD_CHAR"] = LOAD_CHAR;
+        string_inscode_mapping["STORE_NAME"] = STORE_NAME;
+        string_inscode_mapping["STORE_NAME_GLOBAL"] = STORE_NAME_GLOBAL;
+        string_inscode_mapping["STORE_NAME_NOPOP"] = STORE_NAME_NOPOP;
+        string_inscode_mapping["STORE_NAME_GLOBAL_NOPOP"] = STORE_NAME_GLOBAL_NOPOP;
+        string_inscode_mapping["JMP"] = JMP;
+        string_inscode_mapping["JMP_TRUE"] = JMP_TRUE;
+        string_inscode_mapping["JMP_FALSE"] = JMP_FALSE;
+        string_inscode_mapping["BINARY_OP"] = BINARY_OP;
+        string_inscode_mapping["UNARY_OP"] = UNARY_OP;
+        string_inscode_mapping["HALT"] = HALT;
+        string_inscode_mapping["RET"] = RET;
+        string_inscode_mapping["PUSH"] = PUSH;
+        string_inscode_mapping["CALL"] = CALL;
+        string_inscode_mapping["LOAD_GLOBAL"] = LOAD_GLOBAL;
+        string_inscode_mapping["STORE_GLOBAL"] = STORE_GLOBAL;
+        string_inscode_mapping["BUILD_ARR"] = BUILD_ARR;
+        string_inscode_mapping["TYPE_CVT"] = TYPE_CVT;
+        string_inscode_mapping["BINARY_SUBSCR"] = BINARY_SUBSCR;
+        string_inscode_mapping["STORE_SUBSCR"] = STORE_SUBSCR;
+        string_inscode_mapping["STORE_SUBSCR_INPLACE"] = STORE_SUBSCR_INPLACE;
+        string_inscode_mapping["STORE_SUBSCR_NOPOP"] = STORE_SUBSCR_NOPOP;
+        string_inscode_mapping["PRINTK"] = PRINTK;
+        string_inscode_mapping["PUTCH"] = PUTCH;
+        string_inscode_mapping["GETCH"] = GETCH;
+        string_inscode_mapping["SIZE_OF"] = SIZE_OF;
+        string_inscode_mapping["CALL_NATIVE"] = CALL_NATIVE;
+        string_inscode_mapping["BINARY_SUBSCR_UNCHECKED"] = BINARY_SUBSCR_UNCHECKED;
+        string_inscode_mapping["STORE_SUBSCR_UNCHECKED"] = STORE_SUBSCR_UNCHECKED;
+        string_inscode_mapping["SPAWN"] = SPAWN;
+        string_inscode_mapping["SPAWN_CALL"] = SPAWN_CALL;
+        string_inscode_mapping["JOIN"] = JOIN;
+        string_inscode_mapping["COROUTINE"] = COROUTINE;
+        string_inscode_mapping["COROUTINE_CALL"] = COROUTINE_CALL;
+        string_inscode_mapping["RESUME"] = RESUME;
+        string_inscode_mapping["YIELD"] = YIELD;
+        string_inscode_mapping["CO_STATUS"] = CO_STATUS;
+        string_inscode_mapping["SCHEDULE"] = SCHEDULE;
+        string_inscode_mapping["COROUTINE_END"] = COROUTINE_END;
+        string_inscode_mapping["LOAD_STRING"] = LOAD_STRING;
+        string_inscode_mapping["SUBSCR_2D"] = SUBSCR_2D;
+        string_inscode_mapping["STORE_SUBSCR_2D"] = STORE_SUBSCR_2D;
+        string_inscode_mapping["BREAKPOINT"] = BREAKPOINT;
+        string_inscode_mapping["EXPORT"] = EXPORT;
+        string_inscode_mapping["IMPORT"] = IMPORT;
+        string_inscode_mapping["BUILD_MAP"] = BUILD_MAP;
+        string_inscode_mapping["MAP_GET"] = MAP_GET;
+        string_inscode_mapping["MAP_PUT"] = MAP_PUT;
+        string_inscode_mapping["MAP_DEL"] = MAP_DEL;
+        string_inscode_mapping["MAP_HAS"] = MAP_HAS;
+        string_inscode_mapping["MAP_SIZE"] = MAP_SIZE;
+        string_inscode_mapping["CALL_ARGS"] = CALL_ARGS;
+        string_inscode_mapping["BINARY_OP_INT"] = BINARY_OP_INT;
+        string_inscode_mapping["FUNCTION"] = FUNCTION;
+        string_inscode_mapping["LINE"] = LINE;
+        string_inscode_mapping["MEMO"] = MEMO;
+        for (const auto& x : string_inscode_mapping) {
+            inscode_name_mapping[x.second] = x.first;
+        }
+        mnemonics.build(string_inscode_mapping);
+    }
+
+    static void load_param_mapping() {
+        inscode_param_cnt_mapping[VMALLOC] = 1;
+        inscode_param_cnt_mapping[CMALLOC] = 1;
+        inscode_param_cnt_mapping[POP_OP] = 0;
+        inscode_param_cnt_mapping[NOOP] = 0;
+        inscode_param_cnt_mapping[LOAD_NULL] = 0;
+        inscode_param_cnt_mapping[LOAD_CONSTANT] = 1;
+        inscode_param_cnt_mapping[LOAD_NAME] = 1;
+        inscode_param_cnt_mapping[LOAD_NAME_GLOBAL] = 1;
+        inscode_param_cnt_mapping[LOAD_INT] = 1;
+        inscode_param_cnt_mapping[LOAD_FLOAT] = 1;
+        inscode_param_cnt_mapping[LOAD_CHAR] = 1;
+        inscode_param_cnt_mapping[STORE_NAME] = 1;
+        inscode_param_cnt_mapping[STORE_NAME_NOPOP] = 1;
+        inscode_param_cnt_mapping[STORE_NAME_GLOBAL] = 1;
+        inscode_param_cnt_mapping[STORE_NAME_GLOBAL_NOPOP] = 1;
+        inscode_param_cnt_mapping[JMP] = 1;
+        inscode_param_cnt_mapping[JMP_TRUE] = 1;
+        inscode_param_cnt_mapping[JMP_FALSE] = 1;
+        inscode_param_cnt_mapping[BINARY_OP] = 1;
+        inscode_param_cnt_mapping[UNARY_OP] = 1;
+        inscode_param_cnt_mapping[HALT] = 0;
+        inscode_param_cnt_mapping[RET] = 0;
+        inscode_param_cnt_mapping[PUSH] = 0;
+        inscode_param_cnt_mapping[CALL] = 1;
+        inscode_param_cnt_mapping[LOAD_GLOBAL] = 0;
+        inscode_param_cnt_mapping[STORE_GLOBAL] = 0;
+        inscode_param_cnt_mapping[BUILD_ARR] = 1;
+        inscode_param_cnt_mapping[TYPE_CVT] = 1;
+        inscode_param_cnt_mapping[BINARY_SUBSCR] = 0;
+        inscode_param_cnt_mapping[STORE_SUBSCR] = 0;
+        inscode_param_cnt_mapping[STORE_SUBSCR_INPLACE] = 0;
+        inscode_param_cnt_mapping[STORE_SUBSCR_NOPOP] = 0;
+        inscode_param_cnt_mapping[PRINTK] = 0;
+        inscode_param_cnt_mapping[PUTCH] = 0;
+        inscode_param_cnt_mapping[GETCH] = 0;
+        inscode_param_cnt_mapping[SIZE_OF] = 0;
+        inscode_param_cnt_mapping[CALL_NATIVE] = 1;
+        inscode_param_cnt_mapping[BINARY_SUBSCR_UNCHECKED] = 0;
+        inscode_param_cnt_mapping[STORE_SUBSCR_UNCHECKED] = 0;
+        inscode_param_cnt_mapping[SPAWN] = 0;
+        inscode_param_cnt_mapping[SPAWN_CALL] = 1;
+        inscode_param_cnt_mapping[JOIN] = 0;
+        inscode_param_cnt_mapping[COROUTINE] = 0;
+        inscode_param_cnt_mapping[COROUTINE_CALL] = 1;
+        inscode_param_cnt_mapping[RESUME] = 0;
+        inscode_param_cnt_mapping[YIELD] = 0;
+        inscode_param_cnt_mapping[CO_STATUS] = 0;
+        inscode_param_cnt_mapping[SCHEDULE] = 0;
+        inscode_param_cnt_mapping[COROUTINE_END] = 0;
+        inscode_param_cnt_mapping[LOAD_STRING] = 1;
+        inscode_param_cnt_mapping[SUBSCR_2D] = 1;
+        inscode_param_cnt_mapping[STORE_SUBSCR_2D] = 1;
+        inscode_param_cnt_mapping[BREAKPOINT] = 0;
+        inscode_param_cnt_mapping[EXPORT] = 1;
+        inscode_param_cnt_mapping[IMPORT] = 1;
+        inscode_param_cnt_mapping[BUILD_MAP] = 1;
+        inscode_param_cnt_mapping[MAP_GET] = 0;
+        inscode_param_cnt_mapping[MAP_PUT] = 0;
+        inscode_param_cnt_mapping[MAP_DEL] = 0;
+        inscode_param_cnt_mapping[MAP_HAS] = 0;
+        inscode_param_cnt_mapping[MAP_SIZE] = 0;
+        inscode_param_cnt_mapping[CALL_ARGS] = 1;
+        inscode_param_cnt_mapping[BINARY_OP_INT] = 1;
+        inscode_param_cnt_mapping[FUNCTION] = 1;
+        inscode_param_cnt_mapping[LINE] = 1;
+        inscode_param_cnt_mapping[MEMO] = 0;
+        // only used for assemble/disassemble
+        inscode_param_cnt_mapping[CONSTANT] = 3;
+    }
+
+    Machine() {
+        reset();
+    }
+
+    Machine(const Machine &) = delete;
+
+    // A machine that runs a single task on the shared program
+    explicit Machine(task *t) : task_mode(true) {
+        ip = -1;
+        main_co.status = CO_RUNNING;
+        for (slot *arg : t->args) main_co.operands[++main_co.op_top] = arg;
+        esp = new (main_co.stack.frames) frame(nullptr);
+        esp->return_ip = task_halt_ip;
+        ip = t->entry - 1;
+    }
+
+    slot *task_result() {
+        return main_co.op_top > -1 ? main_co.operands[main_co.op_top--] : nullptr;
+    }
+
+    ~Machine() {
+        reset();
+    }
+
+    void enable_verbose() {
+        verbose = true;
+    }
+
+    void enable_evaluator() {
+        evaluator = true;
+    }
+
+    void enable_profiling() {
+        profiling = true;
+    }
+
+    void enable_debugger() {
+        debugger = true;
+    }
+
+    void reset() {
+        ip = -1;
+        co = &main_co;
+        main_co.status = CO_RUNNING;
+        while (main_co.op_top > -1) {
+            SLOT_DECREF(main_co.operands[main_co.op_top--], "Reset");
+        }
+        for (coroutine *c : coroutines) {
+            if (c != nullptr) release_coroutine(c);
+        }
+        coroutines.clear();
+        sched_cursor = 0;
+        esp = nullptr;
+        if (task_mode) {
+            return;
+        }
+        while (var_cnt--) {
+            SLOT_DECREF(globals[var_cnt], "Reset");
+        }
+        while (constant_cnt--) {
+            SLOT_DECREF(constants[constant_cnt], "Reset");
+        }
+        var_cnt = 0;
+        constant_cnt = 0;
+        instructs.clear();
+        ins_cnt = 0;
+        addr_index.clear();
+        module_starts.clear();
+        exported.clear();
+        imported.clear();
+        call_entries.clear();
+        source_map.clear();
+        memo_functions.clear();
+        memo_marks.clear();
+    }
+
+    void add_instruct(instruct ins) {
+        instructs.push_back(ins);
+        ins_cnt++;
+    }
+
+    // Index of the instruction at address addr, or -1
+    static int ip_of(int addr) {
+        auto it = std::lower_bound(addr_index.begin(), addr_index.end(), std::make_pair(addr, INT_MIN));
+        return it == addr_index.end() || it->first != addr ? -1 : it->second;
+    }
+
+    // Resolve `SPAWN` and `COROUTINE` markers. A marker applies to the next call:
+    //   SPAWN; <args> STORE_GLOBAL ...; PUSH; CALL f  =>  NOOP; <args> STORE_GLOBAL ...; LOAD_INT argc; SPAWN_CALL f
+    // and likewise COROUTINE => COROUTINE_CALL. The arguments of such a call must not contain calls themselves.
+    // Jump and call targets are then resolved to instruction indices. The top level of every module after the
+    // program runs first, in load order: its first HALT becomes a jump to the next module, the last one to the
+    // program. A hidden COROUTINE_END is placed after the image; the outermost frame of a coroutine returns to it.
+    // A call to an imported address is bound to the module that exports the same name.
+    // With fast_calls, calls are then turned into CALL_ARGS where possible (see pass_arguments).
+    void link(bool fast_calls = true) {
+        addr_index.resize(ins_cnt);
+        for (int k = 0; k < ins_cnt; k++) addr_index[k] = std::make_pair(instructs[k].address, k);
+        std::sort(addr_index.begin(), addr_index.end());
+        for (int k = 1; k < ins_cnt; k++) {
+            if (addr_index[k].first == addr_index[k - 1].first) {
+                panic("Duplicate instruction address " + std::to_string(addr_index[k].first));
+            }
+        }
+        for (int k = 0; k < ins_cnt; k++) {
+            instruct_code marker = instructs[k].code;
+            if (marker != SPAWN && marker != COROUTINE) continue;
+            int argc = 0, j = k + 1;
+            while (j < ins_cnt && instructs[j].code != PUSH && instructs[j].code != CALL) {
+                if (instructs[j].code == STORE_GLOBAL) argc++;
+                j++;
+            }
+            if (j + 1 >= ins_cnt || instructs[j].code != PUSH || instructs[j + 1].code != CALL) {
+                panic(marker == SPAWN ? "SPAWN must be followed by a function call"
+                                      : "COROUTINE must be followed by a function call");
+            }
+            instructs[k].code = NOOP;
+            instructs[j] = instruct(instructs[j].address, LOAD_INT, argc);
+            instructs[j + 1].code = marker == SPAWN ? SPAWN_CALL : COROUTINE_CALL;
+            if (marker == SPAWN) vm_threaded = true;
+        }
+        for (int k = 0; k < ins_cnt; k++) {
+            if (!code_operand(instructs[k].code)) continue;
+            int target = ip_of(instructs[k].operand);
+            auto import = imported.find(instructs[k].operand);
+            if (target < 0 && import != imported.end()) {
+                auto symbol = exported.find(import->second);
+                if (symbol == exported.end()) {
+                    panic("Unresolved import " + import->second);
+                }
+                target = ip_of(symbol->second);
+            }
+            if (target < 0) {
+                panic("Jump to unknown address " + std::to_string(instructs[k].operand));
+            }
+            instructs[k].operand = target;
+        }
+        complete_source_map();
+        find_call_entries();
+        if (fast_calls) {
+            pass_arguments();
+            find_memo_functions();
+        }
+        for (size_t m = 1; m < module_starts.size(); m++) {
+            int end = m + 1 < module_starts.size() ? module_starts[m + 1] : ins_cnt;
+            int next = m + 1 < module_starts.size() ? module_starts[m + 1] : 0;
+            for (int k = module_starts[m]; k < end; k++) {
+                if (instructs[k].code == HALT) {
+                    instructs[k] = instruct(instructs[k].address, JMP, next);
+                    break;
+                }
+            }
+        }
+        for (int k = 0; k < ins_cnt && task_halt_ip == -1; k++) {
+            if (instructs[k].code == HALT) task_halt_ip = k;
+        }
+        if (vm_threaded && task_halt_ip == -1) {
+            panic("Program spawning tasks must contain HALT");
+        }
+        instructs.push_back(instruct(-1, COROUTINE_END));
+        if (module_starts.size() > 1) {
+            ip = module_starts[1] - 1;
+        }
+    }
+
+    // Name the functions the debug section does not: after their export, else after their address. The top
+    // level of each module is "main" and has no line unless the module says so.
+    void complete_source_map() {
+        for (const auto &e : exported) source_map.add_function(e.second, e.first);
+        for (int k = 0; k < ins_cnt; k++) {
+            instruct_code c = instructs[k].code;
+            if (c == CALL || c == SPAWN_CALL || c == COROUTINE_CALL) {
+                int address = instructs[instructs[k].operand].address;
+                source_map.add_function(address, "function #" + std::to_string(address));
+            }
+        }
+        for (int start : module_starts) {
+            if (start >= ins_cnt) continue;
+            source_map.add_function(instructs[start].address, "main");
+            source_map.add_line(instructs[start].address, 0);
+        }
+        source_map.seal();
+    }
+
+    // Fill call_entries for every call target
+    static void find_call_entries() {
+        call_entries.assign(ins_cnt, call_entry());
+        std::vector<char> targeted(ins_cnt + 1, 0);
+        for (int k = 0; k < ins_cnt; k++) {
+            if (code_operand(instructs[k].code)) targeted[instructs[k].operand] = 1;
+        }
+        for (int k = 0; k < ins_cnt; k++) {
+            instruct_code c = instructs[k].code;
+            if (c != CALL && c != CALL_ARGS) continue;
+            int entry = instructs[k].operand, argc = 0;
+            call_entry &e = call_entries[entry];
+            if (e.argc >= 0) continue;
+            while (entry + argc < ins_cnt && instructs[entry + argc].code == LOAD_GLOBAL
+                   && (argc == 0 || !targeted[entry + argc])) {
+                argc++;
+            }
+            int vmalloc = entry + argc;
+            if (vmalloc >= ins_cnt || instructs[vmalloc].code != VMALLOC || (argc > 0 && targeted[vmalloc])) {
+                if (c == CALL_ARGS) panic("CALL_ARGS to a function that does not load its arguments");
+                continue;
+            }
+            e.argc = argc;
+            e.var_cnt = instructs[vmalloc].operand;
+            e.body = vmalloc + 1;
+            e.direct = argc > 0 && argc <= e.var_cnt;
+            for (int i = 0; i < argc && e.direct; i++) {
+                const instruct &store = instructs[vmalloc + 1 + i];
+                e.direct = vmalloc + 1 + i < ins_cnt && store.code == STORE_NAME && store.operand == i
+                           && !targeted[vmalloc + 1 + i];
+            }
+            if (e.direct) e.body += argc;
+        }
+    }
+
+    // Instructions a memoised function may run besides calls
+    static bool memo_safe(const instruct &ins) {
+        switch (ins.code) {
+            case NOOP: case VMALLOC: case POP_OP: case TYPE_CVT: case LOAD_NULL:
+            case LOAD_NAME: case LOAD_INT: case LOAD_FLOAT: case LOAD_CHAR: case STORE_NAME: case STORE_NAME_NOPOP:
+            case BINARY_OP: case BINARY_OP_INT: case JMP: case JMP_TRUE: case JMP_FALSE:
+            case PUSH: case RET:
+                return true;
+            case UNARY_OP:
+                return ins.operand != 2 && ins.operand != 3;
+            case LOAD_CONSTANT:
+                return constants[ins.operand]->type != ARRAY;
+            default:
+                return false;
+        }
+    }
+
+    // Fill memo_functions and call_entries[].memo. A function is pure if what it runs is memo_safe and the
+    // functions it calls are pure; recursion is allowed, so candidates are dropped until none calls a dropped one.
+    // The global operand stack is only read by the LOAD_GLOBALs of the prologue, the arguments that make up the
+    // cache key: any other LOAD_GLOBAL, a jump back into the prologue, or a STORE_GLOBAL that is not passing an
+    // argument to a CALL_ARGS (a call left unconverted) would reach caller state outside the key.
+    static void find_memo_functions() {
+        std::vector<char> marked(ins_cnt, 0);
+        for (int address : memo_marks) {
+            int k = ip_of(address);
+            if (k < 0 || call_entries[k].argc < 0) panic("MEMO on something that is not a function");
+            marked[k] = 1;
+        }
+        std::vector<char> pure(ins_cnt, 0), seen(ins_cnt, 0);
+        std::vector<std::vector<int>> callees(ins_cnt);
+        std::vector<int> candidates, stack;
+        for (int entry = 0; entry < ins_cnt; entry++) {
+            if (call_entries[entry].argc < 0) continue;
+            bool safe = true;
+            std::vector<int> visited;
+            stack.assign(1, entry);
+            while (!stack.empty() && safe) {
+                int k = stack.back();
+                stack.pop_back();
+                if (k >= ins_cnt || seen[k]) continue;
+                seen[k] = 1;
+                visited.push_back(k);
+                const instruct &ins = instructs[k];
+                int prologue_end = entry + call_entries[entry].argc;
+                if (ins.code == CALL || ins.code == CALL_ARGS) {
+                    callees[entry].push_back(ins.operand);
+                } else if (ins.code == LOAD_GLOBAL) {
+                    safe = k < prologue_end;
+                } else if (ins.code == STORE_GLOBAL) {
+                    safe = k + 1 < ins_cnt && instructs[k + 1].code == CALL_ARGS;
+                } else {
+                    safe = memo_safe(ins);
+                }
+                if (!safe) break;
+                if (ins.code == JMP || ins.code == JMP_TRUE || ins.code == JMP_FALSE) {
+                    if (ins.operand >= entry && ins.operand < prologue_end) {
+                        safe = false;
+                        break;
+                    }
+                    stack.push_back(ins.operand);
+                }
+                if (ins.code != JMP && ins.code != RET) stack.push_back(k + 1);
+            }
+            for (int k : visited) seen[k] = 0;
+            pure[entry] = safe;
+            candidates.push_back(entry);
+        }
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (int entry : candidates) {
+                if (!pure[entry]) continue;
+                for (int callee : callees[entry]) {
+                    if (call_entries[callee].argc >= 0 && pure[callee]) continue;
+                    pure[entry] = 0;
+                    changed = true;
+                    break;
+                }
+            }
+        }
+        for (int entry : candidates) {
+            if (marked[entry] && !pure[entry]) {
+                panic("MEMO on a function that is not pure: #" + std::to_string(instructs[entry].address));
+            }
+            if (marked[entry] && call_entries[entry].argc > memo_cache::MAX_ARGS) {
+                panic("MEMO on a function with more than " + std::to_string(memo_cache::MAX_ARGS) + " arguments");
+            }
+            if (!pure[entry] || (!memo_all && !marked[entry]) || call_entries[entry].argc > memo_cache::MAX_ARGS) continue;
+            call_entries[entry].memo = (int) memo_functions.size();
+            memo_functions.push_back(entry);
+        }
+    }
+
+    // Register-passing calls. Arguments no longer go through the global operand stack:
+    //   <arg 1> STORE_GLOBAL ... <arg argc> STORE_GLOBAL PUSH CALL f  =>  <arg 1> ... <arg argc> CALL_ARGS f
+    // CALL_ARGS does the work of PUSH, CALL, the LOAD_GLOBALs and the VMALLOC of f (and of its STORE_NAMEs if
+    // it has them), then goes on with the body of f. Only arguments passed in straight-line code are matched to
+    // their call; other calls are left alone. The dropped instructions are removed from the image, and jumps
+    // to them go to the next remaining instruction.
+    void pass_arguments() {
+        std::vector<char> targeted(ins_cnt + 1, 0), dropped(ins_cnt, 0);
+        for (int k = 0; k < ins_cnt; k++) {
+            if (code_operand(instructs[k].code)) targeted[instructs[k].operand] = 1;
+        }
+        // STORE_GLOBALs whose value has not been taken yet
+        std::vector<int> pending;
+        bool changed = false;
+        for (int k = 0; k < ins_cnt; k++) {
+            if (targeted[k]) pending.clear();
+            instruct &ins = instructs[k];
+            // Values the instruction takes from the global operand stack, INT_MAX when not known
+            int taken = 0;
+            switch (ins.code) {
+                case STORE_GLOBAL:
+                    pending.push_back(k);
+                    break;
+                case LOAD_GLOBAL:
+                    taken = 1;
+                    break;
+                case SPAWN_CALL: case COROUTINE_CALL:
+                    taken = k > 0 && instructs[k - 1].code == LOAD_INT ? instructs[k - 1].operand : INT_MAX;
+                    break;
+                case CALL: {
+                    int argc = call_entries[ins.operand].argc;
+                    taken = argc < 0 ? INT_MAX : argc;
+                    if (argc < 0 || argc > (int) pending.size() || targeted[k] || k == 0 || instructs[k - 1].code != PUSH) {
+                        break;
+                    }
+                    for (int i = 0; i < argc; i++) dropped[pending[pending.size() - 1 - i]] = 1;
+                    dropped[k - 1] = 1;
+                    ins.code = CALL_ARGS;
+                    changed = true;
+                    break;
+                }
+                case JMP: case RET: case HALT:
+                    pending.clear();
+                    break;
+                default:
+                    break;
+            }
+            if (taken > (int) pending.size()) {
+                pending.clear();
+            } else {
+                pending.resize(pending.size() - taken);
+            }
+        }
+        if (!changed) return;
+        // moved[k]: new index of the first remaining instruction at or after k
+        std::vector<int> moved(ins_cnt + 1);
+        int n = 0;
+        for (int k = 0; k < ins_cnt; k++) {
+            moved[k] = n;
+            if (!dropped[k]) {
+                instructs[n] = instructs[k];
+                call_entries[n] = call_entries[k];
+                n++;
+            }
+        }
+        moved[ins_cnt] = n;
+        instructs.resize(n);
+        call_entries.resize(n);
+        ins_cnt = n;
+        for (int k = 0; k < ins_cnt; k++) {
+            if (code_operand(instructs[k].code)) instructs[k].operand = moved[instructs[k].operand];
+            if (call_entries[k].argc >= 0) call_entries[k].body = moved[call_entries[k].body];
+        }
+        for (auto &x : addr_index) x.second = moved[x.second];
+        for (int &start : module_starts) start = moved[start];
+    }
+
+    coroutine *coroutine_of(slot *handle) {
+        int_tp h = handle->int_val;
+        if (handle->type != INT || h < 0 || h >= (int_tp) coroutines.size()) {
+            panic("Invalid coroutine handle");
+        }
+        return coroutines[h];
+    }
+
+    // Free the stacks of a coroutine that will never run again
+    static void release_coroutine(coroutine *c) {
+        while (c->op_top > -1) {
+            SLOT_DECREF(c->operands[c->op_top], "Release coroutine");
+            c->op_top--;
+        }
+        while (c->esp != nullptr) {
+            frame *f = c->esp;
+            while (f->op_top > -1) {
+                SLOT_DECREF(f->local_operands[f->op_top], "Release coroutine");
+                f->op_top--;
+            }
+            while (f->var_cnt-- > 0) {
+                SLOT_DECREF(f->locals[f->var_cnt], "Release coroutine");
+            }
+            c->esp = f->caller;
+        }
+        delete c;
+    }
+
+    // Save the running coroutine and continue the target one
+    void switch_to(coroutine *target) {
+        if (Quota::on) charge(ip, target->ip + 1);
+        if (perf != nullptr && profiling) profile_charge();
+        if (Trace::on && !task_mode) Trace::transfer(Trace::SWITCH, ip, target->ip + 1);
+        co->esp = esp;
+        co->ip = ip;
+        co = target;
+        co->stack.enter();
+        esp = co->esp;
+        ip = co->ip;
+        operands = (esp == nullptr) ? co->operands : esp->local_operands;
+        op_top_ptr = (esp == nullptr) ? &co->op_top : &(esp->op_top);
+    }
+
+    // Give control back to the resumer of the running coroutine, handing it val
+    void leave_coroutine(slot *val, coroutine_status status) {
+        coroutine *from = co;
+        bool discard = from->scheduled;
+        from->status = status;
+        from->scheduled = false;
+        switch_to(from->resumer);
+        from->resumer = nullptr;
+        co->status = CO_RUNNING;
+        if (discard) {
+            SLOT_DECREF(val, "Scheduled coroutine value");
+        } else {
+            OP_PUSH(val);
+        }
+    }
+
+    // Continue a coroutine from the running one
+    void enter_coroutine(coroutine *target, bool scheduled) {
+        target->resumer = co;
+        target->scheduled = scheduled;
+        co->status = CO_RUNNING;
+        switch_to(target);
+        co->status = CO_RUNNING;
+    }
+
+    bool runnable(coroutine *c) {
+        return c != nullptr && (c->status == CO_SUSPENDED || (c->status == CO_WAITING_INPUT && vm_input.ready()));
+    }
+
+    // Start from the snapshot if there is one for this program, otherwise stop to take one
+    void prepare_snapshot() {
+        std::vector<slot *> ops;
+        int address = Snapshot().load(ops);
+        if (address >= 0) {
+            for (slot *op : ops) main_co.operands[++main_co.op_top] = op;
+            ip = ip_of(address) - 1;
+            return;
+        }
+        if (debugger) return;
+        for (int k = 0; k < ins_cnt; k++) {
+            if (!Snapshot::pure(instructs[k])) {
+                breakpoints.insert(k);
+                instructs[k].code = BREAKPOINT;
+            }
+        }
+        Snapshot::pending = true;
+    }
+
+    void take_snapshot() {
+        for (int k : breakpoints) instructs[k] = original_instructs[k];
+        breakpoints.clear();
+        Snapshot::pending = false;
+        Snapshot().save(instructs[ip].address, co->operands, co->op_top + 1);
+    }
+
+    // Quota checkpoint: charge the instructions from fuel_from up to at, execution goes on at target
+    void charge(int at, int target) {
+        fuel -= std::max(0, at - fuel_from + 1);
+        fuel_from = target;
+        if (fuel >= 0) return;
+        while (fuel < 0) {
+            long long block = Quota::refuel();
+            fuel += block;
+            fuel_taken += block;
+        }
+        if (this == main_machine.load(std::memory_order_relaxed)) publish_stats(at);
+    }
+
+    void publish_stats(int at) {
+        LiveStats::publish(fuel_taken - fuel, at, esp != nullptr ? esp->depth : 0,
+                           op_top_ptr != nullptr ? *op_top_ptr + 1 : 0);
+    }
+
+    // CALL_ARGS to a memoised function: 1 if the cached result replaced the arguments, 0 if the call goes on and
+    // its result is to be stored when it returns, -1 if the arguments are not all ints and chars
+    int memo_lookup(const call_entry &callee) {
+        int argc = callee.argc;
+        slot **args = operands + *op_top_ptr - argc + 1;
+        memo_call call{nullptr, callee.memo, 0, 0, {}};
+        uint64_t h = 1469598103934665603ULL ^ (uint64_t) argc;
+        for (int i = 0; i < argc; i++) {
+            if (args[i]->type == INT) {
+                call.args[i] = args[i]->int_val;
+            } else if (args[i]->type == CHAR) {
+                call.args[i] = args[i]->char_val;
+                call.chars |= 1 << i;
+            } else {
+                return -1;
+            }
+            h = (h ^ (uint64_t) call.args[i]) * 1099511628211ULL;
+        }
+        h ^= (uint64_t) call.chars;
+        call.at = (int) ((h ^ (h >> 32)) & (memo_cache::SIZE - 1));
+        if (memo.empty()) memo.resize(memo_functions.size());
+        memo_cache &cache = memo[callee.memo];
+        if (cache.entries.empty()) cache.entries.resize(memo_cache::SIZE);
+        const memo_cache::entry &e = cache.entries[call.at];
+        if (e.used && e.chars == call.chars && std::equal(call.args, call.args + argc, e.args)) {
+            cache.hits++;
+            for (int i = 0; i < argc; i++) SLOT_DECREF(args[i], "Memoised call");
+            *op_top_ptr -= argc;
+            slot *res;
+            if (e.type == INT) {
+                res = new slot(e.bits);
+            } else if (e.type == CHAR) {
+                res = new slot((char_tp) e.bits);
+            } else {
+                float_tp f;
+                memcpy(&f, &e.bits, sizeof(float_tp));
+                res = new slot(f);
+            }
+            OP_PUSH(res);
+            return 1;
+        }
+        cache.misses++;
+        memo_pending.push_back(call);
+        return 0;
+    }
+
+    // The memoised call on top of memo_pending returns ret
+    void memo_store(const slot *ret) {
+        memo_call call = memo_pending.back();
+        memo_pending.pop_back();
+        if (ret->type != INT && ret->type != CHAR && ret->type != FLOAT) return;
+        memo_cache &cache = memo[call.id];
+        memo_cache::entry &e = cache.entries[call.at];
+        int argc = call_entries[memo_functions[call.id]].argc;
+        if (e.used && (e.chars != call.chars || !std::equal(call.args, call.args + argc, e.args))) cache.evictions++;
+        e.used = true;
+        e.chars = call.chars;
+        std::copy(call.args, call.args + argc, e.args);
+        e.type = ret->type;
+        if (ret->type == INT) {
+            e.bits = ret->int_val;
+        } else if (ret->type == CHAR) {
+            e.bits = ret->char_val;
+        } else {
+            memcpy(&e.bits, &ret->float_val, sizeof(float_tp));
+        }
+    }
+
+    void print_memo() {
+        std::cout << "<<<<<* Memoisation *>>>>>" << std::endl;
+        std::cout << std::left << std::setw(24) << "function" << std::right << std::setw(14) << "hits"
+                  << std::setw(14) << "misses" << std::setw(14) << "evictions" << std::endl;
+        for (size_t id = 0; id < memo.size(); id++) {
+            if (!memo[id].hits && !memo[id].misses) continue;
+            std::cout << std::left << std::setw(24) << source_map.function(instructs[memo_functions[id]].address)
+                      << std::right << std::setw(14) << memo[id].hits << std::setw(14) << memo[id].misses
+                      << std::setw(14) << memo[id].evictions << std::endl;
+        }
+    }
+
+    // Every call target starts a function that extends to the next one; module top levels are not functions
+    void build_function_map() {
+        std::vector<char> entry(ins_cnt + 1, 0);
+        for (int k = 0; k < ins_cnt; k++) {
+            instruct_code c = instructs[k].code;
+            if (c == CALL || c == CALL_ARGS || c == SPAWN_CALL || c == COROUTINE_CALL) entry[instructs[k].operand] = 1;
+        }
+        for (int start : module_starts) entry[start] = 2;
+        function_of.assign(instructs.size(), -1);
+        int current = -1;
+        for (int k = 0; k < (int) instructs.size(); k++) {
+            if (entry[k]) current = entry[k] == 1 ? k : -1;
+            function_of[k] = current;
+        }
+    }
+
+    // Charge the counters since the last charge to the function of the running instruction
+    void profile_charge() {
+        unsigned long long now[PerfCounters::N];
+        perf->read_all(now);
+        profile_row &row = profile[function_of[ip]];
+        for (int i = 0; i < PerfCounters::N; i++) row.counts[i] += now[i] - last_counts[i];
+        row.vm_ins += n_ins - last_n_ins;
+        std::copy(now, now + PerfCounters::N, last_counts);
+        last_n_ins = n_ins;
+    }
+
+    void print_counters(const unsigned long long *begin, const unsigned long long *end) {
+        if (!perf->hardware()) {
+            std::cout << "Hardware counters unavailable" << std::endl;
+        }
+        for (int i = 0; i < PerfCounters::N; i++) {
+            if (!perf->available[i]) continue;
+            std::cout << PerfCounters::names[i] << ": " << end[i] - begin[i];
+            if (i == 0 && n_ins) {
+                std::cout << " (" << std::setprecision(2) << (double) (end[0] - begin[0]) / n_ins << " per instruction)";
+            } else if (i == 1 && perf->available[0] && end[0] > begin[0]) {
+                std::cout << " (IPC " << std::setprecision(2) << (double) (end[1] - begin[1]) / (end[0] - begin[0]) << ")";
+            }
+            std::cout << std::endl;
+        }
+    }
+
+    void print_profile() {
+        std::vector<std::pair<int, profile_row *>> rows;
+        for (auto &r : profile) rows.emplace_back(r.first, &r.second);
+        // Heaviest first: by cycles when they were counted, by time otherwise
+        int key = perf->available[0] ? 0 : PerfCounters::WALL;
+        std::sort(rows.begin(), rows.end(), [key](const std::pair<int, profile_row *> &a, const std::pair<int, profile_row *> &b) {
+            return a.second->counts[key] > b.second->counts[key];
+        });
+        std::cout << "<<<<<* Per function *>>>>>" << std::endl;
+        std::cout << std::left << std::setw(24) << "function" << std::right << std::setw(10) << "calls"
+                  << std::setw(16) << "VM instructions";
+        for (int i = 0; i < PerfCounters::N; i++) {
+            if (perf->available[i]) std::cout << std::setw(16) << PerfCounters::names[i];
+        }
+        std::cout << std::endl;
+        for (size_t n = 0; n < rows.size() && n < 20; n++) {
+            const profile_row &row = *rows[n].second;
+            std::string name = rows[n].first < 0 ? "main" : source_map.function(instructs[rows[n].first].address);
+            std::cout << std::left << std::setw(24) << name << std::right << std::setw(10) << row.calls
+                      << std::setw(16) << row.vm_ins;
+            for (int i = 0; i < PerfCounters::N; i++) {
+                if (perf->available[i]) std::cout << std::setw(16) << row.counts[i];
+            }
+            std::cout << std::endl;
+        }
+    }
+
+    // Debugger (-g)
+    //
+    // Breakpoints are BREAKPOINT instructions patched into the program, so the loop runs at full
+    // speed until one is reached; only stepping and watchpoints check something before each instruction.
+    std::string debug_read_line() {
+        std::string line;
+        int c;
+        while ((c = vm_input.get()) != EOF && c != '\n') line += (char) c;
+        if (c == EOF && line.empty()) return "c";
+        return line;
+    }
+
+    void debug_print_ins(int at) {
+        const instruct &ins = breakpoints.count(at) ? original_instructs[at] : instructs[at];
+        std::cout << "#" << ins.address << " $ " << inscode_name_mapping[ins.code];
+        if (inscode_param_cnt_mapping[ins.code]) {
+            std::cout << " " << (code_operand(ins.code) ? instructs[ins.operand].address : ins.operand);
+        }
+        std::cout << std::endl;
+    }
+
+    bool set_breakpoint(int addr) {
+        int k = ip_of(addr);
+        if (k < 0 || breakpoints.count(k)) return false;
+        breakpoints.insert(k);
+        instructs[k].code = BREAKPOINT;
+        return true;
+    }
+
+    bool delete_breakpoint(int addr) {
+        int k = ip_of(addr);
+        if (k < 0 || !breakpoints.count(k)) return false;
+        instructs[k] = original_instructs[k];
+        breakpoints.erase(k);
+        return true;
+    }
+
+    void watch_sample(watchpoint &w) {
+        slot *s = w.global < var_cnt ? globals[w.global] : nullptr;
+        w.array = nullptr;
+        w.type = VOID;
+        w.bits = 0;
+        if (s == nullptr) return;
+        if (w.element < 0) {
+            w.type = s->type;
+            if (s->type == ARRAY) w.array = s;
+            else if (s->type == FLOAT) memcpy(&w.bits, &s->float_val, sizeof(float_tp));
+            else w.bits = s->as_int();
+            return;
+        }
+        if (s->type != ARRAY || w.element >= s->array_size) return;
+        w.array = s;
+        w.type = s->arr_element_type;
+        if (w.type == INT) w.bits = s->ints()[w.element];
+        else if (w.type == FLOAT) memcpy(&w.bits, s->floats() + w.element, sizeof(float_tp));
+        else w.bits = s->chars()[w.element];
+    }
+
+    std::string watch_string(const watchpoint &w) {
+        std::stringstream res;
+        res << "globals[" << w.global << "]";
+        if (w.element >= 0) res << "[" << w.element << "]";
+        res << " = ";
+        if (w.type == VOID) {
+            res << "(null)";
+        } else if (w.type == ARRAY) {
+            res << "array[" << w.array->array_size << "]";
+        } else if (w.type == FLOAT) {
+            float_tp f;
+            memcpy(&f, &w.bits, sizeof(float_tp));
+            res << f << "(float)";
+        } else if (w.type == CHAR) {
+            res << (char_tp) w.bits << "(char)";
+        } else {
+            res << w.bits << "(int)";
+        }
+        return res.str();
+    }
+
+    void debug_backtrace() {
+        int at = ip;
+        int depth = 0;
+        for (frame *f = esp; f != nullptr; f = f->caller) {
+            int call = f->return_ip - 1;
+            std::cout << "#" << depth++ << " at " << source_map.describe(instructs[at].address) << std::endl;
+            if (call >= 0 && call < ins_cnt && (instructs[call].code == CALL || instructs[call].code == CALL_ARGS
+                                                || instructs[call].code == SPAWN_CALL
+                                                || instructs[call].code == COROUTINE_CALL)) {
+                at = call;
+            } else {
+                std::cout << "#" << depth << " at ?" << std::endl;
+                return;
+            }
+        }
+        std::cout << "#" << depth << " at " << source_map.describe(instructs[at].address) << std::endl;
+    }
+
+    static void debug_print_slots(slot **slots, int cnt) {
+        for (int i = 0; i < cnt; i++) {
+            std::cout << "  " << i << ": " << (slots[i] == nullptr ? "(unset)" : slots[i]->as_string()) << std::endl;
+        }
+    }
+
+    void debug_prompt() {
+        debug_print_ins(ip);
+        while (true) {
+            std::cout << "(svmdb) " << std::flush;
+            std::stringstream cmd(debug_read_line());
+            std::string op;
+            cmd >> op;
+            if (op == "c") {
+                stepping = false;
+                break;
+            } else if (op == "s") {
+                stepping = true;
+                break;
+            } else if (op == "b" || op == "d") {
+                int addr;
+                if (!(cmd >> addr)) {
+                    for (int k : breakpoints) std::cout << "Breakpoint at " << instructs[k].address << std::endl;
+                } else if (op == "b" ? set_breakpoint(addr) : delete_breakpoint(addr)) {
+                    std::cout << (op == "b" ? "Breakpoint set at " : "Breakpoint deleted at ") << addr << std::endl;
+                } else {
+                    std::cout << "No instruction or breakpoint at " << addr << std::endl;
+                }
+            } else if (op == "w") {
+                watchpoint w;
+                if (!(cmd >> w.global) || w.global < 0) {
+                    for (const watchpoint &x : watchpoints) std::cout << watch_string(x) << std::endl;
+                    continue;
+                }
+                if (!(cmd >> w.element)) w.element = -1;
+                watch_sample(w);
+                watchpoints.push_back(w);
+                std::cout << "Watching " << watch_string(w) << std::endl;
+            } else if (op == "u") {
+                watchpoints.clear();
+            } else if (op == "bt") {
+                debug_backtrace();
+            } else if (op == "l") {
+                if (esp == nullptr) debug_print_slots(globals, var_cnt);
+                else debug_print_slots(esp->locals, esp->var_cnt);
+            } else if (op == "g") {
+                debug_print_slots(globals, var_cnt);
+            } else if (op == "o") {
+                for (int i = *op_top_ptr; i >= 0; i--) std::cout << "  " << operands[i]->as_string() << std::endl;
+                if (esp != nullptr) {
+                    std::cout << "global operands:" << std::endl;
+                    for (int i = co->op_top; i >= 0; i--) std::cout << "  " << co->operands[i]->as_string() << std::endl;
+                }
+            } else if (op == "q") {
+                // Not exit(): task workers may still be running, and static destruction would pull their state away
+                std::cout.flush();
+                fflush(stdout);
+                _exit(0);
+            } else if (!op.empty()) {
+                std::cout << "c: continue, s: step, b/d [addr]: set/delete/list breakpoints, "
+                             "w [global [element]]: watch/list, u: clear watchpoints, "
+                             "bt: backtrace, l: locals, g: globals, o: operand stack, q: quit" << std::endl;
+            }
+        }
+        debug_trap = stepping || !watchpoints.empty();
+    }
+
+    // Before each instruction while stepping or watching, and on every breakpoint
+    void debug_hook(instruct &ins) {
+        bool stop = stepping;
+        if (ins.code == BREAKPOINT) {
+            ins = original_instructs[ip];
+            std::cout << "Breakpoint at " << ins.address << "." << std::endl;
+            stop = true;
+        }
+        for (watchpoint &w : watchpoints) {
+            watchpoint now = w;
+            watch_sample(now);
+            if (now.type != w.type || now.array != w.array || now.bits != w.bits) {
+                std::cout << "Watchpoint " << watch_string(w) << " -> " << watch_string(now) << "." << std::endl;
+                w = now;
+                stop = true;
+            }
+        }
+        if (stop) debug_prompt();
+    }
+
+    // One specialisation per mode: the production loop carries no debugger, evaluator or trace code
+    template <bool Verbose, bool Evaluate, bool Debug, bool Tracing>
+    void execute() {
+        if (Verbose) {
+            std::cout << "SLang Virtual Machine Debugger (SVMDB)" << std::endl;
+            std::cout << "I am an opcode-level debugging assistant." << std::endl;
+            std::cout << "======================================" << std::endl;
+            std::cin.get();
+            Machine::load_name_code_mapping();
+            Machine::load_param_mapping();
+        }
+        if (Debug) {
+            std::cout << "SLang Virtual Machine Debugger (SVMDB)" << std::endl;
+            Machine::load_name_code_mapping();
+            ip++;
+            operands = co->operands;
+            op_top_ptr = &co->op_top;
+            debug_prompt();
+            ip--;
+        }
+        co->stack.enter();
+        running_ip = &ip;
+        fuel_from = ip + 1;
+        if (this == main_machine.load(std::memory_order_relaxed)) publish_stats(ip + 1);
+        clock_t start = 0, finish;
+        unsigned long long counts_start[PerfCounters::N];
+        if (Evaluate) {
+            perf = new PerfCounters();
+            if (profiling) build_function_map();
+            if (!Profile::path.empty() && !task_mode) recorder = new Profile(instructs.size());
+            perf->start();
+            perf->read_all(counts_start);
+            std::copy(counts_start, counts_start + PerfCounters::N, last_counts);
+            start = clock();
+        }
+        full_dispatch:
+        {
+            operands = (esp == nullptr) ? co->operands : esp->local_operands;
+            op_top_ptr = (esp == nullptr) ? &co->op_top : &(esp->op_top);
+
+            dispatch:
+            {
+                if (Evaluate) {
+                    n_ins++;
+                    if (recorder != nullptr) recorder->counts[ip + 1]++;
+                }
+                instruct ins = instructs[++ip];
+                if (Debug && (debug_trap || ins.code == BREAKPOINT)) {
+                    debug_hook(ins);
+                }
+                execute_ins:
+                if (Verbose) {
+                    std::cout << "======================================" << std::endl;
+                    std::cout << "#" << ins.address << " $ " << Machine::inscode_name_mapping[ins.code];
+                    if (Machine::inscode_param_cnt_mapping[ins.code]) {
+                        std::cout << " " << (code_operand(ins.code) ? instructs[ins.operand].address : ins.operand);
+                    }
+                    std::cout << " > ";
+                    std::cin.get();
+                }
+                switch (ins.code) {
+                    case VMALLOC: {
+                        if (ins.operand) {
+                            if (esp == nullptr) {
+                                grow_globals(ins.operand);
+                            } else {
+                                // The locals go right after the frame: what the function pushed so far (its
+                                // arguments, from LOAD_GLOBAL) moves up above them
+                                for (int i = 0; i < esp->var_cnt; i++) {
+                                    SLOT_DECREF(esp->locals[i], "Locals reallocated");
+                                }
+                                slot **moved = esp->locals + ins.operand;
+                                memmove(moved, esp->local_operands, (esp->op_top + 1) * sizeof(slot *));
+                                esp->local_operands = moved;
+                                for (int i = 0; i < ins.operand; i++) esp->locals[i] = nullptr;
+                                esp->var_cnt = ins.operand;
+                                FULL_DISPATCH;
+                            }
+                        }
+                        DISPATCH;
+                    }
+
+                    case NOOP:
+                        DISPATCH;
+
+                    case POP_OP: {
+                        slot *op = OP_POP();
+                        SLOT_DECREF(op, "Operand is poped from the stack");
+                        DISPATCH;
+                    }
+
+                    case TYPE_CVT: {
+                        slot *op = OP_POP();
+                        slot *res = convert(ins.operand, op);
+                        OP_PUSH(res);
+                        SLOT_DECREF(op, "Convert type");
+                        DISPATCH;
+                    }
+
+                    case PUSH: {
+                        void *at = esp != nullptr ? (void *) (esp->local_operands + esp->op_top + 1) : co->stack.frames;
+                        esp = new (at) frame(esp);
+                        if (Verbose) {
+                            std::cout << "Frame is pushed into the control stack." << std::endl;
+                        }
+                        FULL_DISPATCH;
+                    }
+
+                    case CALL: {
+                        esp->return_ip = ip + 1;
+                        if (Verbose) {
+                            std::cout << "Call subroutine defined at address " << instructs[ins.operand].address
+                                      << ", with return address "
+                                      << (ip < ins_cnt - 1 ? instructs[ip + 1].address : -1) << "." << std::endl;
+                        }
+                        if (Tracing) Trace::transfer(Trace::CALL, ip, ins.operand);
+                        if (Evaluate && profiling) {
+                            profile_charge();
+                            profile[ins.operand].calls++;
+                        }
+                        if (Evaluate && recorder != nullptr) recorder->calls[ins.operand]++;
+                        if (Quota::on) {
+                            charge(ip, ins.operand);
+                            if (Quota::depth && esp->depth > Quota::depth) Quota::exceeded("call depth limit");
+                        }
+                        ip = ins.operand - 1;
+                        DISPATCH;
+                    }
+
+                    case CALL_ARGS: {
+                        const call_entry &callee = call_entries[ins.operand];
+                        int memo_state = callee.memo >= 0 ? memo_lookup(callee) : -1;
+                        if (memo_state > 0) DISPATCH;
+                        int argc = callee.argc;
+                        slot **args = operands + *op_top_ptr - argc + 1;
+                        *op_top_ptr -= argc;
+                        // Stored arguments move up into the locals, which follow the frame placed over them;
+                        // the others are moved onto the operand stack of the frame, which is placed above them
+                        void *at;
+                        if (callee.direct) {
+                            at = esp != nullptr ? (void *) args : co->stack.frames;
+                            auto **locals = reinterpret_cast<slot **>(static_cast<frame *>(at) + 1);
+                            memmove(locals, args, argc * sizeof(slot *));
+                            for (int i = 0; i < argc; i++) SLOT_INCREF(locals[i], "CALL_ARGS");
+                            for (int i = argc; i < callee.var_cnt; i++) locals[i] = nullptr;
+                        } else {
+                            at = esp != nullptr ? (void *) (args + argc) : co->stack.frames;
+                        }
+                        auto *f = new (at) frame(esp, callee.var_cnt);
+                        if (!callee.direct) {
+                            for (int i = 0; i < callee.var_cnt; i++) f->locals[i] = nullptr;
+                            for (int i = 0; i < argc; i++) f->local_operands[i] = args[argc - 1 - i];
+                            f->op_top = argc - 1;
+                        }
+                        f->return_ip = ip + 1;
+                        esp = f;
+                        if (memo_state == 0) memo_pending.back().f = f;
+                        if (Verbose) {
+                            std::cout << "Call subroutine defined at address " << instructs[ins.operand].address
+                                      << " with " << argc << " argument(s), with return address "
+                                      << (ip < ins_cnt - 1 ? instructs[ip + 1].address : -1) << "." << std::endl;
+                        }
+                        if (Tracing) Trace::transfer(Trace::CALL, ip, callee.body);
+                        if (Evaluate && profiling) {
+                            profile_charge();
+                            profile[ins.operand].calls++;
+                        }
+                        if (Evaluate && recorder != nullptr) recorder->calls[ins.operand]++;
+                        if (Quota::on) {
+                            charge(ip, callee.body);
+                            if (Quota::depth && esp->depth > Quota::depth) Quota::exceeded("call depth limit");
+                        }
+                        ip = callee.body - 1;
+                        FULL_DISPATCH;
+                    }
+
+                    case RET: {
+                        int to_ip = esp->return_ip - 1;
+                        if (Tracing) Trace::transfer(Trace::RET, ip, to_ip + 1);
+                        if (Evaluate && profiling) profile_charge();
+                        if (Quota::on) charge(ip, to_ip + 1);
+                        ip = to_ip;
+                        slot *ret = OP_POP();
+                        // 此处不需要对ret进行减引用，因为ret此会在进入了函数之后被减一次
+                        if (!memo_pending.empty() && memo_pending.back().f == esp) memo_store(ret);
+                        if (Verbose) {
+                            std::cout << "Frame is poped from the control stack. Return to instruct address "
+                                      << (to_ip < ins_cnt - 1 ? instructs[to_ip + 1].address : -1)
+                                      << " with return value " << ret->as_string() << "." << std::endl;
+                        }
+                        while (esp->op_top > -1) {
+                            SLOT_DECREF(esp->local_operands[esp->op_top], "Return statement op decref");
+                        }
+                        while (esp->var_cnt--) {
+                            SLOT_DECREF(esp->locals[esp->var_cnt], "Return statement var decref");
+                        }
+                        // The return value goes where the frame was
+                        esp = esp->caller;
+                        if (esp == nullptr) {
+                            co->operands[++co->op_top] = ret;
+                        } else {
+                            esp->local_operands[++esp->op_top] = ret;
+                        }
+                        FULL_DISPATCH;
+                    }
+
+                    case LOAD_NULL: {
+                        slot* slt = new slot();
+                        OP_PUSH(slt);
+                        if (Verbose) {
+                            std::cout << "NULL value (type: void) was loaded to operand stack." << std::endl;
+                        }
+                        DISPATCH;
+                    }
+
+                    case LOAD_INT: {
+                        slot *created = new slot((int_tp) ins.operand);
+                        OP_PUSH(created);
+                        if (Verbose) {
+                            std::cout << "Int value " << ins.operand << " was loaded to operand stack." << std::endl;
+                        }
+                        DISPATCH;
+                    }
+
+                    case LOAD_FLOAT: {
+                        slot *created = new slot((float_tp) ins.operand);
+                        OP_PUSH(created);
+                        if (Verbose) {
+                            std::cout << "Float value " << ins.operand << " was loaded to operand stack." << std::endl;
+                        }
+                        DISPATCH;
+                    }
+
+                    case SIZE_OF: {
+                        slot *element = OP_POP();
+                        int size;
+                        if (element->type != ARRAY) size = 1;
+                        else size = element->array_size;
+                        SLOT_DECREF(element, "Size of calculate");
+                        OP_PUSH(new slot((int_tp) size));
+                        DISPATCH;
+                    }
+
+                    case LOAD_CHAR: {
+                        slot *created = new slot((char_tp) ins.operand);
+                        OP_PUSH(created);
+                        if (Verbose) {
+                            std::cout << "Char value " << ins.operand << " was loaded to operand stack." << std::endl;
+                        }
+                        DISPATCH;
+                    }
+
+                    case LOAD_CONSTANT: {
+                        slot *constant = constants[ins.operand];
+                        OP_PUSH(constant);
+                        SLOT_INCREF(constant, "LOAD_CONSTANT");
+                        if (Verbose) {
+                            std::cout << "Constant value " << constants[ins.operand]->as_string()
+                                      << " was loaded to operand stack." << std::endl;
+                        }
+                        DISPATCH;
+                    }
+
+                    case LOAD_NAME: {
+                        slot *var = esp->locals[ins.operand];
+                        OP_PUSH(var);
+                        SLOT_INCREF(var, "LOAD_NAME");
+                        if (Verbose) {
+                            std::cout << "Loaded name " << ins.operand << "." << std::endl;
+                        }
+                        DISPATCH;
+                    }
+                    case LOAD_NAME_GLOBAL: {
+                        slot *var = globals[ins.operand];
+                        OP_PUSH(var);
+                        SLOT_INCREF(var, "LOAD_NAME_GLOBAL");
+                        if (Verbose) {
+                            std::cout << "Loaded global name " << ins.operand << "." << std::endl;
+                        }
+                        DISPATCH;
+                    }
+                    case STORE_NAME:
+                    case STORE_NAME_NOPOP: {
+                        // 千万注意！原来的需要DECREF
+                        if (esp->locals[ins.operand] != nullptr) {
+                            SLOT_DECREF(esp->locals[ins.operand], "Store override");
+                        }
+                        if (ins.code == STORE_NAME) {
+                            esp->locals[ins.operand] = OP_POP();
+                        } else {
+                            esp->locals[ins.operand] = OP_TOP();
+                        }
+                        SLOT_INCREF(esp->locals[ins.operand], "STORE_NAME[_NOPOP]");
+                        if (Verbose) {
+                            std::cout << "Stored " << esp->locals[ins.operand]->as_string() << " to name " << ins.operand << " in locals."
+                                      << std::endl;
+                        }
+                        DISPATCH;
+                    }
+                    case STORE_NAME_GLOBAL:
+                    case STORE_NAME_GLOBAL_NOPOP: {
+                        // 千万注意！原来的需要DECREF
+                        if (globals[ins.operand] != nullptr) {
+                            SLOT_DECREF(globals[ins.operand], "Store global override");
+                        }
+                        if (ins.code == STORE_NAME_GLOBAL) {
+                            globals[ins.operand] = OP_POP();
+                        } else {
+                            globals[ins.operand] = OP_TOP();
+                        }
+                        SLOT_INCREF(globals[ins.operand], "STORE_NAME_GLOBAL[_NOPOP]");
+                        if (Verbose) {
+                            std::cout << "Stored " << globals[ins.operand]->as_string() << " to name " << ins.operand << " in globals."
+                                      << std::endl;
+                        }
+                        DISPATCH;
+                    }
+                    case JMP: {
+                        if (Tracing) Trace::transfer(Trace::JUMP, ip, ins.operand);
+                        if (Quota::on) charge(ip, ins.operand);
+                        ip = ins.operand - 1;
+                        if (Verbose) {
+                            std::cout << "Jumped to instruction address " << instructs[ins.operand].address << "." << std::endl;
+                        }
+                        DISPATCH;
+                    }
                     case JMP_TRUE: {
                         slot *o = OP_POP();
                         if (o->int_val) {
-                            ip = addrs[ins.operand] - 1;
-                            if (verbose) {
-                                std::cout << "The condition is true, jumped to instruction address " << ins.operand
+                            if (Tracing) Trace::transfer(Trace::JUMP, ip, ins.operand);
+                            if (Quota::on) charge(ip, ins.operand);
+                            if (Evaluate && recorder != nullptr) recorder->taken[ip]++;
+                            ip = ins.operand - 1;
+                            if (Verbose) {
+                                std::cout << "The condition is true, jumped to instruction address " << instructs[ins.operand].address
                                           << "."
                                           << std::endl;
                             }
                         }
-                        SLOT_DECREF(o, "Jmp true instruct poped op from the stack");
+                        SLOT_DECREF(o, "Jmp true instruct poped op from the stack");
+                        DISPATCH;
+                    }
+                    case JMP_FALSE: {
+                        slot *o = OP_POP();
+                        if (!o->int_val) {
+                            if (Tracing) Trace::transfer(Trace::JUMP, ip, ins.operand);
+                            if (Quota::on) charge(ip, ins.operand);
+                            if (Evaluate && recorder != nullptr) recorder->taken[ip]++;
+                            ip = ins.operand - 1;
+                            if (Verbose) {
+                                std::cout << "The condition is false, jumped to instruction address " << instructs[ins.operand].address
+                                          << "." << std::endl;
+                            }
+                        }
+                        SLOT_DECREF(o, "Jmp false instruct poped op from the stack");
+                        DISPATCH;
+                    }
+                    case UNARY_OP: {
+                        slot *operand = OP_POP();
+                        if (Evaluate && recorder != nullptr) recorder->types[ip] |= Profile::type_bit(operand->type, INT);
+
+                        if (ins.operand == 0 || ins.operand == 1) {
+                            slot *res = unary_op(ins.operand, operand);
+                            if (res == nullptr) {
+                                panic("Unsupported unary operator");
+                            }
+
+                            OP_PUSH(res);
+                            if (Verbose) {
+                                std::cout << "Pop " << operand->as_string() << ", calculate with unary operator "
+                                          << ins.operand << ". Result " << res->as_string()
+                                          << " is pushed into the stack." << std::endl;
+                            }
+                            SLOT_DECREF(operand, "Unary-op for the operand, decref it");
+                            DISPATCH;
+                        }
+
+                        // SELF INCREMENT BY ONE
+                        if (ins.operand == 2) {
+                            operand->int_val++;
+                            if (Verbose) {
+                                std::cout << "Increased the loaded variable by one." << std::endl;
+                            }
+                            SLOT_DECREF(operand, "Increased by one");
+                            DISPATCH;
+                        }
+                        // SELF DECREASEMENT BY ONE
+                        if (ins.operand == 3) {
+                            operand->int_val--;
+                            if (Verbose) {
+                                std::cout << "Decreased the loaded variable by one." << std::endl;
+                            }
+                            SLOT_DECREF(operand, "Decreased by one");
+                            DISPATCH;
+                        }
+                    }
+                    case BINARY_OP: {
+                        slot *right = OP_POP();
+                        slot *left = OP_POP();
+                        if (Evaluate && recorder != nullptr) recorder->types[ip] |= Profile::type_bit(left->type, right->type);
+                        slot *res = binary_op(ins.operand, left, right);
+                        if (res == nullptr) {
+                            panic("Unsupported binary operator");
+                        }
+
+                        OP_PUSH(res);
+                        if (Verbose) {
+                            std::cout << "Pop " << left->as_string() << " and " << right->as_string()
+                                      << ", calculate with binary operator " << ins.operand << ". Result "
+                                      << res->as_string() << " is pushed into the stack." << std::endl;
+                        }
+                        SLOT_DECREF(left, "Bin-Op Left operand decref");
+                        SLOT_DECREF(right, "Bin-Op Right operand decref");
+                        DISPATCH;
+                    }
+                    case BINARY_OP_INT: {
+                        slot *right = OP_POP();
+                        slot *left = OP_POP();
+                        if (Evaluate && recorder != nullptr) recorder->types[ip] |= Profile::type_bit(left->type, right->type);
+                        slot *res = left->type == INT && right->type == INT
+                                    ? int_binary_op(ins.operand, left->int_val, right->int_val)
+                                    : binary_op(ins.operand, left, right);
+                        if (res == nullptr) {
+                            panic("Unsupported binary operator");
+                        }
+                        OP_PUSH(res);
+                        if (Verbose) {
+                            std::cout << "Pop " << left->as_string() << " and " << right->as_string()
+                                      << ", calculate with int binary operator " << ins.operand << ". Result "
+                                      << res->as_string() << " is pushed into the stack." << std::endl;
+                        }
+                        SLOT_DECREF(left, "Bin-Op Left operand decref");
+                        SLOT_DECREF(right, "Bin-Op Right operand decref");
+                        DISPATCH;
+                    }
+                    case HALT: {
+                        if (Verbose) {
+                            std::cout << "Program received HALT signal, terminating..." << std::endl;
+                        }
+                        if (Tracing) Trace::end(ip);
+                        goto finish;
+                    }
+                    case PRINTK: {
+                        slot *slot = OP_POP();
+                        std::cout << slot->as_string() << std::endl;
+                        SLOT_DECREF(slot, "Printk");
+                        DISPATCH;
+                    }
+                    case PUTCH: {
+                        slot *slot = OP_POP();
+                        std::cout << slot->char_val;
+                        SLOT_DECREF(slot, "Putch");
+                        DISPATCH;
+                    }
+                    case GETCH: {
+                        if (co != &main_co && !vm_input.ready()) {
+                            // Park until input arrives; GETCH runs again when the coroutine is resumed
+                            ip--;
+                            if (Verbose) {
+                                std::cout << "Coroutine is waiting for input." << std::endl;
+                            }
+                            leave_coroutine(new slot(), CO_WAITING_INPUT);
+                            DISPATCH;
+                        }
+                        OP_PUSH(new slot((char_tp) vm_input.get()));
+                        DISPATCH;
+                    }
+                    case CALL_NATIVE: {
+                        if (ins.operand < 0 || ins.operand >= NATIVE_CNT) {
+                            panic("Unknown native function");
+                        }
+                        if (ins.operand == NATIVE_READ_STR && co != &main_co && !vm_input.ready()) {
+                            // Park like GETCH; the arguments stay on the stack for the retry
+                            ip--;
+                            leave_coroutine(new slot(), CO_WAITING_INPUT);
+                            DISPATCH;
+                        }
+                        const native_entry &native = native_table[ins.operand];
+                        slot **args = &OP_TOP() - native.argc + 1;
+                        slot *res = native.fn(args);
+                        if (Verbose) {
+                            std::cout << "Called native function " << native.name << " with " << native.argc
+                                      << " argument(s)." << std::endl;
+                        }
+                        for (int i = 0; i < native.argc; i++) {
+                            slot *arg = OP_POP();
+                            SLOT_DECREF(arg, "Native function argument");
+                        }
+                        if (res != nullptr) {
+                            OP_PUSH(res);
+                        }
+                        DISPATCH;
+                    }
+                    case SPAWN_CALL: {
+                        slot *argc_slot = OP_POP();
+                        int argc = argc_slot->int_val;
+                        SLOT_DECREF(argc_slot, "Spawn argument count");
+                        auto *t = new task();
+                        t->entry = ins.operand;
+                        t->args.assign(co->operands + co->op_top - argc + 1, co->operands + co->op_top + 1);
+                        co->op_top -= argc;
+                        if (task_pool == nullptr) {
+                            int n = TaskPool::thread_cnt > 0 ? TaskPool::thread_cnt : (int) std::thread::hardware_concurrency();
+                            task_pool = new TaskPool(n);
+                        }
+                        int handle = task_pool->submit(t);
+                        OP_PUSH(new slot((int_tp) handle));
+                        if (Verbose) {
+                            std::cout << "Spawned task " << handle << " calling subroutine at address " << instructs[ins.operand].address
+                                      << " with " << argc << " argument(s)." << std::endl;
+                        }
+                        DISPATCH;
+                    }
+                    case JOIN: {
+                        slot *handle = OP_POP();
+                        if (task_pool == nullptr) {
+                            panic("Invalid task handle");
+                        }
+                        task *t = task_pool->claim(handle->int_val);
+                        SLOT_DECREF(handle, "Join task handle");
+                        task_pool->wait(t);
+                        OP_PUSH(t->result);
+                        if (Verbose) {
+                            std::cout << "Joined task with result " << t->result->as_string() << "." << std::endl;
+                        }
+                        delete t;
+                        DISPATCH;
+                    }
+                    case COROUTINE_CALL: {
+                        slot *argc_slot = OP_POP();
+                        int argc = argc_slot->int_val;
+                        SLOT_DECREF(argc_slot, "Coroutine argument count");
+                        auto *c = new coroutine();
+                        for (int i = co->op_top - argc + 1; i <= co->op_top; i++) {
+                            c->operands[++c->op_top] = co->operands[i];
+                        }
+                        co->op_top -= argc;
+                        c->esp = new (c->stack.frames) frame(nullptr);
+                        c->esp->return_ip = ins_cnt;
+                        c->ip = ins.operand - 1;
+                        int handle = coroutines.size();
+                        coroutines.push_back(c);
+                        OP_PUSH(new slot((int_tp) handle));
+                        if (Verbose) {
+                            std::cout << "Created coroutine " << handle << " calling subroutine at address "
+                                      << instructs[ins.operand].address << " with " << argc << " argument(s)." << std::endl;
+                        }
+                        DISPATCH;
+                    }
+                    case RESUME: {
+                        slot *handle = OP_POP();
+                        coroutine *c = coroutine_of(handle);
+                        if (Verbose) {
+                            std::cout << "Resume coroutine " << handle->int_val << "." << std::endl;
+                        }
+                        SLOT_DECREF(handle, "Resume coroutine handle");
+                        if (c != nullptr && c->status == CO_RUNNING) {
+                            panic("Cannot resume a running coroutine");
+                        }
+                        if (!runnable(c)) {
+                            // Finished, or still waiting for input
+                            OP_PUSH(new slot());
+                            DISPATCH;
+                        }
+                        enter_coroutine(c, false);
+                        DISPATCH;
+                    }
+                    case YIELD: {
+                        if (co == &main_co) {
+                            panic("YIELD outside a coroutine");
+                        }
+                        slot *val = OP_POP();
+                        if (Verbose) {
+                            std::cout << "Coroutine yielded " << val->as_string() << "." << std::endl;
+                        }
+                        leave_coroutine(val, CO_SUSPENDED);
+                        DISPATCH;
+                    }
+                    case COROUTINE_END: {
+                        // The outermost frame of a coroutine returned here
+                        slot *val = co->operands[co->op_top--];
+                        coroutine *c = co;
+                        if (Verbose) {
+                            std::cout << "Coroutine finished with return value " << val->as_string() << "."
+                                      << std::endl;
+                        }
+                        leave_coroutine(val, CO_DEAD);
+                        for (auto &slt : coroutines) {
+                            if (slt == c) slt = nullptr;
+                        }
+                        release_coroutine(c);
+                        DISPATCH;
+                    }
+                    case CO_STATUS: {
+                        slot *handle = OP_POP();
+                        coroutine *c = coroutine_of(handle);
+                        SLOT_DECREF(handle, "Coroutine status handle");
+                        OP_PUSH(new slot((int_tp) (c == nullptr ? CO_DEAD : c->status)));
+                        DISPATCH;
+                    }
+                    case SCHEDULE: {
+                        // Round-robin over all coroutines until every one has finished. SCHEDULE runs
+                        // again each time control comes back, and blocks on stdin only when every
+                        // remaining coroutine is waiting for input.
+                        int n = coroutines.size();
+                        coroutine *next = nullptr;
+                        bool alive = false;
+                        for (int k = 0; k < n && next == nullptr; k++) {
+                            int idx = (sched_cursor + k) % n;
+                            coroutine *c = coroutines[idx];
+                            if (c == nullptr || c == co || c->status == CO_RUNNING) continue;
+                            alive = true;
+                            if (runnable(c)) {
+                                next = c;
+                                sched_cursor = idx + 1;
+                            }
+                        }
+                        if (next == nullptr) {
+                            if (!alive) {
+                                DISPATCH;
+                            }
+                            vm_input.wait();
+                            ip--;
+                            DISPATCH;
+                        }
+                        ip--;
+                        enter_coroutine(next, true);
                         DISPATCH;
                     }
-                    case JMP_FALSE: {
-                        slot *o = OP_POP();
-                        if (!o->int_val) {
-                            ip = addrs[ins.operand] - 1;
-                            if (verbose) {
-                                std::cout << "The condition is false, jumped to instruction address " << ins.operand
-                                          << "." << std::endl;
+                    case LOAD_STRING: {
+                        // A fresh copy, as the program may modify it
+                        slot *constant = constants[ins.operand];
+                        OP_PUSH(string_slot(constant->chars(), constant->array_size));
+                        if (Verbose) {
+                            std::cout << "String constant " << ins.operand << " was copied to operand stack." << std::endl;
+                        }
+                        DISPATCH;
+                    }
+                    case STORE_GLOBAL: {
+                        slot *val = OP_POP();
+                        co->operands[++co->op_top] = val;
+                        if (Verbose) {
+                            std::cout << "Pushed local value " << val->as_string() << " into global operands."
+                                      << std::endl;
+                        }
+                        DISPATCH;
+                    }
+                    case LOAD_GLOBAL: {
+                        slot *val = co->operands[co->op_top];
+                        co->op_top--;
+                        OP_PUSH(val);
+                        if (Verbose) {
+                            std::cout << "Pushed global value " << val->as_string() << " into local operands."
+                                      << std::endl;
+                        }
+                        DISPATCH;
+                    }
+                    case BUILD_ARR: {
+                        // Operand: element type + 16 * number of dimensions (0 meaning 1).
+                        // The extent of each dimension is on the stack, the last one on top.
+                        basic_data_types type = VOID;
+                        int elem = ins.operand & 15, dims = std::max(1, ins.operand >> 4);
+                        if (elem == 0) {
+                            type = INT;
+                        } else if (elem == 1) {
+                            type = FLOAT;
+                        } else if (elem == 2) {
+                            type = CHAR;
+                        } else {
+                            panic("Unexpected type");
+                        }
+                        if (dims == 1) {
+                            int val = OP_POP()->int_val;
+                            slot *tmp = new slot(val, type);
+                            OP_PUSH(tmp);
+                            if (Verbose) {
+                                std::cout << "Built array " << ins.operand << "[" << val << "]." << std::endl;
                             }
+                            DISPATCH;
+                        }
+                        int *shape = new int[dims + 1];
+                        shape[0] = dims;
+                        int_tp size = 1;
+                        for (int d = dims; d >= 1; d--) {
+                            slot *extent = OP_POP();
+                            if (extent->int_val < 0) panic("Negative array size");
+                            shape[d] = (int) extent->int_val;
+                            size *= extent->int_val;
+                            if (size > INT32_MAX) panic("Array too large");
+                            SLOT_DECREF(extent, "Array extent");
+                        }
+                        slot *tmp = new slot((int) size, type);
+                        tmp->shape = shape;
+                        OP_PUSH(tmp);
+                        if (Verbose) {
+                            std::cout << "Built array " << elem;
+                            for (int d = 1; d <= dims; d++) std::cout << "[" << shape[d] << "]";
+                            std::cout << "." << std::endl;
                         }
-                        SLOT_DECREF(o, "Jmp false instruct poped op from the stack");
                         DISPATCH;
                     }
-                    case UNARY_OP: {
-                        slot *operand = OP_POP();
+                    case BINARY_SUBSCR: {
+                        /*
+                         * e.g.
+                         * LOAD_NAME a
+                         * LOAD_INT 4
+                         * BINARY_SUBSCR
+                         */
+                        slot *source = OP_POP();
+                        slot *target = OP_POP();
+                        int subscr = source->int_val;
+                        if (subscr < 0 || subscr >= target->array_size) {
+                            panic("Array index out of bound");
+                        }
+                        OP_PUSH(target->element(subscr));
+                        if (Verbose) {
+                            std::cout << "Loaded element with index " << subscr << " of the array." << std::endl;
+                        }
+                        SLOT_DECREF(source, "Binary-subscr array index decref");
+                        DISPATCH;
+                    }
+                    case STORE_SUBSCR:
+                    case STORE_SUBSCR_INPLACE:
+                    case STORE_SUBSCR_NOPOP: {
+                        /*
+                         * e.g.
+                         * LOAD_NAME a
+                         * LOAD_INT 4
+                         * LOAD_INT 5
+                         * a[4] = 5;
+                         */
+                        slot *val = OP_POP();
+                        slot *p_subscr = OP_POP();
+                        int subscr = p_subscr->int_val;
+                        slot *target = OP_TOP();
+                        if (subscr < 0 || subscr >= target->array_size) {
+                            panic("Array index out of bound");
+                        }
+                        target->set_element(subscr, val);
+                        if (Verbose) {
+                            std::cout << "Changed element with index " << subscr << " of the array to "
+                                      << val->as_string() << "." << std::endl;
+                        }
+
+                        if (ins.code != STORE_SUBSCR_INPLACE) {
+                            (void) OP_POP();
+                        }
+                        if (ins.code == STORE_SUBSCR_NOPOP) {
+                            OP_PUSH(val);
+                        } else {
+                            SLOT_DECREF(val, "Stored value");
+                        }
+                        SLOT_DECREF(p_subscr, "Poped target subscr");
+                        DISPATCH;
+                    }
+                    case BINARY_SUBSCR_UNCHECKED: {
+                        slot *source = OP_POP();
+                        slot *target = OP_POP();
+                        int subscr = source->int_val;
+                        OP_PUSH(target->element(subscr));
+                        if (Verbose) {
+                            std::cout << "Loaded element with index " << subscr << " of the array (unchecked)." << std::endl;
+                        }
+                        SLOT_DECREF(source, "Binary-subscr array index decref");
+                        DISPATCH;
+                    }
+                    case STORE_SUBSCR_UNCHECKED: {
+                        slot *val = OP_POP();
+                        slot *p_subscr = OP_POP();
+                        int subscr = p_subscr->int_val;
+                        slot *target = OP_POP();
+                        target->set_element(subscr, val);
+                        if (Verbose) {
+                            std::cout << "Changed element with index " << subscr << " of the array to "
+                                      << val->as_string() << " (unchecked)." << std::endl;
+                        }
+                        SLOT_DECREF(val, "Stored value");
+                        SLOT_DECREF(p_subscr, "Poped target subscr");
+                        DISPATCH;
+                    }
+                    case SUBSCR_2D: {
+                        slot *col = OP_POP();
+                        slot *row = OP_POP();
+                        slot *target = OP_POP();
+                        int subscr = target->index_2d(row->int_val, col->int_val, ins.operand);
+                        OP_PUSH(target->element(subscr));
+                        if (Verbose) {
+                            std::cout << "Loaded element [" << row->int_val << "][" << col->int_val
+                                      << "] of the array." << std::endl;
+                        }
+                        SLOT_DECREF(row, "Subscr-2d row decref");
+                        SLOT_DECREF(col, "Subscr-2d column decref");
+                        DISPATCH;
+                    }
+                    case STORE_SUBSCR_2D: {
+                        slot *val = OP_POP();
+                        slot *col = OP_POP();
+                        slot *row = OP_POP();
+                        slot *target = OP_POP();
+                        int subscr = target->index_2d(row->int_val, col->int_val, ins.operand);
+                        target->set_element(subscr, val);
+                        if (Verbose) {
+                            std::cout << "Changed element [" << row->int_val << "][" << col->int_val
+                                      << "] of the array to " << val->as_string() << "." << std::endl;
+                        }
+                        SLOT_DECREF(val, "Stored value");
+                        SLOT_DECREF(row, "Subscr-2d row decref");
+                        SLOT_DECREF(col, "Subscr-2d column decref");
+                        DISPATCH;
+                    }
+                    case BUILD_MAP: {
+                        // Operand: value type + 16 * key type (INT, or CHAR for string keys)
+                        int value = ins.operand & 15, key = ins.operand >> 4;
+                        if (value > CHAR || (key != INT && key != CHAR)) {
+                            panic("Unexpected type");
+                        }
+                        OP_PUSH(new slot(new hash_map((basic_data_types) key, (basic_data_types) value)));
+                        if (Verbose) {
+                            std::cout << "Built map " << ins.operand << "." << std::endl;
+                        }
+                        DISPATCH;
+                    }
+                    case MAP_GET:
+                    case MAP_HAS: {
+                        slot *key = OP_POP();
+                        slot *target = OP_POP();
+                        if (target->type != MAP) panic("Not a map");
+                        hash_map *m = target->map_val;
+                        int i = m->find(m->key_of(key));
+                        if (ins.code == MAP_HAS) {
+                            OP_PUSH(new slot(i >= 0));
+                        } else if (i < 0) {
+                            panic("Map key not found");
+                        } else {
+                            OP_PUSH(m->value_slot(m->value(i)));
+                        }
+                        if (Verbose) {
+                            std::cout << (ins.code == MAP_HAS ? "Looked up key " : "Loaded value of key ")
+                                      << key->as_string() << " in the map." << std::endl;
+                        }
+                        SLOT_DECREF(key, "Map key decref");
+                        SLOT_DECREF(target, "Map decref");
+                        DISPATCH;
+                    }
+                    case MAP_PUT: {
+                        slot *val = OP_POP();
+                        slot *key = OP_POP();
+                        slot *target = OP_POP();
+                        if (target->type != MAP) panic("Not a map");
+                        hash_map *m = target->map_val;
+                        m->put(m->key_of(key), m->word_of(val));
+                        if (Verbose) {
+                            std::cout << "Changed value of key " << key->as_string() << " in the map to "
+                                      << val->as_string() << "." << std::endl;
+                        }
+                        SLOT_DECREF(val, "Stored value");
+                        SLOT_DECREF(key, "Map key decref");
+                        SLOT_DECREF(target, "Map decref");
+                        DISPATCH;
+                    }
+                    case MAP_DEL: {
+                        slot *key = OP_POP();
+                        slot *target = OP_POP();
+                        if (target->type != MAP) panic("Not a map");
+                        hash_map *m = target->map_val;
+                        m->erase(m->key_of(key));
+                        if (Verbose) {
+                            std::cout << "Deleted key " << key->as_string() << " from the map." << std::endl;
+                        }
+                        SLOT_DECREF(key, "Map key decref");
+                        SLOT_DECREF(target, "Map decref");
+                        DISPATCH;
+                    }
+                    case MAP_SIZE: {
+                        slot *target = OP_POP();
+                        if (target->type != MAP) panic("Not a map");
+                        OP_PUSH(new slot((int_tp) target->map_val->size));
+                        SLOT_DECREF(target, "Map decref");
+                        DISPATCH;
+                    }
+                    // Reached by the snapshot stop and by machines that are not debugging (e.g. tasks): run the original instruction
+                    case BREAKPOINT: {
+                        ins = original_instructs[ip];
+                        if (Snapshot::pending && esp == nullptr) take_snapshot();
+                        goto execute_ins;
+                    }
+                    default: {
+                        panic("Unexpected instruction");
+                        break;
+                    }
+                }
+            }
+        }
+        finish:
+        {
+            running_ip = nullptr;
+            if (Tracing) Trace::dump();
+            if (Evaluate) {
+                finish = clock();
+                unsigned long long counts_end[PerfCounters::N];
+                perf->read_all(counts_end);
+                if (profiling) profile_charge();
+                double time_delta = (double) (finish - start) / CLOCKS_PER_SEC;
+                std::cout << "<<<<<* Performance evaluator *>>>>>" << std::endl;
+                std::cout << n_ins << " instructions executed in total" << std::endl;
+                std::cout << "Time consumotion(s): " << std::fixed << std::setprecision(8) << time_delta << std::endl;
+                std::cout << "MIPS: " << std::fixed << std::setprecision(8) << (double) n_ins / time_delta * 1e-6 << std::endl;
+                print_counters(counts_start, counts_end);
+                if (profiling) print_profile();
+                if (!memo.empty()) print_memo();
+                delete perf;
+                perf = nullptr;
+                if (recorder != nullptr) {
+                    recorder->save(module_starts.size() > 1 ? module_starts[1] : ins_cnt);
+                    delete recorder;
+                    recorder = nullptr;
+                }
+            }
+        }
+    }
+
+    // SIGUSR1: one line of live statistics (see LiveStats)
+    static void live_stats_handler(int) {
+        int saved_errno = errno;
+        int at = LiveStats::published_ip.load(std::memory_order_relaxed);
+        LiveStats::line out;
+        out.put("svm: ");
+        if (!LiveStats::counting) {
+            out.put("statistics are counted only with -w");
+        } else if (at < 0) {
+            out.put("not running");
+        } else {
+            long long ins = LiveStats::published_ins.load(std::memory_order_relaxed);
+            out.put_int(ins);
+            out.put(" instructions, ");
+            out.put_fixed2(LiveStats::mips_x100(ins));
+            out.put(" MIPS, call depth ");
+            out.put_int(LiveStats::published_depth.load(std::memory_order_relaxed));
+            out.put(", operand stack ");
+            out.put_int(LiveStats::published_operands.load(std::memory_order_relaxed));
+            out.put(", live slots ");
+            out.put_int(LiveStats::live_slots());
+            out.put(", live arrays ");
+            out.put_int(LiveStats::arrays.load(std::memory_order_relaxed));
+            if (Quota::metered) {
+                out.put(", memory ");
+                out.put_int(Quota::memory_used.load(std::memory_order_relaxed) / 1024);
+                out.put("KB");
+            }
+            if (at >= 0 && at < (int) instructs.size()) {
+                int address = instructs[at].address;
+                const auto *f = source_map.function_entry(address);
+                out.put(", in ");
+                out.put(f == nullptr ? "main" : f->second.c_str());
+                if (f != nullptr) {
+                    out.put(" (entry #");
+                    out.put_int(f->first);
+                    out.put(")");
+                }
+                out.put(" at #");
+                out.put_int(address);
+            }
+        }
+        out.flush();
+        errno = saved_errno;
+    }
+
+    void dispatch() {
+        if (debugger) {
+            if (evaluator) execute<false, true, true, false>();
+            else execute<false, false, true, false>();
+        } else if (verbose) {
+            if (evaluator) execute<true, true, false, false>();
+            else execute<true, false, false, false>();
+        } else if (!Trace::path.empty() && !task_mode) {
+            Trace::start(instructs, (int) instructs.size(), ip + 1);
+            if (evaluator) execute<false, true, false, true>();
+            else execute<false, false, false, true>();
+        } else {
+            if (evaluator) execute<false, true, false, false>();
+            else execute<false, false, false, false>();
+        }
+    }
+};
+
+// The panic message for a stack overflow, written from the SIGSEGV handler: nothing but plain reads and one
+// write(). The trace (-t) is not dumped, as that allocates.
+void report_stack_overflow() {
+    LiveStats::line l;
+    l.put("Runtime error: Stack overflow");
+    if (running_ip != nullptr && *running_ip >= 0 && *running_ip < ins_cnt) {
+        l.put(" (at #");
+        l.put_int(instructs[*running_ip].address);
+        l.put(")");
+    }
+    l.put("\nABORTING...");
+    l.flush(2);
+}
+
+std::string panic_location() {
+    if (running_ip == nullptr || *running_ip < 0 || *running_ip >= (int) instructs.size()) return "";
+    return " (at " + source_map.describe(instructs[*running_ip].address) + ")";
+}
+
+void TaskPool::execute(task *t) {
+    running++;
+    {
+        Machine machine(t);
+        machine.dispatch();
+        t->result = machine.task_result();
+        if (t->result == nullptr) {
+            t->result = new slot();
+        }
+    }
+    t->done.store(true, std::memory_order_release);
+    running--;
+}
+
+void TaskPool::worker_loop(int id) {
+    worker_id = id;
+    // SIGUSR1 goes to the main thread, which runs the main machine
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &usr1, nullptr);
+    int stats_place = LiveStats::enter_thread();
+    while (!stopping.load()) {
+        task *t = take();
+        if (t != nullptr) {
+            execute(t);
+            continue;
+        }
+        std::unique_lock<std::mutex> guard(idle_lock);
+        idle.wait_for(guard, std::chrono::milliseconds(1), [this] { return queued.load() > 0 || stopping.load(); });
+    }
+    LiveStats::leave_thread(stats_place);
+}
+
+std::atomic<Machine *> Machine::main_machine{nullptr};
+std::unordered_map<std::string, instruct_code> Machine::string_inscode_mapping;
+int Machine::inscode_param_cnt_mapping[200];
+std::string Machine::inscode_name_mapping[200];
+
+// Buffered token reader over a (possibly encrypted) program file. It decrypts as it reads, so memory use
+// does not depend on the size of the file.
+class TokenReader {
+private:
+    FILE *file;
+    char buf[1 << 16];
+    size_t pos = 0, len = 0;
+    std::string key;
+    size_t offset = 0;
+    std::string scratch;
+    bool failed = false;
+
+    bool fill() {
+        len = file == nullptr ? 0 : fread(buf, 1, sizeof(buf), file);
+        for (size_t i = 0; i < len && !key.empty(); i++) buf[i] = (char) (buf[i] ^ key[(offset + i) % key.length()]);
+        for (size_t i = 0; i < len; i++) hash = (hash ^ (unsigned char) buf[i]) * 1099511628211ULL;
+        offset += len;
+        pos = 0;
+        return len > 0;
+    }
+
+public:
+    // FNV-1a of everything read so far (the same as Snapshot::hash of the decrypted file once it is all read)
+    unsigned long long hash = 1469598103934665603ULL;
+
+    // An empty key reads the file as it is
+    TokenReader(const std::string &path, std::string _key) : file(fopen(path.c_str(), "rb")), key(std::move(_key)) {
+        if (file == nullptr) {
+            panic("Cannot open " + path);
+        }
+    }
+
+    ~TokenReader() {
+        fclose(file);
+    }
+
+    // Next whitespace-separated token; false at the end of the file
+    bool token(std::string &tok) {
+        tok.clear();
+        while (true) {
+            if (pos == len && !fill()) return false;
+            if (!isspace((unsigned char) buf[pos])) break;
+            pos++;
+        }
+        while (true) {
+            size_t start = pos;
+            while (pos < len && !isspace((unsigned char) buf[pos])) pos++;
+            tok.append(buf + start, pos - start);
+            if (pos < len || !fill()) return true;
+        }
+    }
+
+    // Next token as an integer; false at the end of the file or if the token is not one
+    bool integer(std::string &tok, long long &v) {
+        if (!token(tok)) return false;
+        size_t i = tok[0] == '-' || tok[0] == '+' ? 1 : 0;
+        if (i == tok.size()) return false;
+        v = 0;
+        for (; i < tok.size(); i++) {
+            if (tok[i] < '0' || tok[i] > '9') return false;
+            v = v * 10 + (tok[i] - '0');
+        }
+        if (tok[0] == '-') v = -v;
+        return true;
+    }
+
+    // Stream-style extraction, so the program loader can read from this or from std::cin alike
+    TokenReader &operator>>(std::string &v) {
+        if (!token(v)) failed = true;
+        return *this;
+    }
+
+    template <class T>
+    TokenReader &operator>>(T &v) {
+        char *end = nullptr;
+        if (failed || !token(scratch)) {
+            failed = true;
+        } else if (std::is_floating_point<T>::value) {
+            v = (T) strtod(scratch.c_str(), &end);
+        } else {
+            v = (T) strtoll(scratch.c_str(), &end, 10);
+        }
+        if (!failed && (end == scratch.c_str() || *end != '\0')) failed = true;
+        return *this;
+    }
+
+    explicit operator bool() const {
+        return !failed;
+    }
+};
+
+// Buffered writer, encrypting as it writes when given a key
+class TokenWriter {
+private:
+    FILE *file;
+    bool owned;
+    char buf[1 << 16];
+    size_t len = 0;
+    std::string key;
+    size_t offset = 0;
 
-                        if (ins.operand == 0 || ins.operand == 1) {
-                            slot *res = nullptr;
-                            // NOT
-                            if (ins.operand == 0) {
-                                if (operand->type == INT) {
-                                    res = new slot((int_tp) (operand->int_val ? 0 : 1));
-                                }
-                            }
-                            // NEGATIVE
-                            if (ins.operand == 1) {
-                                if (operand->type == INT) {
-                                    res = new slot(-operand->int_val);
-                                } else if (operand->type == FLOAT) {
-                                    res = new slot(-operand->float_val);
-                                }
-                            }
+    void flush() {
+        for (size_t i = 0; i < len && !key.empty(); i++) buf[i] = (char) (buf[i] ^ key[(offset + i) % key.length()]);
+        fwrite(buf, 1, len, file);
+        offset += len;
+        len = 0;
+    }
 
-                            if (res == nullptr) {
-                                panic("Unsupported unary operator");
-                            }
+public:
+    TokenWriter(const std::string &path, std::string _key) : file(fopen(path.c_str(), "wb")), owned(true), key(std::move(_key)) {
+        if (file == nullptr) {
+            panic("Cannot open " + path);
+        }
+    }
 
-                            OP_PUSH(res);
-                            if (verbose) {
-                                std::cout << "Pop " << operand->as_string() << ", calculate with unary operator "
-                                          << ins.operand << ". Result " << res->as_string()
-                                          << " is pushed into the stack." << std::endl;
-                            }
-                            SLOT_DECREF(operand, "Unary-op for the operand, decref it");
-                            DISPATCH;
-                        }
+    explicit TokenWriter(FILE *_file) : file(_file), owned(false) {}
 
-                        // SELF INCREMENT BY ONE
-                        if (ins.operand == 2) {
-                            operand->int_val++;
-                            if (verbose) {
-                                std::cout << "Increased the loaded variable by one." << std::endl;
-                            }
-                            SLOT_DECREF(operand, "Increased by one");
-                            DISPATCH;
-                        }
-                        // SELF DECREASEMENT BY ONE
-                        if (ins.operand == 3) {
-                            operand->int_val--;
-                            if (verbose) {
-                                std::cout << "Decreased the loaded variable by one." << std::endl;
-                            }
-                            SLOT_DECREF(operand, "Decreased by one");
-                            DISPATCH;
-                        }
-                    }
-                    case BINARY_OP: {
-                        slot *right = OP_POP();
-                        slot *left = OP_POP();
+    ~TokenWriter() {
+        flush();
+        if (owned) fclose(file);
+        else fflush(file);
+    }
+
+    void put(const char *s, size_t n) {
+        // A token longer than buf goes through it in pieces, so that flush encrypts all of it
+        while (len + n > sizeof(buf)) {
+            size_t piece = sizeof(buf) - len;
+            memcpy(buf + len, s, piece);
+            len += piece;
+            flush();
+            s += piece;
+            n -= piece;
+        }
+        memcpy(buf + len, s, n);
+        len += n;
+    }
+
+    void put(const std::string &s) {
+        put(s.data(), s.size());
+    }
+
+    void put_int(long long v) {
+        char tmp[24];
+        int i = sizeof(tmp);
+        unsigned long long u = v < 0 ? 0ULL - (unsigned long long) v : (unsigned long long) v;
+        do {
+            tmp[--i] = (char) ('0' + u % 10);
+            u /= 10;
+        } while (u);
+        if (v < 0) tmp[--i] = '-';
+        put(tmp + i, sizeof(tmp) - i);
+    }
+};
+
+// Hash of a loaded program file, for snapshots; programs typed in interactively have none
+unsigned long long input_hash(const TokenReader &is) {
+    return is.hash;
+}
+
+unsigned long long input_hash(const std::istream &) {
+    return 0;
+}
+
+// Load one module into the image. Its addresses, constant indices and global indices are moved past those
+// of the modules loaded before it. Returns true when an interactive session ends its input with -1.
+template <class Input>
+bool load_module(Input &is, Machine &machine, bool in_interact) {
+    int address_base = 0, global_base = 0, constant_base = constant_cnt;
+    for (const instruct &ins : instructs) address_base = std::max(address_base, ins.address + 2);
+    for (const auto &import : imported) address_base = std::max(address_base, import.first + 2);
+    for (int start : module_starts) {
+        if (start < ins_cnt && instructs[start].code == VMALLOC) global_base = std::max(global_base, instructs[start].operand);
+    }
+    module_starts.push_back(ins_cnt);
+    int addr;
+    while (is >> addr) {
+        if (in_interact && addr == -1) {
+            return true;
+        }
+        instruct_code ins;
+        if (in_interact) {
+            std::string ins_str;
+            is >> ins_str;
+            ins = Machine::string_inscode_mapping[ins_str];
+        } else {
+            int ins_tmp = 0;
+            is >> ins_tmp;
+            ins = instruct_code(ins_tmp);
+        }
+        if (ins == EXPORT || ins == IMPORT) {
+            std::string name;
+            is >> name;
+            if (ins == IMPORT) {
+                imported[addr + address_base] = name;
+            } else if (!exported.emplace(name, addr + address_base).second) {
+                panic("Duplicate export " + name);
+            }
+            continue;
+        }
+        if (ins == FUNCTION) {
+            std::string name;
+            is >> name;
+            source_map.add_function(addr + address_base, name);
+            continue;
+        }
+        if (ins == LINE) {
+            int line = 0;
+            is >> line;
+            source_map.add_line(addr + address_base, line);
+            continue;
+        }
+        if (ins == MEMO) {
+            memo_marks.push_back(addr + address_base);
+            continue;
+        }
+        if (ins == CONSTANT) {
+            int type = -1;
+            is >> type;
+            switch (type) {
+                // int
+                case 0: {
+                    int_tp tmp = 0;
+                    is >> tmp;
+                    constants[constant_base + addr] = new slot(tmp);
+                    break;
+                }
+                    // float
+                case 1: {
+                    float_tp tmp = 0;
+                    is >> tmp;
+                    constants[constant_base + addr] = new slot(tmp);
+                    break;
+                }
+                    // char
+                case 2: {
+                    int tmp = 0;
+                    is >> tmp;
+                    constants[constant_base + addr] = new slot((char_tp) tmp);
+                    break;
+                }
+                    // string
+                case 4: {
+                    std::string hex;
+                    is >> hex;
+                    std::string bytes;
+                    if (!hex_decode(hex, bytes)) panic("Corrupted string constant");
+                    constants[constant_base + addr] = string_slot(bytes.data(), bytes.size());
+                    break;
+                }
+
+                default: {
+                    panic("Unexpected type");
+                }
+            }
+            is >> constants[constant_base + addr]->ref_cnt;
+            continue;
+        } else if (ins == CMALLOC) {
+            int cnt = 0;
+            is >> cnt;
+            if (cnt) {
+                auto **grown = new slot*[constant_base + cnt];
+                std::copy(constants, constants + constant_base, grown);
+                delete[] constants;
+                constants = grown;
+            }
+            constant_cnt = constant_base + cnt;
+            continue;
+        }
+        int param_number = Machine::inscode_param_cnt_mapping[ins];
+        int param = 0;
+        if (param_number) {
+            is >> param;
+        }
+        if (code_operand(ins)) {
+            param += address_base;
+        } else if (ins == LOAD_CONSTANT || ins == LOAD_STRING) {
+            param += constant_base;
+        } else if (ins == LOAD_NAME_GLOBAL || ins == STORE_NAME_GLOBAL || ins == STORE_NAME_GLOBAL_NOPOP
+                   || (ins == VMALLOC && ins_cnt == module_starts.back())) {
+            param += global_base;
+        }
+        if (param_number) {
+            machine.add_instruct(instruct(addr + address_base, ins, param));
+        } else {
+            machine.add_instruct(instruct(addr + address_base, ins));
+        }
+    }
+    return false;
+}
+
+// Load more modules (.slb files) after the program
+void load_modules(const std::vector<std::string> &module_paths, Machine &machine, const std::string &password) {
+    for (const std::string &path : module_paths) {
+        TokenReader module(path, MAGIC + password);
+        std::string hd;
+        module >> hd;
+        if (hd + " " != MAGIC) {
+            panic("Not a bytecode file (or wrong password): " + path);
+        }
+        load_module(module, machine, false);
+        Snapshot::program_hash = Snapshot::program_hash * 31 + module.hash;
+    }
+}
+
+// Run a program, with more modules (.slb files) linked after it
+template <class Input>
+void interpret(Input &is, bool verbose, bool evaluate, bool in_interact, bool debug = false,
+               const std::vector<std::string> &module_paths = {}, const std::string &password = "",
+               bool profile = false) {
+    Machine machine;
+    if (verbose) {
+        machine.enable_verbose();
+    }
+    if (debug) {
+        machine.enable_debugger();
+    }
+    if (evaluate) {
+        machine.enable_evaluator();
+    }
+    if (profile) {
+        machine.enable_profiling();
+    }
+    LiveStats::enter_thread();
+    struct sigaction sa{};
+    sa.sa_handler = Machine::live_stats_handler;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, nullptr);
+    bool ended = load_module(is, machine, in_interact);
+    Snapshot::program_hash = input_hash(is);
+    load_modules(module_paths, machine, password);
+    if (!in_interact || ended) {
+        // The debugger stops at the instructions of the program as written
+        machine.link(!debug);
+        if (debug) {
+            // Breakpoints are patched into the shared instructs, which task threads would be reading concurrently
+            for (int k = 0; k < ins_cnt; k++) {
+                if (instructs[k].code == SPAWN_CALL) panic("The debugger cannot run a program that spawns tasks");
+            }
+        }
+        if (debug || !Snapshot::path.empty()) {
+            original_instructs.assign(instructs.begin(), instructs.begin() + ins_cnt);
+        }
+        if (!Snapshot::path.empty()) {
+            machine.prepare_snapshot();
+        }
+        Machine::main_machine = &machine;
+        machine.dispatch();
+        Machine::main_machine = nullptr;
+        LiveStats::published_ip = -1;
+    }
+    // Workers must be joined before static destruction tears down the slot free lists and statistics they use
+    if (task_pool != nullptr) {
+        task_pool->shutdown();
+        delete task_pool;
+        task_pool = nullptr;
+    }
+}
+
+void interact(bool verbose, bool evaluate) {
+    vm_input.use_stdio = true;
+    interpret(std::cin, verbose, evaluate, true);
+}
+
+void assemble(const std::string& raw_file_path, const std::string& out_file_path, std::string password, bool verbose) {
+    std::cout << "<<<<* SLang Virtual Machine Assembler *>>>>" << std::endl;
+    TokenReader in(raw_file_path, "");
+    TokenWriter out(out_file_path, MAGIC + password);
+    out.put(MAGIC);
+    std::string tok;
+    long long addr;
+    while (in.integer(tok, addr)) {
+        if (!in.token(tok)) break;
+        int ins = mnemonics.find(tok.data(), tok.size());
+        if (ins < 0) {
+            panic("Unknown instruction " + tok);
+        }
+        if (verbose) {
+            std::cout << ":Generating " << tok << " at " << addr << "..." << std::endl;
+        }
+        out.put_int(addr);
+        out.put(" ", 1);
+        out.put_int(ins);
+        out.put(" ", 1);
+        int param_number = Machine::inscode_param_cnt_mapping[ins];
+        while (param_number-- && in.token(tok)) {
+            out.put(tok);
+            out.put(" ", 1);
+        }
+    }
+}
+
+void run(const std::string& input_file_path, const std::vector<std::string> &module_paths, bool verbose, bool evaluate,
+         bool profile, bool debug, const std::string &password) {
+    TokenReader program(input_file_path, MAGIC + password);
+    std::string hd;
+    program >> hd;
+    interpret(program, verbose, evaluate, false, debug, module_paths, password, profile);
+}
+
+void disassemble(const std::string& input_file_path, std::string password) {
+    TokenReader in(input_file_path, MAGIC + password);
+    TokenWriter out(stdout);
+    std::string tok;
+    long long addr, ins;
+    in.token(tok);
+    while (in.integer(tok, addr)) {
+        out.put_int(addr);
+        out.put(" ", 1);
+        if (!in.integer(tok, ins) || ins < 0 || ins >= 200) break;
+        out.put(Machine::inscode_name_mapping[ins]);
+        out.put(" ", 1);
+        int param_number = Machine::inscode_param_cnt_mapping[ins];
+        while (param_number-- && in.token(tok)) {
+            out.put(tok);
+            out.put(" ", 1);
+        }
+        out.put("\n", 1);
+    }
+}
+
+// Print a trace recorded with -t: a summary, or every record with -v
+void decode_trace(const std::string &path, bool verbose) {
+    std::ifstream in(path, std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    size_t p = 0;
+    bool truncated = false;
+    auto varint = [&]() -> unsigned long long {
+        unsigned long long v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (p >= data.size()) {
+                truncated = true;
+                return 0;
+            }
+            auto b = (unsigned char) data[p++];
+            v |= (unsigned long long) (b & 0x7f) << shift;
+            if (!(b & 0x80)) break;
+        }
+        return v;
+    };
+    if (data.compare(0, 9, "SVMTRACE\n") != 0) {
+        panic("Not a trace file: " + path);
+    }
+    p = 9;
+    int cnt = (int) varint();
+    std::vector<int> address(cnt);
+    std::vector<instruct_code> code(cnt);
+    for (int k = 0, prev = 0; k < cnt && !truncated; k++) {
+        address[k] = prev = (int) (prev + Trace::unzigzag(varint()));
+        code[k] = p < data.size() ? (instruct_code) (unsigned char) data[p++] : NOOP;
+    }
+    SourceMap source;
+    int entries = (int) varint();
+    for (int k = 0, prev = 0; k < entries && !truncated; k++) {
+        prev = (int) (prev + Trace::unzigzag(varint()));
+        size_t len = varint();
+        if (p + len > data.size()) truncated = true;
+        if (truncated) break;
+        source.add_function(prev, data.substr(p, len));
+        p += len;
+    }
+    entries = (int) varint();
+    for (int k = 0, prev = 0; k < entries && !truncated; k++) {
+        prev = (int) (prev + Trace::unzigzag(varint()));
+        source.add_line(prev, (int) varint());
+    }
+    if (truncated) {
+        panic("Corrupted trace header");
+    }
+    source.seal();
+    auto name_of = [&](long long k) -> std::string {
+        if (k < 0 || k >= cnt) return "#?";
+        return "#" + std::to_string(address[k]) + " " + Machine::inscode_name_mapping[code[k]] + " "
+               + source.where(address[k]);
+    };
+    // Times each instruction ran, as a difference array over runs
+    std::vector<long long> runs(cnt + 1, 0), events(8, 0);
+    std::unordered_map<int, long long> calls;
+    std::deque<std::string> last;
+    long long cur = -1, executed = 0;
+    bool ended = false;
+    while (p < data.size() && !ended) {
+        unsigned long long head = varint();
+        auto k = (Trace::kind) (head & 7);
+        long long run = (long long) (head >> 3);
+        if (k == Trace::PAD) continue;
+        unsigned long long arg = varint();
+        if (truncated) break;
+        events[k]++;
+        if (k == Trace::SYNC) {
+            cur = (long long) arg;
+            continue;
+        }
+        if (k == Trace::INPUT) {
+            if (verbose) {
+                std::cout << "input " << (arg == 256 ? std::string("EOF") : std::to_string(arg)) << std::endl;
+            }
+            continue;
+        }
+        if (cur < 0) continue;
+        long long at = cur + run - 1;
+        if (run > 0 && cur < cnt && at < cnt) {
+            runs[cur]++;
+            runs[at + 1]--;
+            executed += run;
+        }
+        std::string line = "#" + (cur >= 0 && cur < cnt ? std::to_string(address[cur]) : std::string("?")) + " .. "
+                           + name_of(at);
+        if (k == Trace::END) {
+            line += " end";
+            ended = true;
+        } else {
+            long long target = at + 1 + Trace::unzigzag(arg);
+            line += std::string(k == Trace::SWITCH ? " switch" : "") + " -> " + name_of(target);
+            if (k == Trace::CALL && target >= 0 && target < cnt) {
+                // CALL_ARGS lands after the prologue of the function: count the call at its entry
+                long long entry = target;
+                if (at >= 0 && at < cnt && code[at] == CALL_ARGS) {
+                    while (entry > 0 && code[entry - 1] == STORE_NAME) entry--;
+                    if (entry > 0 && code[entry - 1] == VMALLOC) entry--;
+                    while (entry > 0 && code[entry - 1] == LOAD_GLOBAL) entry--;
+                }
+                calls[address[entry]]++;
+            }
+            cur = target;
+        }
+        if (verbose) {
+            std::cout << line << std::endl;
+        } else {
+            last.push_back(line);
+            if (last.size() > 16) last.pop_front();
+        }
+    }
+    if (verbose) return;
+    std::cout << "<<<<* SLang Trace Decoder *>>>>" << std::endl;
+    std::cout << ":Instructions " << executed << std::endl;
+    std::cout << ":Jumps " << events[Trace::JUMP] << ", calls " << events[Trace::CALL] << ", returns "
+              << events[Trace::RET] << ", coroutine switches " << events[Trace::SWITCH] << ", input bytes "
+              << events[Trace::INPUT] << std::endl;
+    std::vector<std::pair<long long, int>> hot;
+    long long times = 0;
+    for (int k = 0; k < cnt; k++) {
+        times += runs[k];
+        if (times > 0) hot.emplace_back(times, k);
+    }
+    std::sort(hot.begin(), hot.end(), [](const std::pair<long long, int> &a, const std::pair<long long, int> &b) {
+        return a.first != b.first ? a.first > b.first : a.second < b.second;
+    });
+    std::cout << ":Hottest instructions" << std::endl;
+    for (size_t i = 0; i < hot.size() && i < 10; i++) {
+        std::cout << "  " << std::setw(12) << hot[i].first << "  " << name_of(hot[i].second) << std::endl;
+    }
+    std::vector<std::pair<long long, int>> called;
+    for (const auto &c : calls) called.emplace_back(c.second, c.first);
+    std::sort(called.begin(), called.end(), [](const std::pair<long long, int> &a, const std::pair<long long, int> &b) {
+        return a.first != b.first ? a.first > b.first : a.second < b.second;
+    });
+    std::cout << ":Most called functions" << std::endl;
+    for (size_t i = 0; i < called.size() && i < 10; i++) {
+        std::cout << "  " << std::setw(12) << called[i].first << "  " << source.function(called[i].second) << std::endl;
+    }
+    std::cout << ":Last transfers" << std::endl;
+    for (const std::string &line : last) std::cout << "  " << line << std::endl;
+    if (!ended) {
+        std::cout << ":No end record (stopped by panic or signal); last run started at "
+                  << (cur >= 0 && cur < cnt ? name_of(cur) : std::string("#?")) << std::endl;
+    }
+}
+
+// Program image, as read from a .sli/.slb file by the offline tools
+struct constant_def {
+    int type{};
+    std::string value;
+    int ref_cnt{};
+};
+
+struct program {
+    std::vector<instruct> code;
+    std::vector<constant_def> constants;
+    // (address, name) of exported functions
+    std::vector<std::pair<int, std::string>> exports;
+    // Names of imported functions; each one is an IMPORT instruction in code (operand: index here) placed after
+    // the rest, so that the optimiser sees it as an external function
+    std::vector<std::string> imports;
+    // Debug section as written in the file
+    SourceMap source_map;
+    // Functions marked MEMO
+    std::vector<int> memo;
+};
+
+void crypt(std::string &s, std::string password) {
+    password = MAGIC + password;
+    size_t len = password.length();
+    for (size_t i = 0; i < s.length(); i++) s[i] = (char) ((unsigned int) s[i] ^ (unsigned int) password[i % len]);
+}
+
+// Read a program in .sli (mnemonic) or .slb (numeric, header already skipped) form
+void load_program(std::istream &is, bool mnemonic, program &prog) {
+    std::vector<instruct> imports;
+    int addr;
+    while (is >> addr) {
+        instruct_code ins;
+        if (mnemonic) {
+            std::string ins_str;
+            is >> ins_str;
+            int code = mnemonics.find(ins_str.data(), ins_str.size());
+            if (code < 0) {
+                panic("Unknown instruction " + ins_str);
+            }
+            ins = instruct_code(code);
+        } else {
+            int ins_tmp;
+            is >> ins_tmp;
+            ins = instruct_code(ins_tmp);
+        }
+        if (ins == CMALLOC) {
+            int cnt;
+            is >> cnt;
+            prog.constants.resize(cnt);
+            continue;
+        }
+        if (ins == EXPORT || ins == IMPORT) {
+            std::string name;
+            is >> name;
+            if (ins == EXPORT) {
+                prog.exports.emplace_back(addr, name);
+            } else {
+                imports.emplace_back(addr, IMPORT, (int) prog.imports.size());
+                prog.imports.push_back(name);
+            }
+            continue;
+        }
+        if (ins == FUNCTION) {
+            std::string name;
+            is >> name;
+            prog.source_map.add_function(addr, name);
+            continue;
+        }
+        if (ins == LINE) {
+            int line = 0;
+            is >> line;
+            prog.source_map.add_line(addr, line);
+            continue;
+        }
+        if (ins == MEMO) {
+            prog.memo.push_back(addr);
+            continue;
+        }
+        if (ins == CONSTANT) {
+            constant_def c;
+            is >> c.type >> c.value >> c.ref_cnt;
+            if (addr >= (int) prog.constants.size()) prog.constants.resize(addr + 1);
+            prog.constants[addr] = c;
+            continue;
+        }
+        int operand = 0;
+        if (Machine::inscode_param_cnt_mapping[ins]) {
+            is >> operand;
+        }
+        prog.code.emplace_back(addr, ins, operand);
+    }
+    prog.code.insert(prog.code.end(), imports.begin(), imports.end());
+    prog.source_map.seal();
+}
+
+// Read a .slb file, or a plain .sli file if it does not decrypt to a valid header
+void load_program_file(const std::string &path, const std::string &password, program &prog) {
+    std::ifstream input_file(path, std::ios::in);
+    if (!input_file) {
+        panic("Cannot open " + path);
+    }
+    std::string content((std::istreambuf_iterator<char>(input_file)),
+                        (std::istreambuf_iterator<char>()));
+    std::string decrypted = content;
+    crypt(decrypted, password);
+    if (decrypted.compare(0, strlen(MAGIC), MAGIC) == 0) {
+        std::stringstream ss(decrypted.substr(strlen(MAGIC)));
+        load_program(ss, false, prog);
+    } else {
+        std::stringstream ss(content);
+        load_program(ss, true, prog);
+    }
+}
+
+void save_program_file(const std::string &path, const std::string &password, const program &prog) {
+    std::stringstream buf;
+    buf << MAGIC;
+    for (const auto &ins : prog.code) {
+        buf << ins.address << " " << ins.code << " ";
+        if (ins.code == IMPORT) {
+            buf << prog.imports[ins.operand] << " ";
+        } else if (Machine::inscode_param_cnt_mapping[ins.code]) {
+            buf << ins.operand << " ";
+        }
+    }
+    for (const auto &e : prog.exports) {
+        buf << e.first << " " << EXPORT << " " << e.second << " ";
+    }
+    for (const auto &f : prog.source_map.function_entries()) {
+        buf << f.first << " " << FUNCTION << " " << f.second << " ";
+    }
+    for (const auto &l : prog.source_map.line_entries()) {
+        buf << l.first << " " << LINE << " " << l.second << " ";
+    }
+    for (int address : prog.memo) {
+        buf << address << " " << MEMO << " ";
+    }
+    buf << 0 << " " << CMALLOC << " " << prog.constants.size() << " ";
+    for (size_t i = 0; i < prog.constants.size(); i++) {
+        const constant_def &c = prog.constants[i];
+        buf << i << " " << CONSTANT << " " << c.type << " " << c.value << " " << c.ref_cnt << " ";
+    }
+    std::string s = buf.str();
+    crypt(s, password);
+    std::ofstream out_file(path, std::ios::out | std::ios::trunc);
+    out_file << s;
+}
+
+// Bytecode optimiser (svm -O)
+// Passes rewrite the instruction list in place and turn deleted instructions into NOOP; after every
+// pass the NOOPs are dropped and jumps to them are redirected to the next remaining instruction.
+class Optimiser {
+    friend class Translator;
+private:
+    // Profile-guided passes (-P): a site is hot once it ran this often
+    static const long long HOT = 100;
+    static const int MAX_LOOP_TEST = 8;
+    static const int INLINE_SIZE = 16;
+    program &prog;
+    std::vector<instruct> &code;
+    std::unordered_map<int, int> index_of;
+    std::vector<char> leader;
+    std::vector<char> targeted;
+    bool has_inplace_ops = false;
+    Profile *profile;
+    // Address for the next instruction a pass adds
+    int next_address = 0;
+    // Debug section: functions move with their entries like exports, lines are kept per instruction
+    std::vector<std::pair<int, std::string>> functions;
+    std::unordered_map<int, int> line_at;
+
+    static bool is_jump(instruct_code c) {
+        return c == JMP || c == JMP_TRUE || c == JMP_FALSE;
+    }
+
+    // SPAWN_CALL, COROUTINE_CALL and CALL_ARGS only exist after loading, but are handled for hand-written code
+    static bool is_call(instruct_code c) {
+        return c == CALL || c == SPAWN_CALL || c == COROUTINE_CALL || c == CALL_ARGS;
+    }
+
+    // Other code may run (and change globals) before the next instruction
+    static bool switches_context(const instruct &ins) {
+        instruct_code c = ins.code;
+        return c == RESUME || c == YIELD || c == SCHEDULE || c == GETCH || c == JOIN ||
+               (c == CALL_NATIVE && ins.operand == NATIVE_READ_STR);
+    }
+
+    static bool is_store(instruct_code c) {
+        return c == STORE_NAME || c == STORE_NAME_NOPOP || c == STORE_NAME_GLOBAL || c == STORE_NAME_GLOBAL_NOPOP;
+    }
+
+    static bool is_load(instruct_code c) {
+        return c == LOAD_NAME || c == LOAD_NAME_GLOBAL;
+    }
+
+    static bool is_global(instruct_code c) {
+        return c == LOAD_NAME_GLOBAL || c == STORE_NAME_GLOBAL || c == STORE_NAME_GLOBAL_NOPOP;
+    }
 
-                        slot *res = nullptr;
-                        // +
-                        if (ins.operand == 0) {
-                            if (left->type == INT && right->type == INT) {
-                                res = new slot(left->int_val + right->int_val);
-                            } else if (left->type == INT && right->type == FLOAT) {
-                                res = new slot(left->int_val + right->float_val);
-                            } else if (left->type == FLOAT && right->type == INT) {
-                                res = new slot(left->float_val + right->int_val);
-                            } else if (left->type == FLOAT && right->type == FLOAT) {
-                                res = new slot(left->float_val + right->float_val);
-                            }
-                        }
+    static bool is_nopop(instruct_code c) {
+        return c == STORE_NAME_NOPOP || c == STORE_NAME_GLOBAL_NOPOP;
+    }
 
-                            // -
-                        else if (ins.operand == 1) {
-                            if (left->type == INT && right->type == INT) {
-                                res = new slot(left->int_val - right->int_val);
-                            } else if (left->type == INT && right->type == FLOAT) {
-                                res = new slot(left->int_val - right->float_val);
-                            } else if (left->type == FLOAT && right->type == INT) {
-                                res = new slot(left->float_val - right->int_val);
-                            } else if (left->type == FLOAT && right->type == FLOAT) {
-                                res = new slot(left->float_val - right->float_val);
-                            }
-                        }
+    // Pushes exactly one value and has no other effect
+    static bool is_pure_push(instruct_code c) {
+        return c == LOAD_NULL || c == LOAD_CONSTANT || c == LOAD_NAME || c == LOAD_NAME_GLOBAL ||
+               c == LOAD_INT || c == LOAD_FLOAT || c == LOAD_CHAR;
+    }
 
-                            // *
-                        else if (ins.operand == 2) {
-                            if (left->type == INT && right->type == INT) {
-                                res = new slot(left->int_val * right->int_val);
-                            } else if (left->type == INT && right->type == FLOAT) {
-                                res = new slot(left->int_val * right->float_val);
-                            } else if (left->type == FLOAT && right->type == INT) {
-                                res = new slot(left->float_val * right->int_val);
-                            } else if (left->type == FLOAT && right->type == FLOAT) {
-                                res = new slot(left->float_val * right->float_val);
-                            }
-                        }
+    static bool ends_block(const instruct &ins) {
+        instruct_code c = ins.code;
+        return is_jump(c) || is_call(c) || switches_context(ins) || c == RET || c == HALT || c == IMPORT;
+    }
 
-                            // %
-                        else if (ins.operand == 3) {
-                            if (left->type == INT && right->type == INT) {
-                                res = new slot(left->int_val % right->int_val);
-                            }
-                        }
+    // Variable key shared by loads and stores: locals and globals live in different namespaces
+    static long long var_key(const instruct &ins) {
+        return ((long long) is_global(ins.code) << 32) | (unsigned int) ins.operand;
+    }
 
-                            // /
-                        else if (ins.operand == 4) {
-                            if (left->type == INT && right->type == INT) {
-                                res = new slot(left->int_val / right->int_val);
-                            } else if (left->type == INT && right->type == FLOAT) {
-                                res = new slot(left->int_val / right->float_val);
-                            } else if (left->type == FLOAT && right->type == INT) {
-                                res = new slot(left->float_val / right->int_val);
-                            } else if (left->type == FLOAT && right->type == FLOAT) {
-                                res = new slot(left->float_val / right->float_val);
-                            }
-                        }
+    // Values popped and pushed by an instruction, seen from the current operand stack.
+    // NOPOP stores and STORE_SUBSCR_INPLACE leave the value (or array) below them untouched.
+    static bool stack_effect(const instruct &ins, int &pops, int &pushes) {
+        pops = pushes = 0;
+        switch (ins.code) {
+            case NOOP: case VMALLOC: case JMP: case STORE_NAME_NOPOP: case STORE_NAME_GLOBAL_NOPOP:
+                return true;
+            case LOAD_NULL: case LOAD_CONSTANT: case LOAD_NAME: case LOAD_NAME_GLOBAL:
+            case LOAD_INT: case LOAD_FLOAT: case LOAD_CHAR: case GETCH: case LOAD_STRING:
+                pushes = 1;
+                return true;
+            case POP_OP: case STORE_NAME: case STORE_NAME_GLOBAL: case JMP_TRUE: case JMP_FALSE:
+            case PRINTK: case PUTCH:
+                pops = 1;
+                return true;
+            case TYPE_CVT: case SIZE_OF:
+                pops = pushes = 1;
+                return true;
+            case BUILD_ARR:
+                pops = std::max(1, ins.operand >> 4);
+                pushes = 1;
+                return true;
+            case SUBSCR_2D:
+                pops = 3;
+                pushes = 1;
+                return true;
+            case STORE_SUBSCR_2D:
+                pops = 4;
+                return true;
+            case BUILD_MAP:
+                pushes = 1;
+                return true;
+            case MAP_SIZE:
+                pops = pushes = 1;
+                return true;
+            case MAP_GET: case MAP_HAS:
+                pops = 2;
+                pushes = 1;
+                return true;
+            case MAP_PUT:
+                pops = 3;
+                return true;
+            case MAP_DEL:
+                pops = 2;
+                return true;
+            case UNARY_OP:
+                pops = 1;
+                pushes = ins.operand == 0 || ins.operand == 1;
+                return true;
+            case BINARY_OP: case BINARY_OP_INT: case BINARY_SUBSCR: case BINARY_SUBSCR_UNCHECKED:
+                pops = 2;
+                pushes = 1;
+                return true;
+            case STORE_SUBSCR: case STORE_SUBSCR_UNCHECKED:
+                pops = 3;
+                return true;
+            case STORE_SUBSCR_INPLACE:
+                pops = 2;
+                return true;
+            case STORE_SUBSCR_NOPOP:
+                pops = 3;
+                pushes = 1;
+                return true;
+            default:
+                return false;
+        }
+    }
 
-                            // &
-                        else if (ins.operand == 5) {
-                            if (left->type == INT && right->type == INT) {
-                                res = new slot((int_tp) ((unsigned int) left->int_val & (unsigned int) right->int_val));
-                            }
-                        }
+    // Index of the instruction in the same basic block that pushed the value at `depth` (0 is the top)
+    // of the operand stack just before instruction q, or -1 if it cannot be told
+    int producer(int q, int depth) {
+        for (int j = q - 1; j >= 0; j--) {
+            int pops, pushes;
+            if (!stack_effect(code[j], pops, pushes)) return -1;
+            if (depth < pushes) return j;
+            depth += pops - pushes;
+            if (leader[j]) return -1;
+        }
+        return -1;
+    }
 
-                            // |
-                        else if (ins.operand == 6) {
-                            if (left->type == INT && right->type == INT) {
-                                res = new slot((int_tp) ((unsigned int) left->int_val | (unsigned int) right->int_val));
-                            }
-                        }
+    int export_target(const std::pair<int, std::string> &e) {
+        auto it = index_of.find(e.first);
+        if (it == index_of.end()) {
+            panic("Export of unknown address " + e.second);
+        }
+        return it->second;
+    }
 
-                            // <<
-                        else if (ins.operand == 7) {
-                            if (left->type == INT && right->type == INT) {
-                                res = new slot((int_tp) ((unsigned int) left->int_val << (unsigned int) right->int_val));
-                            }
-                        }
+    int target(const instruct &ins) {
+        auto it = index_of.find(ins.operand);
+        if (it == index_of.end()) {
+            panic("Jump to unknown address " + std::to_string(ins.operand));
+        }
+        return it->second;
+    }
 
-                            // >>
-                        else if (ins.operand == 8) {
-                            if (left->type == INT && right->type == INT) {
-                                res = new slot((int_tp) ((unsigned int) left->int_val >> (unsigned int) right->int_val));
-                            }
-                        }
+    void remove(int i) {
+        code[i] = instruct(code[i].address, NOOP, 0);
+    }
 
+    bool int_literal(const instruct &ins, int_tp &val) {
+        if (ins.code == LOAD_INT) {
+            val = ins.operand;
+            return true;
+        }
+        if (ins.code == LOAD_CONSTANT && prog.constants[ins.operand].type == INT) {
+            val = std::stoll(prog.constants[ins.operand].value);
+            return true;
+        }
+        return false;
+    }
 
-                            // ^
-                        else if (ins.operand == 9) {
-                            if (left->type == INT && right->type == INT) {
-                                res = new slot((int_tp) ((unsigned int) left->int_val ^ (unsigned int) right->int_val));
-                            }
-                        }
+    bool char_literal(const instruct &ins, int &val) {
+        if (ins.code == LOAD_CHAR) {
+            val = ins.operand;
+            return true;
+        }
+        if (ins.code == LOAD_CONSTANT && prog.constants[ins.operand].type == CHAR) {
+            val = std::stoi(prog.constants[ins.operand].value);
+            return true;
+        }
+        return false;
+    }
 
-                            // <
-                        else if (ins.operand == 10) {
-                            if (left->type == INT && right->type == INT) {
-                                res = new slot(left->int_val < right->int_val);
-                            } else if (left->type == INT && right->type == FLOAT) {
-                                res = new slot(left->int_val < right->float_val);
-                            } else if (left->type == FLOAT && right->type == INT) {
-                                res = new slot(left->float_val < right->int_val);
-                            } else if (left->type == FLOAT && right->type == FLOAT) {
-                                res = new slot(left->float_val < right->float_val);
-                            }
-                        }
+    // Index of the string constant with these bytes, added to the pool if new
+    int intern_string(const std::string &bytes) {
+        std::string hex = hex_encode(bytes);
+        for (size_t k = 0; k < prog.constants.size(); k++) {
+            if (prog.constants[k].type == ARRAY && prog.constants[k].value == hex) return k;
+        }
+        constant_def c;
+        c.type = ARRAY;
+        c.value = hex;
+        c.ref_cnt = 1;
+        prog.constants.push_back(c);
+        return prog.constants.size() - 1;
+    }
 
-                            // <=
-                        else if (ins.operand == 11) {
-                            if (left->type == INT && right->type == INT) {
-                                res = new slot(left->int_val <= right->int_val);
-                            } else if (left->type == INT && right->type == FLOAT) {
-                                res = new slot(left->int_val <= right->float_val);
-                            } else if (left->type == FLOAT && right->type == INT) {
-                                res = new slot(left->float_val <= right->int_val);
-                            } else if (left->type == FLOAT && right->type == FLOAT) {
-                                res = new slot(left->float_val <= right->float_val);
-                            }
-                        }
+    static bool fits_operand(int_tp val) {
+        return val >= INT32_MIN && val <= INT32_MAX;
+    }
 
-                            // >
-                        else if (ins.operand == 12) {
-                            if (left->type == INT && right->type == INT) {
-                                res = new slot(left->int_val > right->int_val);
-                            } else if (left->type == INT && right->type == FLOAT) {
-                                res = new slot(left->int_val > right->float_val);
-                            } else if (left->type == FLOAT && right->type == INT) {
-                                res = new slot(left->float_val > right->int_val);
-                            } else if (left->type == FLOAT && right->type == FLOAT) {
-                                res = new slot(left->float_val > right->float_val);
-                            }
-                        }
+    // Same semantics as BINARY_OP on two ints
+    static bool fold_binary(int op, int_tp l, int_tp r, int_tp &res) {
+        switch (op) {
+            case 0: res = l + r; return true;
+            case 1: res = l - r; return true;
+            case 2: res = l * r; return true;
+            case 3: if (r == 0) return false; res = l % r; return true;
+            case 4: if (r == 0) return false; res = l / r; return true;
+            case 5: res = (int_tp) ((unsigned int) l & (unsigned int) r); return true;
+            case 6: res = (int_tp) ((unsigned int) l | (unsigned int) r); return true;
+            case 7: if (r < 0 || r >= 32) return false; res = (int_tp) ((unsigned int) l << (unsigned int) r); return true;
+            case 8: if (r < 0 || r >= 32) return false; res = (int_tp) ((unsigned int) l >> (unsigned int) r); return true;
+            case 9: res = (int_tp) ((unsigned int) l ^ (unsigned int) r); return true;
+            case 10: res = l < r; return true;
+            case 11: res = l <= r; return true;
+            case 12: res = l > r; return true;
+            case 13: res = l >= r; return true;
+            case 14: res = l == r; return true;
+            case 15: res = l != r; return true;
+            default: return false;
+        }
+    }
 
-                            // >=
-                        else if (ins.operand == 13) {
-                            if (left->type == INT && right->type == INT) {
-                                res = new slot(left->int_val >= right->int_val);
-                            } else if (left->type == INT && right->type == FLOAT) {
-                                res = new slot(left->int_val >= right->float_val);
-                            } else if (left->type == FLOAT && right->type == INT) {
-                                res = new slot(left->float_val >= right->int_val);
-                            } else if (left->type == FLOAT && right->type == FLOAT) {
-                                res = new slot(left->float_val >= right->float_val);
-                            }
-                        }
+    void analyse() {
+        int n = code.size();
+        index_of.clear();
+        for (int i = 0; i < n; i++) index_of[code[i].address] = i;
+        leader.assign(n, 0);
+        targeted.assign(n, 0);
+        if (n) leader[0] = 1;
+        for (const auto &e : prog.exports) leader[export_target(e)] = targeted[export_target(e)] = 1;
+        for (int i = 0; i < n; i++) {
+            if (is_jump(code[i].code) || is_call(code[i].code)) leader[target(code[i])] = targeted[target(code[i])] = 1;
+            if (ends_block(code[i]) && i + 1 < n) leader[i + 1] = 1;
+        }
+    }
 
-                        // ==
-                        else if (ins.operand == 14) {
-                            if (left->type == INT && right->type == INT) {
-                                res = new slot(left->int_val == right->int_val);
-                            } else if (left->type == FLOAT && right->type == FLOAT) {
-                                res = new slot(left->float_val == right->float_val);
-                            } else if (left->type == CHAR && right->type == CHAR) {
-                                res = new slot(left->char_val == right->char_val);
-                            } else {
-                                res = new slot(false);
-                            }
-                        }
+    // Drop NOOPs and redirect jumps that pointed at them
+    void compact() {
+        int n = code.size();
+        std::unordered_map<int, int> redirect;
+        std::vector<instruct> kept;
+        std::vector<int> pending;
+        for (int i = 0; i < n; i++) {
+            if (code[i].code == NOOP && i != n - 1) {
+                pending.push_back(code[i].address);
+                continue;
+            }
+            for (int addr : pending) redirect[addr] = code[i].address;
+            pending.clear();
+            kept.push_back(code[i]);
+        }
+        for (auto &ins : kept) {
+            if (is_jump(ins.code) || is_call(ins.code)) {
+                auto it = redirect.find(ins.operand);
+                if (it != redirect.end()) ins.operand = it->second;
+            }
+        }
+        for (auto &e : prog.exports) {
+            auto it = redirect.find(e.first);
+            if (it != redirect.end()) e.first = it->second;
+        }
+        for (auto &f : functions) {
+            auto it = redirect.find(f.first);
+            if (it != redirect.end()) f.first = it->second;
+        }
+        for (int &address : prog.memo) {
+            auto it = redirect.find(address);
+            if (it != redirect.end()) address = it->second;
+        }
+        code.swap(kept);
+        analyse();
+    }
 
-                            // !=
-                        else if (ins.operand == 15) {
-                            if (left->type == INT && right->type == INT) {
-                                res = new slot(left->int_val != right->int_val);
-                            } else if (left->type == FLOAT && right->type == FLOAT) {
-                                res = new slot(left->float_val != right->float_val);
-                            } else if (left->type == CHAR && right->type == CHAR) {
-                                res = new slot(left->char_val != right->char_val);
-                            } else {
-                                res = new slot(true);
-                            }
-                        }
+    void successors(int i, std::vector<int> &succ) {
+        succ.clear();
+        const instruct &ins = code[i];
+        int n = code.size();
+        if (ins.code == RET || ins.code == HALT || ins.code == IMPORT) return;
+        if (is_jump(ins.code)) succ.push_back(target(ins));
+        if (ins.code != JMP && i + 1 < n) succ.push_back(i + 1);
+    }
 
-                        if (res == nullptr) {
-                            panic("Unsupported binary operator");
-                        }
+    std::vector<char> reachable_from(const std::vector<int> &roots, bool into_calls) {
+        std::vector<char> seen(code.size(), 0);
+        std::vector<int> stack(roots), succ;
+        while (!stack.empty()) {
+            int i = stack.back();
+            stack.pop_back();
+            if (seen[i]) continue;
+            seen[i] = 1;
+            successors(i, succ);
+            if (into_calls && is_call(code[i].code)) succ.push_back(target(code[i]));
+            for (int s : succ) if (!seen[s]) stack.push_back(s);
+        }
+        return seen;
+    }
 
-                        OP_PUSH(res);
-                        if (verbose) {
-                            std::cout << "Pop " << left->as_string() << " and " << right->as_string()
-                                      << ", calculate with binary operator " << ins.operand << ". Result "
-                                      << res->as_string() << " is pushed into the stack." << std::endl;
-                        }
-                        SLOT_DECREF(left, "Bin-Op Left operand decref");
-                        SLOT_DECREF(right, "Bin-Op Right operand decref");
-                        DISPATCH;
-                    }
-                    case HALT: {
-                        if (verbose) {
-                            std::cout << "Program received HALT signal, terminating..." << std::endl;
-                        }
-                        goto finish;
-                    }
-                    case PRINTK: {
-                        slot *slot = OP_POP();
-                        std::cout << slot->as_string() << std::endl;
-                        SLOT_DECREF(slot, "Printk");
-                        DISPATCH;
-                    }
-                    case PUTCH: {
-                        slot *slot = OP_POP();
-                        SLOT_DECREF(slot, "Putch");
-                        std::cout << slot->char_val;
-                        DISPATCH;
+    int pass_constant_folding() {
+        int cnt = 0, n = code.size();
+        for (int i = 0; i + 1 < n; i++) {
+            int_tp l, r, res;
+            instruct &a = code[i], &b = code[i + 1];
+            if (i + 2 < n && !leader[i + 1] && !leader[i + 2] && code[i + 2].code == BINARY_OP) {
+                if (int_literal(a, l) && int_literal(b, r) && fold_binary(code[i + 2].operand, l, r, res) &&
+                    fits_operand(res)) {
+                    a = instruct(a.address, LOAD_INT, (int) res);
+                    remove(i + 1);
+                    remove(i + 2);
+                    cnt++;
+                    i += 2;
+                    continue;
+                }
+                // x * 1, x + 0, x - 0
+                if (!has_inplace_ops && int_literal(b, r) &&
+                    ((r == 1 && code[i + 2].operand == 2) || (r == 0 && (code[i + 2].operand == 0 || code[i + 2].operand == 1)))) {
+                    remove(i + 1);
+                    remove(i + 2);
+                    cnt++;
+                    i += 2;
+                    continue;
+                }
+            }
+            if (!leader[i + 1] && int_literal(a, l)) {
+                if (b.code == UNARY_OP && b.operand == 0) {
+                    a = instruct(a.address, LOAD_INT, l ? 0 : 1);
+                } else if (b.code == UNARY_OP && b.operand == 1 && fits_operand(-l)) {
+                    a = instruct(a.address, LOAD_INT, (int) -l);
+                } else if (b.code == TYPE_CVT && b.operand == 0 && fits_operand(l)) {
+                    a = instruct(a.address, LOAD_INT, (int) l);
+                } else if (b.code == TYPE_CVT && b.operand == 1 && fits_operand(l)) {
+                    a = instruct(a.address, LOAD_FLOAT, (int) l);
+                } else {
+                    continue;
+                }
+                remove(i + 1);
+                cnt++;
+                i++;
+            }
+        }
+        return cnt;
+    }
+
+    int pass_copy_propagation() {
+        int cnt = 0, n = code.size();
+        // variable -> the pure push that produced its current value
+        std::unordered_map<long long, instruct> copies;
+        for (int i = 0; i < n; i++) {
+            if (leader[i]) copies.clear();
+            instruct &ins = code[i];
+            if (is_load(ins.code)) {
+                auto it = copies.find(var_key(ins));
+                if (it != copies.end()) {
+                    ins = instruct(ins.address, it->second.code, it->second.operand);
+                    cnt++;
+                }
+            } else if (is_store(ins.code)) {
+                long long key = var_key(ins);
+                for (auto it = copies.begin(); it != copies.end();) {
+                    if (it->first == key || (is_load(it->second.code) && var_key(it->second) == key)) {
+                        it = copies.erase(it);
+                    } else {
+                        ++it;
                     }
-                    case GETCH: {
-                        OP_PUSH(new slot((char_tp) getchar()));
-                        DISPATCH;
+                }
+                if (i == 0 || leader[i]) continue;
+                const instruct &src = code[i - 1];
+                if (is_pure_push(src.code) && !(is_load(src.code) && var_key(src) == key) &&
+                    (is_load(src.code) || !has_inplace_ops)) {
+                    copies[key] = src;
+                }
+            }
+        }
+        // STORE x; LOAD x => STORE_NOPOP x, and STORE_NOPOP x; POP_OP => STORE x
+        for (int i = 0; i + 1 < n; i++) {
+            instruct &a = code[i], &b = code[i + 1];
+            if (leader[i + 1] || !is_store(a.code)) continue;
+            if (!is_nopop(a.code) && is_load(b.code) && var_key(a) == var_key(b)) {
+                a.code = a.code == STORE_NAME ? STORE_NAME_NOPOP : STORE_NAME_GLOBAL_NOPOP;
+            } else if (is_nopop(a.code) && b.code == POP_OP) {
+                a.code = a.code == STORE_NAME_NOPOP ? STORE_NAME : STORE_NAME_GLOBAL;
+            } else {
+                continue;
+            }
+            remove(i + 1);
+            cnt++;
+            i++;
+        }
+        return cnt;
+    }
+
+    // Liveness of locals and globals over the whole program; a call is treated as a use of every global
+    // read inside any function, and a return as a use of every global.
+    int pass_dead_store() {
+        int n = code.size(), local_cnt = 0, global_cnt = 0;
+        for (const auto &ins : code) {
+            if (!is_load(ins.code) && !is_store(ins.code)) continue;
+            if (is_global(ins.code)) global_cnt = std::max(global_cnt, ins.operand + 1);
+            else local_cnt = std::max(local_cnt, ins.operand + 1);
+        }
+        int words = (local_cnt + global_cnt + 63) / 64;
+        if (!words) return 0;
+        auto bit = [&](const instruct &ins) { return is_global(ins.code) ? local_cnt + ins.operand : ins.operand; };
+
+        std::vector<int> roots;
+        for (const auto &ins : code) if (is_call(ins.code)) roots.push_back(target(ins));
+        for (const auto &e : prog.exports) roots.push_back(export_target(e));
+        std::vector<char> in_function = reachable_from(roots, true);
+        std::vector<uint64_t> escaped(words, 0), all_globals(words, 0);
+        for (int g = 0; g < global_cnt; g++) all_globals[(local_cnt + g) / 64] |= 1ull << ((local_cnt + g) % 64);
+        for (int i = 0; i < n; i++) {
+            if (in_function[i] && code[i].code == LOAD_NAME_GLOBAL) {
+                int b = bit(code[i]);
+                escaped[b / 64] |= 1ull << (b % 64);
+            }
+        }
+
+        std::vector<uint64_t> live_in((size_t) n * words, 0), live_out((size_t) n * words, 0);
+        std::vector<int> succ;
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (int i = n - 1; i >= 0; i--) {
+                const instruct &ins = code[i];
+                uint64_t *out = &live_out[(size_t) i * words], *in = &live_in[(size_t) i * words];
+                if (ins.code == RET) {
+                    std::copy(all_globals.begin(), all_globals.end(), out);
+                } else {
+                    successors(i, succ);
+                    for (int s : succ) {
+                        for (int w = 0; w < words; w++) out[w] |= live_in[(size_t) s * words + w];
                     }
-                    case STORE_GLOBAL: {
-                        slot *val = OP_POP();
-                        global_operands[++op_top] = val;
-                        if (verbose) {
-                            std::cout << "Pushed local value " << val->as_string() << " into global operands."
-                                      << std::endl;
-                        }
-                        DISPATCH;
+                }
+                std::vector<uint64_t> next(out, out + words);
+                if (is_store(ins.code)) {
+                    int b = bit(ins);
+                    next[b / 64] &= ~(1ull << (b % 64));
+                } else if (is_load(ins.code)) {
+                    int b = bit(ins);
+                    next[b / 64] |= 1ull << (b % 64);
+                } else if (is_call(ins.code) || switches_context(ins)) {
+                    for (int w = 0; w < words; w++) next[w] |= escaped[w];
+                }
+                for (int w = 0; w < words; w++) {
+                    if (next[w] != in[w]) {
+                        in[w] = next[w];
+                        changed = true;
                     }
-                    case LOAD_GLOBAL: {
-                        slot *val = global_operands[op_top];
-                        op_top--;
-                        OP_PUSH(val);
-                        if (verbose) {
-                            std::cout << "Pushed global value " << val->as_string() << " into local operands."
-                                      << std::endl;
+                }
+            }
+        }
+
+        int cnt = 0;
+        for (int i = 0; i < n; i++) {
+            instruct &ins = code[i];
+            if (!is_store(ins.code)) continue;
+            int b = bit(ins);
+            if (live_out[(size_t) i * words + b / 64] & (1ull << (b % 64))) continue;
+            if (is_nopop(ins.code)) remove(i);
+            else ins = instruct(ins.address, POP_OP, 0);
+            cnt++;
+        }
+        return cnt;
+    }
+
+    int pass_dead_code() {
+        int cnt = 0, n = code.size();
+        std::vector<int> roots(1, 0);
+        for (const auto &e : prog.exports) roots.push_back(export_target(e));
+        std::vector<char> live = reachable_from(roots, true);
+        for (int i = 1; i < n; i++) {
+            if (!live[i] && code[i].code != NOOP) {
+                remove(i);
+                cnt++;
+            }
+        }
+        for (int i = 0; i + 1 < n; i++) {
+            if (code[i].code == NOOP) continue;
+            // value pushed only to be popped
+            if (is_pure_push(code[i].code) && code[i + 1].code == POP_OP && !leader[i + 1]) {
+                remove(i);
+                remove(i + 1);
+                cnt++;
+                i++;
+            } else if (code[i].code == JMP && target(code[i]) == i + 1) {
+                remove(i);
+                cnt++;
+            }
+        }
+        return cnt;
+    }
+
+    int pass_jump_threading() {
+        int cnt = 0, n = code.size();
+        for (int i = 0; i < n; i++) {
+            instruct &ins = code[i];
+            if (!is_jump(ins.code)) continue;
+            int t = target(ins), hops = 0;
+            while (code[t].code == JMP && target(code[t]) != t && hops++ < n) t = target(code[t]);
+            if (code[t].address != ins.operand) {
+                ins.operand = code[t].address;
+                cnt++;
+            }
+            // A jump straight to RET or HALT does the same as the RET or HALT itself
+            if (ins.code == JMP && (code[t].code == RET || code[t].code == HALT)) {
+                ins = instruct(ins.address, code[t].code, 0);
+                cnt++;
+            }
+        }
+        return cnt;
+    }
+
+    int pass_branch_simplification() {
+        int cnt = 0, n = code.size();
+        for (int i = 0; i < n; i++) {
+            instruct &ins = code[i];
+            int_tp val;
+            if (i + 1 < n && !leader[i + 1] && (code[i + 1].code == JMP_TRUE || code[i + 1].code == JMP_FALSE) &&
+                int_literal(ins, val)) {
+                // constant condition
+                bool taken = (code[i + 1].code == JMP_TRUE) == (val != 0);
+                if (taken) {
+                    ins = instruct(ins.address, JMP, code[i + 1].operand);
+                } else {
+                    remove(i);
+                }
+                remove(i + 1);
+                cnt++;
+                i++;
+            } else if ((ins.code == JMP_TRUE || ins.code == JMP_FALSE) && target(ins) == i + 1) {
+                ins = instruct(ins.address, POP_OP, 0);
+                cnt++;
+            } else if ((ins.code == JMP_TRUE || ins.code == JMP_FALSE) && i + 2 < n && code[i + 1].code == JMP &&
+                       !targeted[i + 1] && target(ins) == i + 2) {
+                // JMP_TRUE A; JMP B; A: => JMP_FALSE B; A:
+                if (profile != nullptr) invert_taken(ins.address);
+                ins = instruct(ins.address, ins.code == JMP_TRUE ? JMP_FALSE : JMP_TRUE, code[i + 1].operand);
+                remove(i + 1);
+                cnt++;
+                i++;
+            }
+        }
+        return cnt;
+    }
+
+    // Range analysis for loops of the form
+    //   i = <literal >= 0>;
+    //   H: if (!(i < sizeof(a))) goto E;  ...  i = i + <literal >= 0>;  goto H;
+    // where a is never stored inside the loop. Between the test and any store to i, 0 <= i < sizeof(a),
+    // so a[i] in that region is rewritten to the unchecked subscript opcodes.
+    int pass_bounds_check_elimination() {
+        int cnt = 0, n = code.size();
+        if (has_inplace_ops) return 0;
+        for (int e = 0; e < n; e++) {
+            if (code[e].code != JMP) continue;
+            int h = target(code[e]);
+            if (h < 2 || h + 5 > e) continue;
+            const instruct &iv = code[h], &arr = code[h + 1];
+            if (!is_load(iv.code) || !is_load(arr.code) || code[h + 2].code != SIZE_OF ||
+                code[h + 3].code != BINARY_OP || code[h + 3].operand != 10 || code[h + 4].code != JMP_FALSE ||
+                leader[h + 1] || leader[h + 2] || leader[h + 3] || leader[h + 4]) {
+                continue;
+            }
+            long long iv_key = var_key(iv), arr_key = var_key(arr);
+            if (iv_key == arr_key) continue;
+            // i is a non-negative int on loop entry, and the loop is only entered through its test
+            int_tp val;
+            const instruct &init = code[h - 1];
+            if (!is_store(init.code) || var_key(init) != iv_key || leader[h - 1] || !int_literal(code[h - 2], val) ||
+                val < 0) {
+                continue;
+            }
+            bool ok = true;
+            for (int j = 0; j < n && ok; j++) {
+                if ((is_jump(code[j].code) || is_call(code[j].code)) && (j < h || j > e)) {
+                    int t = target(code[j]);
+                    if (t > h && t <= e) ok = false;
+                    if (t == h) ok = false;
+                }
+            }
+            // inside the loop: a is never stored, i only grows, and calls cannot touch globals we rely on
+            for (int j = h; j <= e && ok; j++) {
+                const instruct &ins = code[j];
+                if ((is_call(ins.code) || switches_context(ins) || ins.code == PUSH) &&
+                    (is_global(iv.code) || is_global(arr.code))) ok = false;
+                if (!is_store(ins.code)) continue;
+                if (var_key(ins) == arr_key) ok = false;
+                if (var_key(ins) == iv_key) {
+                    ok = j >= 3 && !leader[j - 2] && !leader[j - 1] && !leader[j] &&
+                         is_load(code[j - 3].code) && var_key(code[j - 3]) == iv_key &&
+                         int_literal(code[j - 2], val) && val >= 0 &&
+                         code[j - 1].code == BINARY_OP && code[j - 1].operand == 0;
+                }
+            }
+            if (!ok) continue;
+            // forward "i < sizeof(a) still holds" analysis over the loop body
+            int body = h + 5;
+            std::vector<char> safe(e - body + 1, 1);
+            bool changed = true;
+            while (changed) {
+                changed = false;
+                for (int j = body; j <= e; j++) {
+                    bool in = true;
+                    if (j > body) {
+                        const instruct &prev = code[j - 1];
+                        bool falls = prev.code != JMP && prev.code != RET && prev.code != HALT;
+                        if (falls) {
+                            in = safe[j - 1 - body] && !(is_store(prev.code) && var_key(prev) == iv_key);
+                        } else if (!targeted[j]) {
+                            in = false;
                         }
-                        DISPATCH;
                     }
-                    case BUILD_ARR: {
-                        basic_data_types type = VOID;
-                        if (ins.operand == 0) {
-                            type = INT;
-                        } else if (ins.operand == 1) {
-                            type = FLOAT;
-                        } else if (ins.operand == 2) {
-                            type = CHAR;
-                        } else {
-                            panic("Unexpected type");
-                        }
-                        int val = OP_POP()->int_val;
-                        slot *tmp = new slot(val, type);
-                        OP_PUSH(tmp);
-                        if (verbose) {
-                            std::cout << "Built array " << ins.operand << "[" << val << "]." << std::endl;
+                    if (targeted[j] && j > body) {
+                        for (int k = h; k <= e && in; k++) {
+                            if (!is_jump(code[k].code) || target(code[k]) != j) continue;
+                            if (k < body) {
+                                in = false;
+                            } else {
+                                in = safe[k - body] && !(is_store(code[k].code) && var_key(code[k]) == iv_key);
+                            }
                         }
-                        DISPATCH;
                     }
-                    case BINARY_SUBSCR: {
-                        /*
-                         * e.g.
-                         * LOAD_NAME a
-                         * LOAD_INT 4
-                         * BINARY_SUBSCR
-                         */
-                        slot *source = OP_POP();
-                        slot *target = OP_POP();
-                        int subscr = source->int_val;
-                        if (subscr < 0 || subscr >= target->array_size) {
-                            panic("Array index out of bound");
-                        }
-                        slot *fresh = OP_PUSH(*(target->array_val + subscr));
-                        if (verbose) {
-                            std::cout << "Loaded element with index " << subscr << " of the array." << std::endl;
-                        }
-                        SLOT_DECREF(source, "Binary-subscr array index decref");
-                        SLOT_INCREF(fresh, "Array value is referenced");
-                        DISPATCH;
+                    if (in != (bool) safe[j - body]) {
+                        safe[j - body] = in;
+                        changed = true;
                     }
-                    case STORE_SUBSCR:
-                    case STORE_SUBSCR_INPLACE:
-                    case STORE_SUBSCR_NOPOP: {
-                        /*
-                         * e.g.
-                         * LOAD_NAME a
-                         * LOAD_INT 4
-                         * LOAD_INT 5
-                         * a[4] = 5;
-                         */
-                        slot *val = OP_POP();
-                        slot *p_subscr = OP_POP();
-                        int subscr = p_subscr->int_val;
-                        slot *target = OP_TOP();
-                        if (subscr < 0 || subscr >= target->array_size) {
-                            panic("Array index out of bound");
-                        }
-                        SLOT_DECREF(target->array_val[subscr], "Array element store subscr");
-                        target->array_val[subscr] = val;
-                        if (verbose) {
-                            std::cout << "Changed element with index " << subscr << " of the array to "
-                                      << val->as_string() << "." << std::endl;
-                        }
+                }
+            }
+            for (int q = body; q <= e; q++) {
+                int index_pos, target_pos;
+                if (code[q].code == BINARY_SUBSCR) {
+                    index_pos = producer(q, 0);
+                    target_pos = producer(q, 1);
+                } else if (code[q].code == STORE_SUBSCR) {
+                    index_pos = producer(q, 1);
+                    target_pos = producer(q, 2);
+                } else {
+                    continue;
+                }
+                if (index_pos < body || target_pos < body || !safe[index_pos - body] ||
+                    !is_load(code[index_pos].code) || var_key(code[index_pos]) != iv_key ||
+                    !is_load(code[target_pos].code) || var_key(code[target_pos]) != arr_key) {
+                    continue;
+                }
+                code[q].code = code[q].code == BINARY_SUBSCR ? BINARY_SUBSCR_UNCHECKED : STORE_SUBSCR_UNCHECKED;
+                cnt++;
+            }
+        }
+        return cnt;
+    }
+
+    // Subscripts of flattened 2-d arrays, a[i][j] of an array declared [n][s]:
+    //   a; <i>; LOAD_INT s; BINARY_OP *; <j>; (LOAD_INT 1; BINARY_OP *;) BINARY_OP +; BINARY_SUBSCR
+    // become a; <i>; <j>; SUBSCR_2D s (and likewise STORE_SUBSCR => STORE_SUBSCR_2D s).
+    int pass_subscript_fusion() {
+        int cnt = 0, n = code.size();
+        for (int q = 0; q < n; q++) {
+            if (code[q].code != BINARY_SUBSCR && code[q].code != STORE_SUBSCR) continue;
+            int plus = producer(q, code[q].code == STORE_SUBSCR ? 1 : 0);
+            if (plus < 1 || code[plus].code != BINARY_OP || code[plus].operand != 0) continue;
+            // <j>, possibly multiplied by 1
+            int_tp one;
+            bool times_one = code[plus - 1].code == BINARY_OP && code[plus - 1].operand == 2 && plus >= 2 &&
+                             int_literal(code[plus - 2], one) && one == 1;
+            int mul = producer(plus, 1);
+            if (mul < 1 || code[mul].code != BINARY_OP || code[mul].operand != 2) continue;
+            int_tp stride;
+            if (producer(mul, 0) != mul - 1 || !int_literal(code[mul - 1], stride) || stride <= 0 ||
+                !fits_operand(stride)) continue;
+            // <j> starts right after the multiplication; nothing may jump into the sequence
+            bool one_block = true;
+            for (int k = mul; k <= q; k++) {
+                if (leader[k]) one_block = false;
+            }
+            if (!one_block) continue;
+            remove(mul - 1);
+            remove(mul);
+            if (times_one) {
+                remove(plus - 2);
+                remove(plus - 1);
+            }
+            remove(plus);
+            code[q] = instruct(code[q].address, code[q].code == BINARY_SUBSCR ? SUBSCR_2D : STORE_SUBSCR_2D,
+                               (int) stride);
+            cnt++;
+        }
+        return cnt;
+    }
+
+    // Char array literals are built one element at a time:
+    //   LOAD_INT n; BUILD_ARR 2; (LOAD_INT i; LOAD_CONSTANT c; STORE_SUBSCR_INPLACE)*
+    // The whole run becomes LOAD_STRING k of an interned string constant.
+    int pass_string_interning() {
+        int cnt = 0, n = code.size();
+        for (int i = 0; i + 1 < n; i++) {
+            int_tp size;
+            if (code[i + 1].code != BUILD_ARR || code[i + 1].operand != CHAR || leader[i + 1] ||
+                !int_literal(code[i], size) || size < 0) continue;
+            std::string bytes(size, '\0');
+            int j = i + 2;
+            while (j + 2 < n && !leader[j] && !leader[j + 1] && !leader[j + 2] &&
+                   code[j + 2].code == STORE_SUBSCR_INPLACE) {
+                int_tp idx;
+                int ch;
+                if (!int_literal(code[j], idx) || idx < 0 || idx >= size || !char_literal(code[j + 1], ch)) break;
+                bytes[idx] = (char) ch;
+                j += 3;
+            }
+            if (j == i + 2) continue;
+            code[i] = instruct(code[i].address, LOAD_STRING, intern_string(bytes));
+            for (int k = i + 1; k < j; k++) remove(k);
+            cnt++;
+        }
+        return cnt;
+    }
+
+    long long taken(int address) const {
+        auto it = profile->taken_at.find(address);
+        return it == profile->taken_at.end() ? 0 : it->second;
+    }
+
+    // The branch at address now jumps where it used to fall through
+    void invert_taken(int address) {
+        profile->taken_at[address] = profile->count(address) - taken(address);
+    }
+
+    // Every address in the profile must be an instruction of the input, of the kind the profile says
+    void check_profile() {
+        auto check = [&](int address, bool (*kind)(instruct_code)) {
+            auto it = index_of.find(address);
+            if (it == index_of.end() || (kind != nullptr && !kind(code[it->second].code))) {
+                panic("Profile does not match the program (address " + std::to_string(address) + ")");
+            }
+        };
+        for (const auto &x : profile->count_at) check(x.first, nullptr);
+        for (const auto &x : profile->calls_at) check(x.first, nullptr);
+        for (const auto &x : profile->taken_at) {
+            check(x.first, [](instruct_code c) { return c == JMP_TRUE || c == JMP_FALSE; });
+        }
+        for (const auto &x : profile->types_at) {
+            check(x.first, [](instruct_code c) { return c == BINARY_OP || c == BINARY_OP_INT || c == UNARY_OP; });
+        }
+    }
+
+    // Hot BINARY_OPs that only ever saw two ints
+    int pass_type_specialisation() {
+        int cnt = 0;
+        for (auto &ins : code) {
+            if (ins.code != BINARY_OP || profile->count(ins.address) < HOT) continue;
+            auto it = profile->types_at.find(ins.address);
+            if (it == profile->types_at.end() || it->second != Profile::type_bit(INT, INT)) continue;
+            ins.code = BINARY_OP_INT;
+            cnt++;
+        }
+        return cnt;
+    }
+
+    // Of the two arms of an if-else, only the one placed first needs a jump over the other:
+    //   JMP_FALSE E; <then>; JMP X; E: <else>; X:  =>  JMP_TRUE T; E: <else>; JMP X; T: <then>; X:
+    // when the profile says the then-arm is the hot one. Every fall-through edge is kept, if need be through
+    // the moved JMP X, so the arms may be any code.
+    int pass_branch_layout() {
+        int cnt = 0, n = code.size();
+        for (int i = 0; i < n; i++) {
+            instruct &ins = code[i];
+            if (ins.code != JMP_TRUE && ins.code != JMP_FALSE) continue;
+            long long runs = profile->count(ins.address), jumps = taken(ins.address);
+            if (runs < HOT || runs - jumps <= jumps) continue;
+            int e = target(ins);
+            if (e <= i + 2 || code[e - 1].code != JMP) continue;
+            int x = target(code[e - 1]);
+            if (x <= e) continue;
+            std::vector<instruct> arms(code.begin() + e, code.begin() + x);
+            arms.push_back(code[e - 1]);
+            arms.insert(arms.end(), code.begin() + i + 1, code.begin() + e - 1);
+            int then_address = code[i + 1].address;
+            std::copy(arms.begin(), arms.end(), code.begin() + i + 1);
+            invert_taken(ins.address);
+            ins = instruct(ins.address, ins.code == JMP_TRUE ? JMP_FALSE : JMP_TRUE, then_address);
+            analyse();
+            cnt++;
+        }
+        return cnt;
+    }
+
+    // Evaluates a loop test: no effect besides pushing
+    static bool loop_test(const instruct &ins) {
+        instruct_code c = ins.code;
+        return is_pure_push(c) || c == BINARY_OP || c == BINARY_OP_INT || (c == UNARY_OP && ins.operand <= 1) ||
+               c == SIZE_OF || c == TYPE_CVT || c == BINARY_SUBSCR || c == BINARY_SUBSCR_UNCHECKED;
+    }
+
+    // Hot loops test at the top and jump back at the bottom:
+    //   H: <test>; JMP_FALSE X; B: <body>; JMP H; X:  =>  H: <test>; JMP_FALSE X; B: <body>; <test>; JMP_TRUE B; X:
+    // which saves the JMP on every iteration. The copy of the test takes over the address of the JMP.
+    int pass_loop_rotation() {
+        int cnt = 0, n = code.size();
+        std::vector<instruct> rotated;
+        for (int j = 0; j < n; j++) {
+            const instruct &ins = code[j];
+            int h = ins.code == JMP ? target(ins) : j, t = h;
+            if (h < j && profile->count(ins.address) >= HOT) {
+                while (t < j && t - h < MAX_LOOP_TEST && (t == h || !leader[t]) && loop_test(code[t])) t++;
+            }
+            if (t == h || t + 1 >= j || leader[t] || (code[t].code != JMP_FALSE && code[t].code != JMP_TRUE) ||
+                target(code[t]) != j + 1) {
+                rotated.push_back(ins);
+                continue;
+            }
+            for (int k = h; k <= t; k++) {
+                int address = k == h ? ins.address : next_address++;
+                if (!line_at.empty()) line_at[address] = line_at[code[k].address];
+                if (k < t) rotated.emplace_back(address, code[k].code, code[k].operand);
+                else rotated.emplace_back(address, code[t].code == JMP_FALSE ? JMP_TRUE : JMP_FALSE, code[t + 1].address);
+            }
+            cnt++;
+        }
+        code.swap(rotated);
+        analyse();
+        return cnt;
+    }
+
+    // Hot functions small enough to inline, and hot pairs of instructions that could be fused into one.
+    // Only listed: a frame owns the reference counts of its locals, so bytecode cannot inline a call as is.
+    std::vector<std::string> candidates() {
+        std::vector<std::string> res;
+        std::vector<std::pair<long long, std::pair<int, int>>> calls;
+        for (const auto &x : profile->calls_at) {
+            if (x.second < HOT) continue;
+            std::vector<char> body = reachable_from({index_of[x.first]}, false);
+            int size = 0;
+            bool leaf = true;
+            for (size_t i = 0; i < code.size(); i++) {
+                if (!body[i]) continue;
+                size++;
+                if (is_call(code[i].code)) leaf = false;
+            }
+            if (leaf && size <= INLINE_SIZE) calls.push_back({-x.second, {x.first, size}});
+        }
+        std::sort(calls.begin(), calls.end());
+        for (size_t k = 0; k < calls.size() && k < 5; k++) {
+            int entry = calls[k].second.first;
+            auto named = std::find_if(functions.begin(), functions.end(), [entry](const std::pair<int, std::string> &f) {
+                return f.first == entry;
+            });
+            res.push_back("Inlining candidate #" + std::to_string(entry) +
+                          (named == functions.end() ? "" : " (" + named->second + ")") + ": " +
+                          std::to_string(-calls[k].first) + " calls, " + std::to_string(calls[k].second.second) +
+                          " instructions");
+        }
+        std::unordered_map<int, long long> pair_runs;
+        for (size_t i = 0; i + 1 < code.size(); i++) {
+            if (!leader[i + 1]) pair_runs[code[i].code << 8 | code[i + 1].code] += profile->count(code[i + 1].address);
+        }
+        std::vector<std::pair<long long, int>> pairs;
+        for (const auto &x : pair_runs) {
+            if (x.second >= HOT) pairs.emplace_back(-x.second, x.first);
+        }
+        std::sort(pairs.begin(), pairs.end());
+        for (size_t k = 0; k < pairs.size() && k < 5; k++) {
+            res.push_back("Superinstruction candidate " + Machine::inscode_name_mapping[pairs[k].second >> 8] + " + " +
+                          Machine::inscode_name_mapping[pairs[k].second & 255] + ": " +
+                          std::to_string(-pairs[k].first) + " runs");
+        }
+        return res;
+    }
 
-                        if (ins.code != STORE_SUBSCR_INPLACE) {
-                            OP_POP();
-                        }
-                        if (ins.code == STORE_SUBSCR_NOPOP) {
-                            OP_PUSH(val);
-                        }
-                        SLOT_DECREF(p_subscr, "Poped target subscr");
-                        DISPATCH;
-                    }
-                    default: {
-                        panic("Unexpected instruction");
-                        break;
-                    }
-                }
+    // Drop unused constants and give instructions consecutive addresses
+    void finalize() {
+        std::vector<int> const_map(prog.constants.size(), -1);
+        std::vector<constant_def> constants;
+        for (auto &ins : code) {
+            if (ins.code != LOAD_CONSTANT && ins.code != LOAD_STRING) continue;
+            if (const_map[ins.operand] == -1) {
+                const_map[ins.operand] = constants.size();
+                constants.push_back(prog.constants[ins.operand]);
             }
+            ins.operand = const_map[ins.operand];
         }
-        finish:
-        {
-            if (evaluator) {
-                finish = clock();
-                double time_delta = (double) (finish - start) / CLOCKS_PER_SEC;
-                std::cout << "<<<<<* Performance evaluator *>>>>>" << std::endl;
-                std::cout << n_ins << " instructions executed in total" << std::endl;
-                std::cout << "Time consumotion(s): " << std::fixed << std::setprecision(8) << time_delta << std::endl;
-                std::cout << "MIPS: " << std::fixed << std::setprecision(8) << (double) n_ins / time_delta * 1e-6 << std::endl;
+        prog.constants.swap(constants);
+        std::unordered_map<int, int> addr_map;
+        std::vector<int> lines;
+        for (size_t i = 0; i < code.size(); i++) {
+            addr_map[code[i].address] = 2 * i;
+            if (!line_at.empty()) lines.push_back(line_at[code[i].address]);
+        }
+        for (auto &ins : code) {
+            ins.address = addr_map[ins.address];
+            if (is_jump(ins.code) || is_call(ins.code)) ins.operand = addr_map[ins.operand];
+        }
+        for (auto &e : prog.exports) e.first = addr_map[e.first];
+        for (int &address : prog.memo) address = addr_map[address];
+        SourceMap source_map;
+        // A function removed as dead code leaves its name on the next one, which keeps its own
+        for (auto f = functions.rbegin(); f != functions.rend(); f++) {
+            auto it = addr_map.find(f->first);
+            if (it != addr_map.end()) source_map.add_function(it->second, f->second);
+        }
+        for (size_t i = 0; i < lines.size(); i++) {
+            if (i == 0 || lines[i] != lines[i - 1]) source_map.add_line(2 * i, lines[i]);
+        }
+        source_map.seal();
+        prog.source_map = source_map;
+    }
+
+public:
+    explicit Optimiser(program &_prog, Profile *_profile = nullptr) : prog(_prog), code(_prog.code), profile(_profile) {}
+
+    void optimise() {
+        typedef int (Optimiser::*pass_fn)();
+        struct pass {
+            const char *name;
+            pass_fn fn;
+            int rewrites;
+        } passes[] = {
+                {"constant-folding",      &Optimiser::pass_constant_folding,      0},
+                {"copy-propagation",      &Optimiser::pass_copy_propagation,      0},
+                {"dead-store",            &Optimiser::pass_dead_store,            0},
+                {"dead-code",             &Optimiser::pass_dead_code,             0},
+                {"jump-threading",        &Optimiser::pass_jump_threading,        0},
+                {"branch-simplification", &Optimiser::pass_branch_simplification, 0},
+                {"bounds-check-elimination", &Optimiser::pass_bounds_check_elimination, 0},
+                {"string-interning",      &Optimiser::pass_string_interning,      0},
+                {"subscript-fusion",      &Optimiser::pass_subscript_fusion,      0}
+        };
+        for (const auto &ins : code) {
+            if (ins.code == UNARY_OP && (ins.operand == 2 || ins.operand == 3)) has_inplace_ops = true;
+        }
+        // Once the others are done, as they only know BINARY_OP
+        pass profile_passes[] = {
+                {"type-specialisation",   &Optimiser::pass_type_specialisation,   0},
+                {"branch-layout",         &Optimiser::pass_branch_layout,         0},
+                {"loop-rotation",         &Optimiser::pass_loop_rotation,         0}
+        };
+        size_t ins_before = code.size(), const_before = prog.constants.size();
+        if (code.empty()) return;
+        functions = prog.source_map.function_entries();
+        if (!prog.source_map.line_entries().empty()) {
+            for (const auto &ins : code) line_at[ins.address] = prog.source_map.line(ins.address);
+        }
+        analyse();
+        if (profile != nullptr) check_profile();
+        for (int round = 0; round < 16; round++) {
+            int total = 0;
+            for (auto &p : passes) {
+                int cnt = (this->*p.fn)();
+                p.rewrites += cnt;
+                total += cnt;
+                compact();
+            }
+            if (!total) break;
+        }
+        std::vector<std::string> report;
+        if (profile != nullptr) {
+            for (const auto &ins : code) next_address = std::max(next_address, ins.address + 2);
+            for (auto &p : profile_passes) {
+                p.rewrites = (this->*p.fn)();
+                compact();
             }
+            report = candidates();
         }
+        finalize();
+        for (const auto &p : passes) {
+            std::cout << ":" << std::left << std::setw(26) << p.name << p.rewrites << " rewrite(s)" << std::endl;
+        }
+        if (profile != nullptr) {
+            for (const auto &p : profile_passes) {
+                std::cout << ":" << std::left << std::setw(26) << p.name << p.rewrites << " rewrite(s)" << std::endl;
+            }
+            // Addresses of the input
+            for (const std::string &line : report) std::cout << ":" << line << std::endl;
+        }
+        std::cout << ":Instructions " << ins_before << " -> " << code.size() << std::endl;
+        std::cout << ":Constants " << const_before << " -> " << prog.constants.size() << std::endl;
     }
 };
 
-std::unordered_map<std::string, instruct_code> Machine::string_inscode_mapping;
-int Machine::inscode_param_cnt_mapping[200];
+void optimise(const std::string &input_file_path, const std::string &out_file_path, const std::string &password) {
+    std::cout << "<<<<* SLang Bytecode Optimiser *>>>>" << std::endl;
+    program prog;
+    load_program_file(input_file_path, password, prog);
+    Profile profile;
+    if (!Profile::path.empty()) profile.load();
+    Optimiser(prog, Profile::path.empty() ? nullptr : &profile).optimise();
+    save_program_file(out_file_path, password, prog);
+}
 
-void interpret(std::istream &is, bool verbose, bool evaluate, bool in_interact) {
-    Machine machine = Machine();
-    if (verbose) {
-        machine.enable_verbose();
+// Ahead-of-time translation to C++ (-c)
+//
+// The linked program becomes one C++ function per slang function (every CALL target), plus the top level, with
+// a label for each jump target. Each function keeps its locals and its operand stack in local arrays, the
+// depth of the operand stack being worked out from the stack effect of every instruction, so the interpreter's
+// decoding, dispatch and frame handling disappear. Values stay in slots with the interpreter's reference counts:
+// the increment operators and arrays act on the slot that every variable holding it shares, so locals cannot
+// simply become C++ ints. The generated file defines SVM_AOT and includes svm.cpp as its runtime (slots,
+// natives, maps, input); build it with
+//   g++ -O2 -pthread -I <directory of svm.cpp> prog.cpp -o prog
+// Tasks and coroutines switch stacks inside the interpreter and cannot be translated.
+class Translator {
+private:
+    static const size_t LONG_FUNCTION = 2000;
+    std::ostream &out;
+    // Translated functions, written out once all of them are known
+    std::ostringstream code;
+    // Entry instruction of each function, in order of discovery; the top level first
+    std::vector<int> entries;
+    std::unordered_map<int, bool> is_entry;
+
+    static std::string name(int ip) {
+        return "L" + std::to_string(ip);
     }
-    if (evaluate) {
-        machine.enable_evaluator();
+
+    static std::string function(int ip) {
+        return "fn_" + std::to_string(ip);
     }
-    int addr;
-    while (is >> addr) {
-        if (in_interact && addr == -1) {
-            machine.dispatch();
-            break;
+
+    static void fail(int ip, const std::string &why) {
+        panic("Cannot translate " + Machine::inscode_name_mapping[instructs[ip].code] + " at address " +
+              std::to_string(instructs[ip].address) + ": " + why);
+    }
+
+    // Instructions that may run after ip in the same function
+    static std::vector<int> successors(int ip) {
+        const instruct &ins = instructs[ip];
+        switch (ins.code) {
+            case JMP:
+                return {ins.operand};
+            case JMP_TRUE: case JMP_FALSE:
+                return {ip + 1, ins.operand};
+            case RET: case HALT: case COROUTINE_END:
+                return {};
+            default:
+                return {ip + 1};
         }
-        instruct_code ins;
-        if (in_interact) {
-            std::string ins_str;
-            is >> ins_str;
-            ins = Machine::string_inscode_mapping[ins_str];
-        } else {
-            int ins_tmp;
-            is >> ins_tmp;
-            ins = instruct_code(ins_tmp);
+    }
+
+    // Operand stack effect inside a function, where calls and global operands are not on the local stack
+    static void effect(int ip, int &pops, int &pushes) {
+        const instruct &ins = instructs[ip];
+        pops = pushes = 0;
+        switch (ins.code) {
+            case PUSH: case HALT:
+                return;
+            case CALL: case LOAD_GLOBAL:
+                pushes = 1;
+                return;
+            case RET: case STORE_GLOBAL:
+                pops = 1;
+                return;
+            case CALL_NATIVE:
+                pops = native_table[ins.operand].argc;
+                pushes = native_table[ins.operand].result;
+                return;
+            default:
+                if (!Optimiser::stack_effect(ins, pops, pushes)) fail(ip, "not supported");
         }
-        if (ins == CONSTANT) {
-            int type;
-            is >> type;
-            switch (type) {
-                // int
-                case 0: {
-                    int_tp tmp;
-                    is >> tmp;
-                    constants[addr] = new slot(tmp);
+    }
+
+    // Instructions of the function entered at entry, in code order; finds the functions it calls
+    std::vector<int> body(int entry, bool top_level) {
+        std::vector<char> seen(instructs.size());
+        std::vector<int> todo = {entry}, res;
+        seen[entry] = 1;
+        while (!todo.empty()) {
+            int ip = todo.back();
+            todo.pop_back();
+            res.push_back(ip);
+            const instruct &ins = instructs[ip];
+            switch (ins.code) {
+                case SPAWN_CALL: case JOIN: case COROUTINE_CALL: case RESUME: case YIELD: case CO_STATUS:
+                case SCHEDULE: case BREAKPOINT:
+                    fail(ip, "tasks and coroutines need the interpreter");
                     break;
-                }
-                    // float
-                case 1: {
-                    float_tp tmp;
-                    is >> tmp;
-                    constants[addr] = new slot(tmp);
+                case COROUTINE_END:
+                    if (!top_level) fail(ip, "function does not return");
                     break;
-                }
-                    // char
-                case 2: {
-                    int tmp;
-                    is >> tmp;
-                    constants[addr] = new slot((char_tp) tmp);
+                case RET:
+                    if (top_level) fail(ip, "return from the top level");
+                    break;
+                case CALL_NATIVE:
+                    if (ins.operand < 0 || ins.operand >= NATIVE_CNT) fail(ip, "unknown native function");
+                    break;
+                case UNARY_OP:
+                    if (ins.operand < 0 || ins.operand > 3) fail(ip, "unknown operator");
+                    break;
+                case CALL:
+                    if (!is_entry[ins.operand]) {
+                        is_entry[ins.operand] = true;
+                        entries.push_back(ins.operand);
+                    }
+                    break;
+                default:
                     break;
+            }
+            for (int next : successors(ip)) {
+                if (!seen[next]) {
+                    seen[next] = 1;
+                    todo.push_back(next);
                 }
+            }
+        }
+        std::sort(res.begin(), res.end());
+        return res;
+    }
 
-                default: {
-                    panic("Unexpected type");
+    // Operand stack depth before each instruction of a function; returns the deepest it gets
+    int depths(int entry, std::unordered_map<int, int> &depth) {
+        std::vector<int> todo = {entry};
+        depth[entry] = 0;
+        int deepest = 0;
+        while (!todo.empty()) {
+            int ip = todo.back();
+            todo.pop_back();
+            int pops, pushes, d = depth[ip];
+            effect(ip, pops, pushes);
+            if (d < pops) fail(ip, "operand stack underflow");
+            deepest = std::max(deepest, d - pops + pushes);
+            for (int next : successors(ip)) {
+                auto it = depth.find(next);
+                if (it == depth.end()) {
+                    depth[next] = d - pops + pushes;
+                    todo.push_back(next);
+                } else if (it->second != d - pops + pushes) {
+                    fail(next, "operand stack depth differs between the paths reaching it");
                 }
             }
-            is >> constants[addr]->ref_cnt;
-            continue;
-        } else if (ins == CMALLOC) {
-            is >> constant_cnt;
-            if (constant_cnt) constants = new slot*[constant_cnt];
-            continue;
         }
-        int param_number = Machine::inscode_param_cnt_mapping[ins];
-        if (param_number) {
-            int param;
-            is >> param;
-            machine.add_instruct(instruct(addr, ins, param));
-        } else {
-            machine.add_instruct(instruct(addr, ins));
+        return deepest;
+    }
+
+    static std::string c_string(const char_tp *chars, int n) {
+        std::ostringstream s;
+        s << '"';
+        for (int i = 0; i < n; i++) {
+            auto c = (unsigned char) chars[i];
+            s << '\\' << (char) ('0' + (c >> 6)) << (char) ('0' + ((c >> 3) & 7)) << (char) ('0' + (c & 7));
         }
+        s << '"';
+        return s.str();
     }
-    if (!in_interact) machine.dispatch();
-}
 
-void interact(bool verbose, bool evaluate) {
-    interpret(std::cin, verbose, evaluate, true);
-}
+    static std::string constant_expr(slot *c) {
+        std::ostringstream s;
+        switch (c->type) {
+            case INT:
+                if (c->int_val == LLONG_MIN) s << "new slot((int_tp) LLONG_MIN)";
+                else s << "new slot((int_tp) " << c->int_val << "LL)";
+                break;
+            case FLOAT: {
+                uint64_t bits;
+                memcpy(&bits, &c->float_val, sizeof(bits));
+                s << "new slot(aot_float(0x" << std::hex << bits << std::dec << "ULL))";
+                break;
+            }
+            case CHAR:
+                s << "new slot((char_tp) " << (int) c->char_val << ")";
+                break;
+            case ARRAY:
+                s << "string_slot(" << c_string(c->chars(), c->array_size) << ", " << c->array_size << ")";
+                break;
+            default:
+                s << "new slot()";
+                break;
+        }
+        return s.str();
+    }
+
+    // One instruction. S and T name the operand stack and its top: the function's own, or the global operand
+    // stack at the top level, where (as in the interpreter) LOAD_GLOBAL and STORE_GLOBAL move nothing.
+    void emit(int ip, bool top_level, const std::vector<char> &targeted) {
+        const instruct &ins = instructs[ip];
+        const std::string S = top_level ? "aot_stack" : "stk", T = top_level ? "aot_top" : "top";
+        const std::string vars = top_level ? "globals" : "locals";
+        const std::string push = S + "[++" + T + "] = ", pop = S + "[" + T + "--]", tos = S + "[" + T + "]";
+        int n = ins.operand;
+        std::ostream &out = code;
+        if (targeted[ip]) out << name(ip) << ":\n";
+        out << "    // " << ins.address << " " << Machine::inscode_name_mapping[ins.code];
+        if (Machine::inscode_param_cnt_mapping[ins.code]) {
+            out << " " << (code_operand(ins.code) ? instructs[n].address : n);
+        }
+        out << "\n";
+        switch (ins.code) {
+            case VMALLOC:
+                if (top_level) out << "    grow_globals(" << n << ");\n";
+                break;
+            case NOOP: case PUSH:
+                break;
+            case POP_OP:
+                out << "    { slot *o = " << pop << "; aot_decref(o); }\n";
+                break;
+            case TYPE_CVT:
+                out << "    { slot *o = " << tos << "; " << tos << " = convert(" << n << ", o); aot_decref(o); }\n";
+                break;
+            case LOAD_NULL:
+                out << "    " << push << "new slot();\n";
+                break;
+            case LOAD_INT:
+                out << "    " << push << "new slot((int_tp) " << n << ");\n";
+                break;
+            case LOAD_FLOAT:
+                out << "    " << push << "new slot((float_tp) " << n << ");\n";
+                break;
+            case LOAD_CHAR:
+                out << "    " << push << "new slot((char_tp) " << n << ");\n";
+                break;
+            case SIZE_OF:
+                out << "    { slot *o = " << pop << "; int size = o->type != ARRAY ? 1 : o->array_size; aot_decref(o); "
+                    << push << "new slot((int_tp) size); }\n";
+                break;
+            case LOAD_CONSTANT:
+                out << "    { slot *c = constants[" << n << "]; " << push << "c; aot_incref(c); }\n";
+                break;
+            case LOAD_NAME: case LOAD_NAME_GLOBAL: {
+                std::string v = (ins.code == LOAD_NAME ? vars : "globals") + "[" + std::to_string(n) + "]";
+                out << "    { slot *v = " << v << "; " << push << "v; aot_incref(v); }\n";
+                break;
+            }
+            case STORE_NAME: case STORE_NAME_NOPOP: case STORE_NAME_GLOBAL: case STORE_NAME_GLOBAL_NOPOP: {
+                bool global = ins.code == STORE_NAME_GLOBAL || ins.code == STORE_NAME_GLOBAL_NOPOP;
+                bool nopop = ins.code == STORE_NAME_NOPOP || ins.code == STORE_NAME_GLOBAL_NOPOP;
+                std::string v = (global ? "globals" : vars) + "[" + std::to_string(n) + "]";
+                out << "    if (" << v << " != nullptr) aot_decref(" << v << ");\n";
+                out << "    " << v << " = " << (nopop ? tos : pop) << "; aot_incref(" << v << ");\n";
+                break;
+            }
+            case JMP:
+                out << "    goto " << name(n) << ";\n";
+                break;
+            case JMP_TRUE: case JMP_FALSE:
+                out << "    { slot *o = " << pop << "; bool c = " << (ins.code == JMP_TRUE ? "o->int_val != 0" : "o->int_val == 0")
+                    << "; aot_decref(o); if (c) goto " << name(n) << "; }\n";
+                break;
+            case UNARY_OP:
+                if (n <= 1) {
+                    out << "    { slot *o = " << tos << ", *r = unary_op(" << n << ", o); "
+                        << "if (r == nullptr) aot_error(\"Unsupported unary operator\"); " << tos << " = r; aot_decref(o); }\n";
+                } else {
+                    out << "    { slot *o = " << pop << "; o->int_val" << (n == 2 ? "++" : "--") << "; aot_decref(o); }\n";
+                }
+                break;
+            case BINARY_OP: case BINARY_OP_INT:
+                out << "    { slot *r = " << pop << ", *l = " << tos << ", *res = binary_op(" << n << ", l, r); "
+                    << "if (res == nullptr) aot_error(\"Unsupported binary operator\"); " << tos << " = res; "
+                    << "aot_decref(l); aot_decref(r); }\n";
+                break;
+            case HALT:
+                out << (top_level ? "    return false;\n" : "    aot_halt();\n");
+                break;
+            case PRINTK:
+                out << "    { slot *o = " << pop << "; std::cout << o->as_string() << std::endl; aot_decref(o); }\n";
+                break;
+            case PUTCH:
+                out << "    { slot *o = " << pop << "; std::cout << o->char_val; aot_decref(o); }\n";
+                break;
+            case GETCH:
+                out << "    " << push << "new slot((char_tp) vm_input.get());\n";
+                break;
+            case CALL_NATIVE: {
+                const native_entry &native = native_table[n];
+                out << "    { slot *r = native_table[" << n << "].fn(&" << tos << " - " << native.argc - 1 << ");";
+                for (int i = 0; i < native.argc; i++) out << " { slot *a = " << pop << "; aot_decref(a); }";
+                out << " if (r != nullptr) " << push << "r; }\n";
+                break;
+            }
+            case CALL:
+                out << "    { slot *r = " << function(n) << "(); " << push << "r; }\n";
+                break;
+            case RET:
+                out << "    { slot *r = " << pop << ";";
+                out << " while (top > -1) { slot *o = stk[top--]; aot_decref(o); }";
+                out << " for (slot *v : locals) aot_decref(v); return r; }\n";
+                break;
+            case STORE_GLOBAL:
+                if (!top_level) out << "    aot_stack[++aot_top] = " << pop << ";\n";
+                break;
+            case LOAD_GLOBAL:
+                if (!top_level) out << "    " << push << "aot_stack[aot_top--];\n";
+                break;
+            case LOAD_STRING:
+                out << "    " << push << "string_slot(constants[" << n << "]->chars(), constants[" << n << "]->array_size);\n";
+                break;
+            case BUILD_ARR: {
+                int elem = n & 15, dims = std::max(1, n >> 4);
+                if (elem > 2) fail(ip, "unexpected type");
+                std::string type = elem == 0 ? "INT" : elem == 1 ? "FLOAT" : "CHAR";
+                if (dims == 1) {
+                    out << "    { int size = " << pop << "->int_val; " << push << "new slot(size, " << type << "); }\n";
+                    break;
+                }
+                out << "    { int *shape = new int[" << dims + 1 << "]; shape[0] = " << dims << "; int_tp size = 1;\n"
+                    << "      for (int d = " << dims << "; d >= 1; d--) { slot *e = " << pop << "; "
+                    << "if (e->int_val < 0) aot_error(\"Negative array size\"); shape[d] = (int) e->int_val; size *= e->int_val; "
+                    << "if (size > INT32_MAX) aot_error(\"Array too large\"); aot_decref(e); }\n"
+                    << "      slot *a = new slot((int) size, " << type << "); a->shape = shape; " << push << "a; }\n";
+                break;
+            }
+            case BINARY_SUBSCR: case BINARY_SUBSCR_UNCHECKED:
+                out << "    { slot *i = " << pop << ", *a = " << pop << "; int k = i->int_val; ";
+                if (ins.code == BINARY_SUBSCR) out << "if (k < 0 || k >= a->array_size) aot_error(\"Array index out of bound\"); ";
+                out << push << "a->element(k); aot_decref(i); }\n";
+                break;
+            case STORE_SUBSCR: case STORE_SUBSCR_INPLACE: case STORE_SUBSCR_NOPOP: case STORE_SUBSCR_UNCHECKED:
+                out << "    { slot *v = " << pop << ", *i = " << pop << ", *a = " << tos << "; int k = i->int_val; ";
+                if (ins.code != STORE_SUBSCR_UNCHECKED) out << "if (k < 0 || k >= a->array_size) aot_error(\"Array index out of bound\"); ";
+                out << "a->set_element(k, v); ";
+                if (ins.code != STORE_SUBSCR_INPLACE) out << T << "--; ";
+                if (ins.code == STORE_SUBSCR_NOPOP) out << push << "v; ";
+                else out << "aot_decref(v); ";
+                out << "aot_decref(i); }\n";
+                break;
+            case SUBSCR_2D:
+                out << "    { slot *j = " << pop << ", *i = " << pop << ", *a = " << pop << "; "
+                    << push << "a->element(a->index_2d(i->int_val, j->int_val, " << n << ")); "
+                    << "aot_decref(i); aot_decref(j); }\n";
+                break;
+            case STORE_SUBSCR_2D:
+                out << "    { slot *v = " << pop << ", *j = " << pop << ", *i = " << pop << ", *a = " << pop << "; "
+                    << "a->set_element(a->index_2d(i->int_val, j->int_val, " << n << "), v); "
+                    << "aot_decref(v); aot_decref(i); aot_decref(j); }\n";
+                break;
+            case BUILD_MAP: {
+                int value = n & 15, key = n >> 4;
+                if (value > CHAR || (key != INT && key != CHAR)) fail(ip, "unexpected type");
+                out << "    " << push << "new slot(new hash_map((basic_data_types) " << key << ", (basic_data_types) " << value << "));\n";
+                break;
+            }
+            case MAP_GET: case MAP_HAS:
+                out << "    { slot *k = " << pop << ", *t = " << pop << "; if (t->type != MAP) aot_error(\"Not a map\"); "
+                    << "hash_map *m = t->map_val; int i = m->find(m->key_of(k)); ";
+                if (ins.code == MAP_HAS) out << push << "new slot(i >= 0); ";
+                else out << "if (i < 0) aot_error(\"Map key not found\"); " << push << "m->value_slot(m->value(i)); ";
+                out << "aot_decref(k); aot_decref(t); }\n";
+                break;
+            case MAP_PUT:
+                out << "    { slot *v = " << pop << ", *k = " << pop << ", *t = " << pop << "; if (t->type != MAP) aot_error(\"Not a map\"); "
+                    << "t->map_val->put(t->map_val->key_of(k), t->map_val->word_of(v)); "
+                    << "aot_decref(v); aot_decref(k); aot_decref(t); }\n";
+                break;
+            case MAP_DEL:
+                out << "    { slot *k = " << pop << ", *t = " << pop << "; if (t->type != MAP) aot_error(\"Not a map\"); "
+                    << "t->map_val->erase(t->map_val->key_of(k)); aot_decref(k); aot_decref(t); }\n";
+                break;
+            case MAP_SIZE:
+                out << "    { slot *t = " << pop << "; if (t->type != MAP) aot_error(\"Not a map\"); "
+                    << push << "new slot((int_tp) t->map_val->size); aot_decref(t); }\n";
+                break;
+            case COROUTINE_END:
+                out << "    return false;\n";
+                break;
+            default:
+                fail(ip, "not supported");
+        }
+    }
 
-void assemble(const std::string& raw_file_path, const std::string& out_file_path, std::string password) {
-    std::ifstream raw_file(raw_file_path, std::ios::in);
-    std::ofstream out_file(out_file_path, std::ios::out | std::ios::trunc);
+    // Splits the top level into pieces of about LONG_FUNCTION instructions that no jump crosses. It keeps
+    // nothing in C++ locals, so each piece can be a function of its own: gcc needs minutes for a function of
+    // tens of thousands of statements (typically straight-line initialisation code).
+    static std::vector<std::vector<int>> pieces(const std::vector<int> &ips) {
+        std::unordered_map<int, int> position;
+        for (size_t k = 0; k < ips.size(); k++) position[ips[k]] = (int) k;
+        // crossing[k] > 0: some jump crosses the boundary between ips[k - 1] and ips[k]
+        std::vector<int> crossing(ips.size() + 1);
+        for (size_t k = 0; k < ips.size(); k++) {
+            const instruct &ins = instructs[ips[k]];
+            if (ins.code != JMP && ins.code != JMP_TRUE && ins.code != JMP_FALSE) continue;
+            int target = position[ins.operand];
+            crossing[std::min((int) k, target) + 1]++;
+            crossing[std::max((int) k, target) + 1]--;
+        }
+        std::vector<std::vector<int>> res(1);
+        int crossed = 0;
+        for (size_t k = 0; k < ips.size(); k++) {
+            crossed += crossing[k];
+            if (crossed == 0 && res.back().size() >= LONG_FUNCTION) res.emplace_back();
+            res.back().push_back(ips[k]);
+        }
+        return res;
+    }
 
-    std::cout << "<<<<* SLang Virtual Machine Assembler *>>>>" << std::endl;
-    std::stringstream buf;
-    int addr;
-    buf << MAGIC;
-    while (raw_file >> addr) {
-        std::string ins_str;
-        raw_file >> ins_str;
-        std::cout << ":Generating " << ins_str << " at " << addr << "..." << std::endl;
-        instruct_code ins = Machine::string_inscode_mapping[ins_str];
-        int param_number = Machine::inscode_param_cnt_mapping[ins];
-        buf << addr << " " << ins << " ";
-        while (param_number--) {
-            std::string param;
-            raw_file >> param;
-            buf << param << " ";
+    void emit_function(int entry, bool top_level) {
+        std::ostream &out = code;
+        std::vector<int> ips = body(entry, top_level);
+        std::vector<char> targeted(instructs.size());
+        int var_cnt = 1;
+        for (int ip : ips) {
+            const instruct &ins = instructs[ip];
+            if (ins.code == JMP || ins.code == JMP_TRUE || ins.code == JMP_FALSE) targeted[ins.operand] = 1;
+            if (ins.code == VMALLOC) var_cnt = std::max(var_cnt, ins.operand);
         }
+        if (top_level) {
+            // Each piece returns false once the program has ended
+            std::vector<std::vector<int>> parts = pieces(ips);
+            for (size_t k = 0; k < parts.size(); k++) {
+                if (parts[k].size() > LONG_FUNCTION) out << "__attribute__((cold)) ";
+                out << "static bool top_level_" << k << "() {\n";
+                for (int ip : parts[k]) emit(ip, true, targeted);
+                out << "    return true;\n";
+                out << "}\n\n";
+            }
+            out << "static void top_level() {\n";
+            for (size_t k = 0; k < parts.size(); k++) out << "    if (!top_level_" << k << "()) return;\n";
+            out << "}\n\n";
+            return;
+        }
+        std::unordered_map<int, int> depth;
+        int deepest = std::max(1, depths(entry, depth));
+        // A function is not split; a long one is optimised for size instead, which gcc builds much faster
+        out << "// " << source_map.function(instructs[entry].address) << "\n";
+        if (ips.size() > LONG_FUNCTION) out << "__attribute__((cold)) ";
+        out << "static slot *" << function(entry) << "() {\n";
+        out << "    slot *locals[" << var_cnt << "] = {};\n";
+        out << "    slot *stk[" << deepest << "];\n";
+        out << "    int top = -1;\n";
+        for (int ip : ips) emit(ip, false, targeted);
+        out << "}\n\n";
     }
 
-    std::string s = buf.str();
-    password = MAGIC + password;
-    int len = password.length();
-    std::cout << ":Encrypting bytecode..." << std::endl;
-    for (int i = 0; i < s.length(); i++) s[i] = (unsigned int) s[i] ^ (unsigned int) password[i % len];
-    out_file << s;
+public:
+    explicit Translator(std::ostream &_out) : out(_out) {}
 
-    raw_file.close();
-    out_file.close();
-}
+    void translate(const std::string &source) {
+        int start = module_starts.size() > 1 ? module_starts[1] : 0;
+        out << "// Translated by svm -c from " << source << "\n"
+            << "// Build: g++ -O2 -pthread -I <directory of svm.cpp> <this file> -o <program>\n"
+            << "#define SVM_AOT\n"
+            << "#include \"svm.cpp\"\n\n";
+        // Functions are found while their callers are translated; declare them all before the first
+        entries.push_back(start);
+        is_entry[start] = true;
+        for (size_t k = 0; k < entries.size(); k++) emit_function(entries[k], k == 0);
+        for (size_t k = 1; k < entries.size(); k++) out << "static slot *" << function(entries[k]) << "();\n";
+        out << "\n" << code.str();
+        out << "static void load_constants() {\n";
+        if (constant_cnt) out << "    constants = new slot *[" << constant_cnt << "]();\n";
+        out << "    constant_cnt = " << constant_cnt << ";\n";
+        for (int i = 0; i < constant_cnt; i++) {
+            if (constants[i] == nullptr) continue;
+            out << "    constants[" << i << "] = " << constant_expr(constants[i]) << ";\n";
+            out << "    constants[" << i << "]->ref_cnt = " << constants[i]->ref_cnt << ";\n";
+        }
+        out << "}\n\n";
+        out << "int main(int argc, char *argv[]) {\n"
+            << "    return aot_main(argc, argv, load_constants, top_level);\n"
+            << "}\n";
+    }
+};
 
-void run(const std::string& input_file_path, bool verbose, bool evaluate, std::string password) {
-    std::ifstream input_file(input_file_path, std::ios::in);
-    std::string content((std::istreambuf_iterator<char>(input_file)),
-                        (std::istreambuf_iterator<char>()));
-    password = MAGIC + password;
-    int len = password.length();
-    for (int i = 0; i < content.length(); i++) content[i] = (unsigned int) content[i] ^ (unsigned int) password[i % len];
-    std::stringstream ss(content);
+// Translate a program, with more modules linked after it, to C++
+void translate(const std::string &input_file_path, const std::vector<std::string> &module_paths,
+               const std::string &out_file_path, const std::string &password) {
+    TokenReader program(input_file_path, MAGIC + password);
     std::string hd;
-    ss >> hd;
-    interpret(ss, verbose, evaluate, false);
+    program >> hd;
+    if (hd + " " != MAGIC) {
+        panic("Not a bytecode file (or wrong password): " + input_file_path);
+    }
+    Machine machine;
+    load_module(program, machine, false);
+    load_modules(module_paths, machine, password);
+    // Calls go through the global operand stack, which the translation keeps
+    machine.link(false);
+    std::ofstream os(out_file_path, std::ios::out | std::ios::trunc);
+    Translator(os).translate(input_file_path);
 }
 
-void disassemble(const std::string& input_file_path, std::string password) {
-    std::ifstream input_file(input_file_path, std::ios::in);
-    std::string content((std::istreambuf_iterator<char>(input_file)),
-                        (std::istreambuf_iterator<char>()));
-    std::string code_name_mapping[200];
-    for (const auto& x : Machine::string_inscode_mapping) {
-        code_name_mapping[x.second] = x.first;
-    }
-    password = MAGIC + password;
-    int len = password.length();
-    for (int i = 0; i < content.length(); i++) content[i] = ((unsigned int) content[i]) ^ ((unsigned int) password[i % len]);
-    std::stringstream ss(content);
-    std::string hd;
-    ss >> hd;
-    int addr;
-    while (ss >> addr) {
-        std::cout << addr << " ";
-        int ins_tmp;
-        instruct_code ins;
-        ss >> ins_tmp;
-        ins = instruct_code(ins_tmp);
-        std::cout << code_name_mapping[ins] << " ";
-        int param_number = Machine::inscode_param_cnt_mapping[ins];
-        while (param_number--) {
-            std::string param;
-            ss >> param;
-            std::cout << param << " ";
+#ifdef SVM_AOT
+// Runtime of a program translated to C++ (-c), which defines SVM_AOT and includes this file
+
+// Global operand stack: arguments on their way into a function, and the operands of the top level
+slot **aot_stack = nullptr;
+int aot_top = -1;
+
+float_tp aot_float(uint64_t bits) {
+    float_tp f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// Reference counts as in the interpreter, never atomic (a translated program has no tasks). Freeing is out of
+// line, so each of the many decrements in a translated function stays small.
+__attribute__((noinline)) void aot_release(slot *s) {
+    delete s;
+}
+
+inline void aot_incref(slot *s) {
+    s->ref_cnt++;
+}
+
+inline void aot_decref(slot *s) {
+    if (s != nullptr && !--s->ref_cnt) aot_release(s);
+}
+
+__attribute__((noinline, cold)) void aot_error(const char *msg) {
+    panic(msg);
+}
+
+// HALT inside a function
+void aot_halt() {
+    exit(0);
+}
+
+// The program runs on the control stack of a stack segment, so the guard page below it catches a runaway
+// recursion the way it does in the interpreter; the fault handler reports it from an alternate stack.
+int aot_main(int argc, char *argv[], void (*load_constants)(), void (*top_level)()) {
+    int o;
+    while ((o = getopt(argc, argv, "k:")) != -1) {
+        if (o == 'k') {
+            StackSegment::limit = (size_t) std::max(1, atoi(optarg)) << 20;
+        } else {
+            std::cout << "Usage: " << argv[0] << " (-k MB) -- stack limit, 64 by default" << std::endl;
+            return 1;
         }
-        std::cout << std::endl;
     }
+    load_constants();
+    StackSegment stack;
+    stack.enter();
+    aot_stack = stack.operands;
+    static char handler_stack[1 << 16];
+    stack_t alt{};
+    alt.ss_sp = handler_stack;
+    alt.ss_size = sizeof(handler_stack);
+    sigaltstack(&alt, nullptr);
+    ucontext_t caller{}, program{};
+    getcontext(&program);
+    program.uc_stack.ss_sp = stack.frames;
+    program.uc_stack.ss_size = stack.frame_bytes;
+    program.uc_link = &caller;
+    makecontext(&program, top_level, 0);
+    swapcontext(&caller, &program);
+    return 0;
 }
-
+#else
 int main(int argc, char *argv[]) {
     Machine::load_param_mapping();
     enum run_mode {
         RUN,
         INTERACT,
         DISASSEMBLE,
-        ASSEMBLE
+        ASSEMBLE,
+        OPTIMISE,
+        DECODE_TRACE,
+        TRANSLATE
     };
     run_mode rm = RUN;
-    char const *optstring = "r:d:a:ivo:p:eh";
+    char const *optstring = "r:d:a:O:x:c:ivgo:p:j:s:m:k:t:l:P:w:Mefh";
     std::string input_path;
     std::string output_path;
     std::string password;
+    std::vector<std::string> module_paths;
     bool verbose = false;
     bool evaluate = false;
+    bool profile = false;
+    bool debug = false;
     int o;
     while ((o = getopt(argc, argv, optstring)) != -1) {
         switch (o) {
             case 'e':
                 evaluate = true;
                 break;
+            case 'f':
+                profile = true;
+                break;
             case 'r':
                 rm = RUN;
                 input_path.assign(optarg);
@@ -1265,30 +7386,107 @@ int main(int argc, char *argv[]) {
                 rm = ASSEMBLE;
                 input_path.assign(optarg);
                 break;
+            case 'O':
+                rm = OPTIMISE;
+                input_path.assign(optarg);
+                break;
+            case 'c':
+                rm = TRANSLATE;
+                input_path.assign(optarg);
+                break;
             case 'v':
                 verbose = true;
                 break;
+            case 'g':
+                debug = true;
+                break;
             case 'o':
                 output_path.assign(optarg);
                 break;
             case 'p':
                 password.assign(optarg);
                 break;
+            case 'j':
+                TaskPool::thread_cnt = atoi(optarg);
+                break;
+            case 's':
+                Snapshot::path.assign(optarg);
+                break;
+            case 'm':
+                module_paths.emplace_back(optarg);
+                break;
+            case 't':
+                Trace::path.assign(optarg);
+                break;
+            case 'P':
+                Profile::path.assign(optarg);
+                break;
+            case 'x':
+                rm = DECODE_TRACE;
+                input_path.assign(optarg);
+                break;
+            case 'l': {
+                std::string limit(optarg);
+                size_t eq = limit.find('=');
+                std::string name = limit.substr(0, eq);
+                double value = eq == std::string::npos ? 0 : atof(limit.c_str() + eq + 1);
+                if (name == "ins") {
+                    Quota::instructions = (long long) value;
+                } else if (name == "time") {
+                    Quota::seconds = value;
+                } else if (name == "mem") {
+                    Quota::memory = (long long) (value * (1 << 20));
+                } else if (name == "depth") {
+                    Quota::depth = (int) value;
+                } else {
+                    std::cout << "Unknown limit " << name << " (ins, time, mem or depth)" << std::endl;
+                    return 1;
+                }
+                break;
+            }
+            case 'M':
+                memo_all = true;
+                break;
+            case 'w':
+                LiveStats::counting = true;
+                if (strcmp(optarg, "-") == 0) break;
+                LiveStats::fd = open(optarg, O_WRONLY | O_CREAT | O_APPEND, 0644);
+                if (LiveStats::fd < 0) {
+                    std::cout << "Cannot open " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case 'k':
+                StackSegment::limit = (size_t) std::max(1, atoi(optarg)) << 20;
+                break;
             case 'h':
             default:
                 std::cout <<
                  "\n"
                  "Usage:\n"
-                 "$ svm -r (-e) ./helloworld.slb (-v) (-p password) -- Run program (-v: in verbose mode, -e: performance evaluator)\n"
+                 "$ svm -r (-e (-f) (-P profile)) ./helloworld.slb (-v) (-g) (-p password) (-j threads) (-s snapshot) (-m module.slb ...) (-k MB) (-t trace) (-l limit=value ...) (-w stats) (-M) -- Run program (-v: in verbose mode, -g: debugger, -e: performance evaluator, -f: with -e, counters per function, -P: with -e, record a profile for svm -O, -j: task threads, -s: start from/save a post-initialisation snapshot, -m: link more modules, -k: stack limit of each coroutine, 64 by default, -t: record an execution trace, -l: quota, one of ins=instructions, time=seconds, mem=MB, depth=calls, -w: count instructions for the statistics printed on SIGUSR1, and append them to a file (- for stderr), -M: memoise every pure function)\n"
                  "$ svm -d ./helloworld.slb (-p password) -- Disassembly\n"
                  "$ svm -i (-v) (-e) -- Interact Mode (-v: in verbose mode, -e: performance evaluator)\n"
-                 "$ svm -a ./helloworld.txt -o ./helloworld.slb (-p password) -- Assembly input file\n" << std::endl;
+                 "$ svm -a ./helloworld.txt -o ./helloworld.slb (-p password) (-v) -- Assembly input file (-v: show progress)\n"
+                 "$ svm -O ./helloworld.slb -o ./helloworld.opt.slb (-p password) (-P profile) -- Optimise bytecode (.sli or .slb input, -P: guided by a profile)\n"
+                 "$ svm -x ./trace.bin (-v) -- Decode an execution trace (-v: every record instead of a summary)\n"
+                 "$ svm -c ./helloworld.slb -o ./helloworld.cpp (-p password) (-m module.slb ...) -- Translate to C++, then build with g++ -O2 -pthread -I <directory of svm.cpp> helloworld.cpp -o helloworld\n" << std::endl;
                 break;
         }
     }
+    if (!Trace::path.empty() && (verbose || debug) && (rm == RUN || rm == INTERACT)) {
+        // Only the plain and evaluator loops record a trace
+        std::cout << "-t cannot be combined with -v or -g" << std::endl;
+        return 1;
+    }
+    if (debug && TaskPool::thread_cnt > 0) {
+        std::cout << "-g cannot be combined with -j" << std::endl;
+        return 1;
+    }
+    Quota::start(LiveStats::counting);
     switch (rm) {
         case RUN:
-            run(input_path, verbose, evaluate, password);
+            run(input_path, module_paths, verbose, evaluate, profile, debug, password);
             break;
         case INTERACT:
             Machine::load_name_code_mapping();
@@ -1296,11 +7494,24 @@ int main(int argc, char *argv[]) {
             break;
         case ASSEMBLE:
             Machine::load_name_code_mapping();
-            assemble(input_path, output_path, password);
+            assemble(input_path, output_path, password, verbose);
             break;
         case DISASSEMBLE:
             Machine::load_name_code_mapping();
             disassemble(input_path, password);
             break;
+        case OPTIMISE:
+            Machine::load_name_code_mapping();
+            optimise(input_path, output_path, password);
+            break;
+        case DECODE_TRACE:
+            Machine::load_name_code_mapping();
+            decode_trace(input_path, verbose);
+            break;
+        case TRANSLATE:
+            Machine::load_name_code_mapping();
+            translate(input_path, module_paths, output_path, password);
+            break;
     }
 }
+#endif